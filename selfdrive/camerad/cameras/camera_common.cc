@@ -1,20 +1,28 @@
 #include "selfdrive/camerad/cameras/camera_common.h"
 
+#include <sched.h>
+#include <sys/resource.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cassert>
 #include <cstdio>
+#include <cstring>
 #include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <thread>
 
 #include "libyuv.h"
 #include <jpeglib.h>
 
+#include "selfdrive/camerad/imgproc/image_stats.h"
 #include "selfdrive/camerad/imgproc/utils.h"
 #include "selfdrive/common/clutil.h"
 #include "selfdrive/common/modeldata.h"
 #include "selfdrive/common/params.h"
 #include "selfdrive/common/swaglog.h"
+#include "selfdrive/common/timing.h"
 #include "selfdrive/common/util.h"
 #include "selfdrive/hardware/hw.h"
 
@@ -82,6 +90,9 @@ void CameraBuf::init(cl_device_id device_id, cl_context context, CameraState *s,
   const CameraInfo *ci = &s->ci;
   camera_state = s;
   frame_buf_count = frame_cnt;
+  assert(frame_buf_count <= CAMERA_QUEUE_SIZE);
+  // without an OpenCL device (no GPU on PC) the image pipeline runs on the CPU
+  use_cpu = device_id == nullptr;
 
   // RAW frame
   const int frame_size = ci->frame_height * ci->frame_stride;
@@ -90,7 +101,9 @@ void CameraBuf::init(cl_device_id device_id, cl_context context, CameraState *s,
 
   for (int i = 0; i < frame_buf_count; i++) {
     camera_bufs[i].allocate(frame_size);
-    camera_bufs[i].init_cl(device_id, context);
+    if (!use_cpu) {
+      camera_bufs[i].init_cl(device_id, context);
+    }
   }
 
   rgb_width = ci->frame_width;
@@ -109,20 +122,38 @@ void CameraBuf::init(cl_device_id device_id, cl_context context, CameraState *s,
 
   vipc_server->create_buffers(yuv_type, YUV_BUFFER_COUNT, false, rgb_width, rgb_height);
 
+  if (use_cpu) {
+    // only the 2x downscaling debayer.cl has a CPU port
+    assert(!(ci->bayer && Hardware::TICI()));
+    if (ci->bayer) {
+      debayer_cpu = std::make_unique<DebayerCpu>(ci->frame_stride, rgb_width, rgb_height, rgb_stride, ci->bayer_flip, ci->hdr);
+    }
+    rgb2yuv_cpu = std::make_unique<Rgb2YuvCpu>(rgb_width, rgb_height, rgb_stride);
+    return;
+  }
+
   if (ci->bayer) {
     debayer = new Debayer(device_id, context, this, s);
   }
   rgb2yuv = std::make_unique<Rgb2Yuv>(context, device_id, rgb_width, rgb_height, rgb_stride);
 
+  // profiling gives the per-stage device times
 #ifdef __APPLE__
-  q = CL_CHECK_ERR(clCreateCommandQueue(context, device_id, 0, &err));
+  q = CL_CHECK_ERR(clCreateCommandQueue(context, device_id, CL_QUEUE_PROFILING_ENABLE, &err));
 #else
-  const cl_queue_properties props[] = {0};  //CL_QUEUE_PRIORITY_KHR, CL_QUEUE_PRIORITY_HIGH_KHR, 0};
+  const cl_queue_properties props[] = {CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0};  //CL_QUEUE_PRIORITY_KHR, CL_QUEUE_PRIORITY_HIGH_KHR, 0};
   q = CL_CHECK_ERR(clCreateCommandQueueWithProperties(context, device_id, props, &err));
 #endif
 }
 
 CameraBuf::~CameraBuf() {
+  for (auto &f : pipeline) {
+    if (f.yuv_event) {
+      CL_CHECK(clWaitForEvents(1, &f.yuv_event));
+      CL_CHECK(clReleaseEvent(f.debayer_event));
+      CL_CHECK(clReleaseEvent(f.yuv_event));
+    }
+  }
   for (int i = 0; i < frame_buf_count; i++) {
     camera_bufs[i].free();
   }
@@ -130,39 +161,90 @@ CameraBuf::~CameraBuf() {
   if (q) CL_CHECK(clReleaseCommandQueue(q));
 }
 
-bool CameraBuf::acquire() {
-  if (!safe_queue.try_pop(cur_buf_idx, 1)) return false;
-
-  if (camera_bufs_metadata[cur_buf_idx].frame_id == -1) {
-    LOGE("no frame data? wtf");
-    release();
-    return false;
-  }
-
-  cur_frame_data = camera_bufs_metadata[cur_buf_idx];
-  cur_rgb_buf = vipc_server->get_buffer(rgb_type);
-  cl_mem camrabuf_cl = camera_bufs[cur_buf_idx].buf_cl;
-  cl_event event;
+static uint64_t cl_event_end_ns(cl_event event) {
+  cl_ulong end = 0;
+  CL_CHECK(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL));
+  return end;
+}
 
-  if (debayer) {
-    float gain = 0.0;
+// queue the debayer (or copy) and rgb2yuv of a frame, chained by events without waiting on the host
+void CameraBuf::enqueue(int buf_idx) {
+  PipelineFrame f = {
+    .buf_idx = buf_idx,
+    .frame_data = camera_bufs_metadata[buf_idx],
+    .rgb_buf = vipc_server->get_buffer(rgb_type),
+    .yuv_buf = vipc_server->get_buffer(yuv_type),
+  };
+  FrameTiming &timing = f.frame_data.timing;
+  timing.dequeued = nanos_since_boot();
 
+  float gain = 0.0;
 #ifndef QCOM2
-    gain = camera_state->digital_gain;
-    if ((int)gain == 0) gain = 1.0;
+  gain = camera_state->digital_gain;
+  if ((int)gain == 0) gain = 1.0;
 #endif
 
-    debayer->queue(q, camrabuf_cl, cur_rgb_buf->buf_cl, rgb_width, rgb_height, gain, &event);
+  if (use_cpu) {
+    const uint8_t *camera_buf = (const uint8_t *)camera_bufs[buf_idx].addr;
+    if (debayer_cpu) {
+      debayer_cpu->run(camera_buf, (uint8_t *)f.rgb_buf->addr, gain);
+    } else {
+      assert(rgb_stride == camera_state->ci.frame_stride);
+      memcpy(f.rgb_buf->addr, camera_buf, f.rgb_buf->len);
+    }
+    timing.debayered = nanos_since_boot();
+
+    rgb2yuv_cpu->run((const uint8_t *)f.rgb_buf->addr, (uint8_t *)f.yuv_buf->addr);
+    timing.converted = nanos_since_boot();
   } else {
-    assert(rgb_stride == camera_state->ci.frame_stride);
-    CL_CHECK(clEnqueueCopyBuffer(q, camrabuf_cl, cur_rgb_buf->buf_cl, 0, 0, cur_rgb_buf->len, 0, 0, &event));
+    cl_mem camrabuf_cl = camera_bufs[buf_idx].buf_cl;
+    if (debayer) {
+      debayer->queue(q, camrabuf_cl, f.rgb_buf->buf_cl, rgb_width, rgb_height, gain, &f.debayer_event);
+    } else {
+      assert(rgb_stride == camera_state->ci.frame_stride);
+      CL_CHECK(clEnqueueCopyBuffer(q, camrabuf_cl, f.rgb_buf->buf_cl, 0, 0, f.rgb_buf->len, 0, 0, &f.debayer_event));
+    }
+    rgb2yuv->queue(q, f.rgb_buf->buf_cl, f.yuv_buf->buf_cl, 1, &f.debayer_event, &f.yuv_event);
+    // submit now, so it runs while the previous frame is processed
+    CL_CHECK(clFlush(q));
   }
+  pipeline.push_back(f);
+}
 
-  clWaitForEvents(1, &event);
-  CL_CHECK(clReleaseEvent(event));
+bool CameraBuf::acquire() {
+  // queue every frame that's ready, up to the pipeline depth. the CPU path does the work
+  // in enqueue(), queueing more than one frame there would only delay the first
+  const size_t depth = use_cpu ? 1 : CAMERA_PIPELINE_DEPTH;
+  int buf_idx;
+  while (pipeline.size() < depth && safe_queue.try_pop(buf_idx, pipeline.empty() ? 1 : 0)) {
+    if (camera_bufs_metadata[buf_idx].frame_id == -1) {
+      LOGE("no frame data? wtf");
+      cur_buf_idx = buf_idx;
+      release();
+      continue;
+    }
+    enqueue(buf_idx);
+  }
+  if (pipeline.empty()) return false;
+
+  // the oldest frame goes out first, the in-order queue finishes its kernels first too
+  PipelineFrame f = pipeline.front();
+  pipeline.pop_front();
+  if (f.yuv_event) {
+    CL_CHECK(clWaitForEvents(1, &f.yuv_event));
+    // device clocks aren't host clocks, place the debayer end relative to now using the device times
+    FrameTiming &timing = f.frame_data.timing;
+    timing.converted = nanos_since_boot();
+    const uint64_t rgb2yuv_ns = cl_event_end_ns(f.yuv_event) - cl_event_end_ns(f.debayer_event);
+    timing.debayered = std::max(timing.dequeued, timing.converted - rgb2yuv_ns);
+    CL_CHECK(clReleaseEvent(f.debayer_event));
+    CL_CHECK(clReleaseEvent(f.yuv_event));
+  }
 
-  cur_yuv_buf = vipc_server->get_buffer(yuv_type);
-  rgb2yuv->queue(q, cur_rgb_buf->buf_cl, cur_yuv_buf->buf_cl);
+  cur_buf_idx = f.buf_idx;
+  cur_frame_data = f.frame_data;
+  cur_rgb_buf = f.rgb_buf;
+  cur_yuv_buf = f.yuv_buf;
 
   VisionIpcBufExtra extra = {
                         cur_frame_data.frame_id,
@@ -173,10 +255,44 @@ bool CameraBuf::acquire() {
   cur_yuv_buf->set_frame_id(cur_frame_data.frame_id);
   vipc_server->send(cur_rgb_buf, &extra);
   vipc_server->send(cur_yuv_buf, &extra);
+  cur_frame_data.timing.sent = nanos_since_boot();
 
+  if (timing_ring.empty()) timing_ring.resize(CAMERA_STATS_FRAMES);
+  timing_ring[frames_sent++ % CAMERA_STATS_FRAMES] = cur_frame_data;
+  if (frames_sent % CAMERA_STATS_FRAMES == 0) {
+    log_stats();
+  }
   return true;
 }
 
+// p50/p99/max of the time spent in each stage over the ring
+void CameraBuf::log_stats() {
+  auto summary = [this](const char *name, auto stage_ns) {
+    std::vector<uint64_t> ns;
+    ns.reserve(timing_ring.size());
+    for (const auto &frame : timing_ring) {
+      // skips unset eofs, and eofs on a different clock than nanos_since_boot
+      if (uint64_t t = stage_ns(frame); t < 10e9) ns.push_back(t);
+    }
+    if (ns.empty()) return std::string();
+
+    std::sort(ns.begin(), ns.end());
+    return util::string_format(" %s p50 %.2f p99 %.2f max %.2f,", name,
+                               ns[ns.size() / 2] / 1e6, ns[std::min(ns.size() - 1, ns.size() * 99 / 100)] / 1e6, ns.back() / 1e6);
+  };
+
+  std::string stats;
+  stats += summary("eof to dequeue", [](auto &f) { return f.timestamp_eof ? f.timing.dequeued - f.timestamp_eof : UINT64_MAX; });
+  stats += summary(camera_state->ci.bayer ? "debayer" : "copy", [](auto &f) { return f.timing.debayered - f.timing.dequeued; });
+  stats += summary("rgb2yuv", [](auto &f) { return f.timing.converted - f.timing.debayered; });
+  stats += summary("send", [](auto &f) { return f.timing.sent - f.timing.converted; });
+  stats += summary("eof to sent", [](auto &f) { return f.timestamp_eof ? f.timing.sent - f.timestamp_eof : UINT64_MAX; });
+  if (stats.empty()) return;
+
+  stats.pop_back();
+  LOG("camera %d frame latency ms:%s", camera_state->camera_num, stats.c_str());
+}
+
 void CameraBuf::release() {
   if (release_callback) {
     release_callback((void*)camera_state, cur_buf_idx);
@@ -187,6 +303,29 @@ void CameraBuf::queue(size_t buf_idx) {
   safe_queue.push(buf_idx);
 }
 
+void CameraBuf::write_camera_buf(size_t buf_idx, const void *data, size_t size) {
+  auto &buf = camera_bufs[buf_idx];
+  if (use_cpu) {
+    memcpy(buf.addr, data, size);
+  } else {
+    CL_CHECK(clEnqueueWriteBuffer(buf.copy_q, buf.buf_cl, CL_TRUE, 0, size, data, 0, NULL, NULL));
+  }
+}
+
+uint8_t *CameraBuf::map_camera_buf(size_t buf_idx) {
+  auto &buf = camera_bufs[buf_idx];
+  if (use_cpu) return (uint8_t *)buf.addr;
+  // the cl buffer wraps buf.addr, so mapping it doesn't copy
+  return (uint8_t *)CL_CHECK_ERR(clEnqueueMapBuffer(buf.copy_q, buf.buf_cl, CL_TRUE, CL_MAP_WRITE, 0, buf.len, 0, NULL, NULL, &err));
+}
+
+void CameraBuf::unmap_camera_buf(size_t buf_idx, uint8_t *ptr) {
+  auto &buf = camera_bufs[buf_idx];
+  if (use_cpu) return;
+  CL_CHECK(clEnqueueUnmapMemObject(buf.copy_q, buf.buf_cl, ptr, 0, NULL, NULL));
+  CL_CHECK(clFinish(buf.copy_q));
+}
+
 // common functions
 
 void fill_frame_data(cereal::FrameData::Builder &framed, const FrameMetadata &frame_data) {
@@ -217,126 +356,171 @@ kj::Array<uint8_t> get_frame_image(const CameraBuf *b) {
   const int y_max = env_ymax != -1 ? env_ymax : b->rgb_height - 1;
   const int new_width = (x_max - x_min + 1) / scale;
   const int new_height = (y_max - y_min + 1) / scale;
-  const uint8_t *dat = (const uint8_t *)b->cur_rgb_buf->addr;
+  const uint8_t *dat = (const uint8_t *)b->cur_rgb_buf->addr + x_min * 3 + y_min * b->rgb_stride;
 
   kj::Array<uint8_t> frame_image = kj::heapArray<uint8_t>(new_width*new_height*3);
-  uint8_t *resized_dat = frame_image.begin();
-  int goff = x_min*3 + y_min*b->rgb_stride;
-  for (int r=0;r<new_height;r++) {
-    for (int c=0;c<new_width;c++) {
-      memcpy(&resized_dat[(r*new_width+c)*3], &dat[goff+r*b->rgb_stride*scale+c*3*scale], 3*sizeof(uint8_t));
-    }
+  if (scale == 1) {
+    libyuv::CopyPlane(dat, b->rgb_stride, frame_image.begin(), new_width * 3, new_width * 3, new_height);
+  } else {
+    // libyuv only scales 4 byte pixels, the rgb round trip through ARGB keeps the byte order
+    const int crop_width = new_width * scale, crop_height = new_height * scale;
+    std::vector<uint8_t> argb(crop_width * crop_height * 4), scaled(new_width * new_height * 4);
+    libyuv::RGB24ToARGB(dat, b->rgb_stride, argb.data(), crop_width * 4, crop_width, crop_height);
+    libyuv::ARGBScale(argb.data(), crop_width * 4, crop_width, crop_height,
+                      scaled.data(), new_width * 4, new_width, new_height, libyuv::kFilterNone);
+    libyuv::ARGBToRGB24(scaled.data(), new_width * 4, frame_image.begin(), new_width * 3, new_width, new_height);
   }
   return kj::mv(frame_image);
 }
 
-static kj::Array<capnp::byte> yuv420_to_jpeg(const CameraBuf *b, int thumbnail_width, int thumbnail_height) {
-  // make the buffer big enough. jpeg_write_raw_data requires 16-pixels aligned height to be used.
-  std::unique_ptr<uint8[]> buf(new uint8_t[(thumbnail_width * ((thumbnail_height + 15) & ~15) * 3) / 2]);
-  uint8_t *y_plane = buf.get();
-  uint8_t *u_plane = y_plane + thumbnail_width * thumbnail_height;
-  uint8_t *v_plane = u_plane + (thumbnail_width * thumbnail_height) / 4;
-  {
+// Publishes road camera thumbnails without stalling frame delivery. The processing thread only
+// takes a point sampled downscale of the planes, the JPEG encode and send run on a worker
+// at the lowest priority, reusing one compressor.
+class ThumbnailPublisher {
+public:
+  ThumbnailPublisher(PubMaster *pm, int width, int height) : pm(pm), width(width), height(height) {
+    // jpeg_write_raw_data takes 16 line blocks, pad the planes to a 16 pixel aligned height
+    const size_t size = (width * ((height + 15) & ~15) * 3) / 2;
+    snapshot.resize(size);
+    encode_buf.resize(size);
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_colorspace(&cinfo, JCS_YCbCr);
+    // configure sampling factors for yuv420.
+    cinfo.comp_info[0].h_samp_factor = 2;  // Y
+    cinfo.comp_info[0].v_samp_factor = 2;
+    cinfo.comp_info[1].h_samp_factor = 1;  // U
+    cinfo.comp_info[1].v_samp_factor = 1;
+    cinfo.comp_info[2].h_samp_factor = 1;  // V
+    cinfo.comp_info[2].v_samp_factor = 1;
+    cinfo.raw_data_in = TRUE;
+    jpeg_set_quality(&cinfo, 50, TRUE);
+
+    thread = std::thread(&ThumbnailPublisher::encoder_thread, this);
+  }
+
+  ~ThumbnailPublisher() {
+    {
+      std::lock_guard lk(lock);
+      stop = true;
+    }
+    cv.notify_one();
+    thread.join();
+    jpeg_destroy_compress(&cinfo);
+  }
+
+  // replaces a snapshot the worker hasn't picked up yet
+  void queue(const CameraBuf *b) {
+    std::unique_lock lk(lock);
+    uint8_t *y_plane = snapshot.data();
+    uint8_t *u_plane = y_plane + width * height;
+    uint8_t *v_plane = u_plane + (width * height) / 4;
     int result = libyuv::I420Scale(
         b->cur_yuv_buf->y, b->rgb_width, b->cur_yuv_buf->u, b->rgb_width / 2, b->cur_yuv_buf->v, b->rgb_width / 2,
         b->rgb_width, b->rgb_height,
-        y_plane, thumbnail_width, u_plane, thumbnail_width / 2, v_plane, thumbnail_width / 2,
-        thumbnail_width, thumbnail_height, libyuv::kFilterNone);
+        y_plane, width, u_plane, width / 2, v_plane, width / 2,
+        width, height, libyuv::kFilterNone);
     if (result != 0) {
       LOGE("Generate YUV thumbnail failed.");
-      return {};
+      return;
     }
+    frame_id = b->cur_frame_data.frame_id;
+    timestamp_eof = b->cur_frame_data.timestamp_eof;
+    pending = true;
+    lk.unlock();
+    cv.notify_one();
   }
 
-  struct jpeg_compress_struct cinfo;
-  struct jpeg_error_mgr jerr;
-  cinfo.err = jpeg_std_error(&jerr);
-  jpeg_create_compress(&cinfo);
-
-  uint8_t *thumbnail_buffer = nullptr;
-  size_t thumbnail_len = 0;
-  jpeg_mem_dest(&cinfo, &thumbnail_buffer, &thumbnail_len);
-
-  cinfo.image_width = thumbnail_width;
-  cinfo.image_height = thumbnail_height;
-  cinfo.input_components = 3;
-
-  jpeg_set_defaults(&cinfo);
-  jpeg_set_colorspace(&cinfo, JCS_YCbCr);
-  // configure sampling factors for yuv420.
-  cinfo.comp_info[0].h_samp_factor = 2;  // Y
-  cinfo.comp_info[0].v_samp_factor = 2;
-  cinfo.comp_info[1].h_samp_factor = 1;  // U
-  cinfo.comp_info[1].v_samp_factor = 1;
-  cinfo.comp_info[2].h_samp_factor = 1;  // V
-  cinfo.comp_info[2].v_samp_factor = 1;
-  cinfo.raw_data_in = TRUE;
-
-  jpeg_set_quality(&cinfo, 50, TRUE);
-  jpeg_start_compress(&cinfo, TRUE);
-
-  JSAMPROW y[16], u[8], v[8];
-  JSAMPARRAY planes[3]{y, u, v};
-
-  for (int line = 0; line < cinfo.image_height; line += 16) {
-    for (int i = 0; i < 16; ++i) {
-      y[i] = y_plane + (line + i) * cinfo.image_width;
-      if (i % 2 == 0) {
-        int offset = (cinfo.image_width / 2) * ((i + line) / 2);
-        u[i / 2] = u_plane + offset;
-        v[i / 2] = v_plane + offset;
-      }
-    }
-    jpeg_write_raw_data(&cinfo, planes, 16);
-  }
-
-  jpeg_finish_compress(&cinfo);
-  jpeg_destroy_compress(&cinfo);
-
-  kj::Array<capnp::byte> dat = kj::heapArray<capnp::byte>(thumbnail_buffer, thumbnail_len);
-  free(thumbnail_buffer);
-  return dat;
-}
-
-static void publish_thumbnail(PubMaster *pm, const CameraBuf *b) {
-  auto thumbnail = yuv420_to_jpeg(b, b->rgb_width / 4, b->rgb_height / 4);
-  if (thumbnail.size() == 0) return;
-
-  MessageBuilder msg;
-  auto thumbnaild = msg.initEvent().initThumbnail();
-  thumbnaild.setFrameId(b->cur_frame_data.frame_id);
-  thumbnaild.setTimestampEof(b->cur_frame_data.timestamp_eof);
-  thumbnaild.setThumbnail(thumbnail);
+private:
+  void encoder_thread() {
+    util::set_thread_name("camerad_thumbnail");
+#ifdef __linux__
+    // don't inherit camerad's realtime priority. on linux, 0 is the calling thread for both
+    struct sched_param sa = {};
+    sched_setscheduler(0, SCHED_OTHER, &sa);
+    setpriority(PRIO_PROCESS, 0, 19);
+#endif
 
-  pm->send("thumbnail", msg);
-}
+    while (true) {
+      uint32_t cur_frame_id;
+      uint64_t cur_timestamp_eof;
+      {
+        std::unique_lock lk(lock);
+        cv.wait(lk, [this] { return pending || stop; });
+        if (stop) break;
+        encode_buf.swap(snapshot);
+        cur_frame_id = frame_id;
+        cur_timestamp_eof = timestamp_eof;
+        pending = false;
+      }
 
-float set_exposure_target(const CameraBuf *b, int x_start, int x_end, int x_skip, int y_start, int y_end, int y_skip) {
-  int lum_med;
-  uint32_t lum_binning[256] = {0};
-  const uint8_t *pix_ptr = b->cur_yuv_buf->y;
-
-  unsigned int lum_total = 0;
-  for (int y = y_start; y < y_end; y += y_skip) {
-    for (int x = x_start; x < x_end; x += x_skip) {
-      uint8_t lum = pix_ptr[(y * b->rgb_width) + x];
-      lum_binning[lum]++;
-      lum_total += 1;
+      kj::Array<capnp::byte> thumbnail = encode();
+      MessageBuilder msg;
+      auto thumbnaild = msg.initEvent().initThumbnail();
+      thumbnaild.setFrameId(cur_frame_id);
+      thumbnaild.setTimestampEof(cur_timestamp_eof);
+      thumbnaild.setThumbnail(thumbnail);
+      pm->send("thumbnail", msg);
     }
   }
 
+  kj::Array<capnp::byte> encode() {
+    uint8_t *y_plane = encode_buf.data();
+    uint8_t *u_plane = y_plane + width * height;
+    uint8_t *v_plane = u_plane + (width * height) / 4;
+
+    uint8_t *thumbnail_buffer = nullptr;
+    size_t thumbnail_len = 0;
+    jpeg_mem_dest(&cinfo, &thumbnail_buffer, &thumbnail_len);
+    jpeg_start_compress(&cinfo, TRUE);
+
+    JSAMPROW y[16], u[8], v[8];
+    JSAMPARRAY planes[3]{y, u, v};
+
+    for (int line = 0; line < cinfo.image_height; line += 16) {
+      for (int i = 0; i < 16; ++i) {
+        y[i] = y_plane + (line + i) * cinfo.image_width;
+        if (i % 2 == 0) {
+          int offset = (cinfo.image_width / 2) * ((i + line) / 2);
+          u[i / 2] = u_plane + offset;
+          v[i / 2] = v_plane + offset;
+        }
+      }
+      jpeg_write_raw_data(&cinfo, planes, 16);
+    }
 
-  // Find mean lumimance value
-  unsigned int lum_cur = 0;
-  for (lum_med = 255; lum_med >= 0; lum_med--) {
-    lum_cur += lum_binning[lum_med];
+    jpeg_finish_compress(&cinfo);
 
-    if (lum_cur >= lum_total / 2) {
-      break;
-    }
+    kj::Array<capnp::byte> dat = kj::heapArray<capnp::byte>(thumbnail_buffer, thumbnail_len);
+    free(thumbnail_buffer);
+    return dat;
   }
 
-  return lum_med / 256.0;
+  PubMaster *pm;
+  const int width, height;
+  struct jpeg_compress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  std::thread thread;
+
+  std::mutex lock;
+  std::condition_variable cv;
+  std::vector<uint8_t> snapshot, encode_buf;
+  uint32_t frame_id = 0;
+  uint64_t timestamp_eof = 0;
+  bool pending = false, stop = false;
+};
+
+float set_exposure_target(const CameraBuf *b, int x_start, int x_end, int x_skip, int y_start, int y_end, int y_skip) {
+  const StatsRect rect = {x_start, x_end, x_skip, y_start, y_end, y_skip};
+  ImageStats stats;
+  image_stats(b->cur_yuv_buf->y, b->rgb_width, &rect, &stats, 1);
+  return stats.percentile(50) / 256.0;
 }
 
 extern ExitHandler do_exit;
@@ -352,15 +536,19 @@ void *processing_thread(MultiCameraState *cameras, CameraState *cs, process_thre
   }
   util::set_thread_name(thread_name);
 
+  std::unique_ptr<ThumbnailPublisher> thumbnail;
+  if (cs == &(cameras->road_cam) && cameras->pm) {
+    thumbnail = std::make_unique<ThumbnailPublisher>(cameras->pm, cs->buf.rgb_width / 4, cs->buf.rgb_height / 4);
+  }
+
   uint32_t cnt = 0;
   while (!do_exit) {
     if (!cs->buf.acquire()) continue;
 
     callback(cameras, cs, cnt);
 
-    if (cs == &(cameras->road_cam) && cameras->pm && cnt % 100 == 3) {
-      // this takes 10ms???
-      publish_thumbnail(cameras->pm, &(cs->buf));
+    if (thumbnail && cnt % 100 == 3) {
+      thumbnail->queue(&(cs->buf));
     }
     cs->buf.release();
     ++cnt;
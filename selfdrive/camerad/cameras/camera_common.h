@@ -2,16 +2,19 @@
 
 #include <cstdint>
 #include <cstdlib>
+#include <deque>
 #include <memory>
 #include <thread>
+#include <vector>
 
 #include "cereal/messaging/messaging.h"
 #include "cereal/visionipc/visionbuf.h"
 #include "cereal/visionipc/visionipc.h"
 #include "cereal/visionipc/visionipc_server.h"
+#include "selfdrive/camerad/imgproc/cpu_isp.h"
 #include "selfdrive/camerad/transforms/rgb_to_yuv.h"
 #include "selfdrive/common/mat.h"
-#include "selfdrive/common/queue.h"
+#include "selfdrive/common/ring_queue.h"
 #include "selfdrive/common/swaglog.h"
 #include "selfdrive/common/visionimg.h"
 #include "selfdrive/hardware/hw.h"
@@ -29,6 +32,10 @@
 
 const int UI_BUF_COUNT = 4;
 const int YUV_BUFFER_COUNT = Hardware::EON() ? 100 : 40;
+// frames with queued kernels in CameraBuf, the next frame is debayered while the current one is processed
+const int CAMERA_PIPELINE_DEPTH = 2;
+const int CAMERA_STATS_FRAMES = 1200;  // 1 min at 20 fps
+const int CAMERA_QUEUE_SIZE = 32;  // at least the frame_cnt of any CameraBuf
 
 enum CameraType {
   RoadCam = 0,
@@ -36,7 +43,9 @@ enum CameraType {
   WideRoadCam
 };
 
-// TODO: remove these once all the internal tools are moved to vipc
+// TODO: remove these once all the internal tools are moved to vipc.
+// without them the messages only carry the frame id, tools get the pixels of that frame
+// from the VisionIPC stream of the camera (see selfdrive/camerad/snapshot/snapshot.py)
 const bool env_send_driver = getenv("SEND_DRIVER") != NULL;
 const bool env_send_road = getenv("SEND_ROAD") != NULL;
 const bool env_send_wide_road = getenv("SEND_WIDE_ROAD") != NULL;
@@ -51,6 +60,14 @@ typedef struct CameraInfo {
   bool hdr;
 } CameraInfo;
 
+// nanos_since_boot() as a frame leaves each camerad stage, following timestamp_eof
+typedef struct FrameTiming {
+  uint64_t dequeued;   // popped by CameraBuf::acquire and queued for processing
+  uint64_t debayered;  // debayer or copy done
+  uint64_t converted;  // rgb2yuv done
+  uint64_t sent;       // rgb and yuv buffers sent over vipc
+} FrameTiming;
+
 typedef struct FrameMetadata {
   uint32_t frame_id;
   unsigned int frame_length;
@@ -70,6 +87,8 @@ typedef struct FrameMetadata {
   unsigned int lens_pos;
   float lens_err;
   float lens_true_pos;
+
+  FrameTiming timing;
 } FrameMetadata;
 
 typedef struct CameraExpInfo {
@@ -87,18 +106,42 @@ private:
   CameraState *camera_state;
   Debayer *debayer = nullptr;
   std::unique_ptr<Rgb2Yuv> rgb2yuv;
+  // used instead of the kernels when there is no OpenCL device
+  std::unique_ptr<DebayerCpu> debayer_cpu;
+  std::unique_ptr<Rgb2YuvCpu> rgb2yuv_cpu;
 
   VisionStreamType rgb_type, yuv_type;
 
   int cur_buf_idx;
 
-  SafeQueue<int> safe_queue;
+  // buf indices of captured frames. an index is queued at most once until it's released, so with
+  // frame_cnt <= CAMERA_QUEUE_SIZE a push never waits. none may be dropped, a buffer whose index
+  // never reaches release_callback is lost to the driver
+  RingQueue<int, CAMERA_QUEUE_SIZE> safe_queue{OverflowPolicy::Block};
+
+  // frames with queued work, delivered by acquire() in the order they arrived
+  struct PipelineFrame {
+    int buf_idx;
+    FrameMetadata frame_data;
+    VisionBuf *rgb_buf, *yuv_buf;
+    cl_event debayer_event, yuv_event;
+  };
+  std::deque<PipelineFrame> pipeline;
+
+  // metadata and stage timestamps of the last CAMERA_STATS_FRAMES frames sent,
+  // summarized in the log each time it wraps
+  std::vector<FrameMetadata> timing_ring;
+  uint32_t frames_sent = 0;
 
   int frame_buf_count;
   release_cb release_callback;
 
+  void enqueue(int buf_idx);
+  void log_stats();
+
 public:
-  cl_command_queue q;
+  cl_command_queue q = nullptr;
+  bool use_cpu = false;
   FrameMetadata cur_frame_data;
   VisionBuf *cur_rgb_buf;
   VisionBuf *cur_yuv_buf;
@@ -114,6 +157,10 @@ public:
   bool acquire();
   void release();
   void queue(size_t buf_idx);
+  void write_camera_buf(size_t buf_idx, const void *data, size_t size);
+  // for backends that decode straight into a camera buf: map it, fill it, unmap it, then queue() it
+  uint8_t *map_camera_buf(size_t buf_idx);
+  void unmap_camera_buf(size_t buf_idx, uint8_t *ptr);
 };
 
 typedef void (*process_thread_cb)(MultiCameraState *s, CameraState *c, int cnt);
@@ -1,10 +1,15 @@
 #include "selfdrive/camerad/cameras/camera_replay.h"
 
+#include <algorithm>
 #include <cassert>
+#include <future>
 #include <thread>
 
 #include "selfdrive/common/clutil.h"
+#include "selfdrive/common/swaglog.h"
+#include "selfdrive/common/timing.h"
 #include "selfdrive/common/util.h"
+#include "selfdrive/ui/replay/logreader.h"
 
 extern ExitHandler do_exit;
 
@@ -15,93 +20,244 @@ namespace {
 const char *BASE_URL = "https://commadataci.blob.core.windows.net/openpilotci/";
 
 const std::string road_camera_route = "0c94aa1e1296d7c6|2021-05-05--19-48-37";
-// const std::string driver_camera_route = "534ccd8a0950a00c|2021-06-08--12-15-37";
 
-std::string get_url(std::string route_name, const std::string &camera, int segment_num) {
-  std::replace(route_name.begin(), route_name.end(), '|', '/');
-  return util::string_format("%s%s/%d/%s.hevc", BASE_URL, route_name.c_str(), segment_num, camera.c_str());
+// when the pacing thread falls this many frames behind (a slow decode, a segment that took
+// long to load), it skips the missed time slots instead of sending a burst to catch up.
+// a gap this long between logged frames is a break in the log, not a frame time
+const int MAX_LAG_FRAMES = 3;
+
+// REPLAY_SEGMENTS is a comma separated list of segment directories, local or https://,
+// each with the fcamera.hevc, dcamera.hevc and ecamera.hevc of that segment and its qlog.bz2
+std::vector<std::string> get_segments() {
+  std::vector<std::string> segments;
+  std::string env = util::getenv("REPLAY_SEGMENTS", "");
+  for (size_t start = 0, end; start < env.size(); start = end + 1) {
+    end = env.find(',', start);
+    if (end == std::string::npos) end = env.size();
+    std::string segment = env.substr(start, end - start);
+    while (!segment.empty() && segment.back() == '/') segment.pop_back();
+    if (!segment.empty()) segments.push_back(segment);
+  }
+
+  if (segments.empty()) {
+    std::string route_name = road_camera_route;
+    std::replace(route_name.begin(), route_name.end(), '|', '/');
+    segments.push_back(BASE_URL + route_name + "/0");
+  }
+  return segments;
 }
 
-void camera_init(VisionIpcServer *v, CameraState *s, int camera_id, unsigned int fps, cl_device_id device_id, cl_context ctx, VisionStreamType rgb_type, VisionStreamType yuv_type, const std::string &url) {
-  s->frame = new FrameReader();
-  if (!s->frame->load(url)) {
-    printf("failed to load stream from %s", url.c_str());
-    assert(0);
+std::unique_ptr<FrameReader> load_frame_reader(const std::string &url) {
+  auto fr = std::make_unique<FrameReader>();
+  if (!fr->load(url)) {
+    LOGW("failed to load stream from %s", url.c_str());
+    return nullptr;
   }
+  return fr;
+}
+
+// the logged end of frame time of each frame of a video, by its index in the file. 0 for frames
+// the log has no encodeIdx of, or all of them without a log
+std::vector<uint64_t> load_frame_timestamps(const std::string &url, cereal::Event::Which encode_idx, size_t frame_count) {
+  std::vector<uint64_t> timestamps(frame_count);
+  LogReader log;
+  if (!log.load(url)) {
+    LOGW("failed to load %s, pacing at the nominal frame rate", url.c_str());
+    return timestamps;
+  }
+  for (const Event *e : log.events) {
+    if (e->which != encode_idx || e->frame) continue;
+    auto idx = capnp::AnyStruct::Reader(e->event).getPointerSection()[0].getAs<cereal::EncodeIndex>();
+    if (idx.getSegmentId() < frame_count) {
+      timestamps[idx.getSegmentId()] = idx.getTimestampEof();
+    }
+  }
+  return timestamps;
+}
+
+// a segment of one camera, loaded in the background while the one before it plays
+struct Segment {
+  std::unique_ptr<FrameReader> frame;
+  std::vector<uint64_t> timestamps;
+};
+
+Segment load_segment(const CameraState *s, size_t segment) {
+  Segment seg = {.frame = load_frame_reader(s->urls[segment])};
+  if (seg.frame) {
+    seg.timestamps = load_frame_timestamps(s->log_urls[segment], s->encode_idx, seg.frame->getFrameCount());
+  }
+  return seg;
+}
+
+void camera_release(void *cookie, int buf_idx) {
+  ((CameraState *)cookie)->free_bufs.push(buf_idx);
+}
+
+void camera_init(VisionIpcServer *v, CameraState *s, int camera_id, unsigned int fps, cl_device_id device_id, cl_context ctx,
+                 VisionStreamType rgb_type, VisionStreamType yuv_type, const std::vector<std::string> &segments, const std::string &camera,
+                 cereal::Event::Which encode_idx) {
+  for (const auto &segment : segments) {
+    s->urls.push_back(segment + "/" + camera + ".hevc");
+    s->log_urls.push_back(segment + "/qlog.bz2");
+  }
+  s->encode_idx = encode_idx;
+  // a camera that isn't in the first segment isn't replayed
+  s->frame = load_frame_reader(s->urls[0]);
+  if (!s->frame) return;
 
   CameraInfo ci = {
       .frame_width = s->frame->width,
       .frame_height = s->frame->height,
-      .frame_stride = s->frame->width * 3,
+      // FrameReader rows are aligned the same way as the rgb VisionBufs
+      .frame_stride = s->frame->aligned_width * 3,
   };
   s->ci = ci;
   s->camera_num = camera_id;
   s->fps = fps;
-  s->buf.init(device_id, ctx, s, v, FRAME_BUF_COUNT, rgb_type, yuv_type);
+  s->enabled = true;
+  s->buf.init(device_id, ctx, s, v, FRAME_BUF_COUNT, rgb_type, yuv_type, camera_release);
+  for (int i = 0; i < FRAME_BUF_COUNT; ++i) {
+    s->free_bufs.push(i);
+  }
+  LOG("camera %d: replaying %s, %dx%d at %d fps", camera_id, camera.c_str(), ci.frame_width, ci.frame_height, fps);
 }
 
 void camera_close(CameraState *s) {
-  delete s->frame;
+  s->frame.reset();
 }
 
-void run_camera(CameraState *s) {
-  uint32_t stream_frame_id = 0, frame_id = 0;
-  size_t buf_idx = 0;
-  std::unique_ptr<uint8_t[]> rgb_buf = std::make_unique<uint8_t[]>(s->frame->getRGBSize());
-  std::unique_ptr<uint8_t[]> yuv_buf = std::make_unique<uint8_t[]>(s->frame->getYUVSize());
+// decodes ahead straight into free camera bufs, moving on to the next segment (loaded in the
+// background while the current one plays) at the end of each one, and looping at the end of the
+// list. a buf is handed to the pacing thread once the frame in it is complete, with the time it's
+// due from the logged frame times
+void decode_thread(CameraState *s) {
+  util::set_thread_name(util::string_format("replay_decode_%d", s->camera_num).c_str());
+
+  const uint64_t period_ns = 1e9 / s->fps;
+  size_t segment = 0;
+  std::vector<uint64_t> timestamps = load_frame_timestamps(s->log_urls[0], s->encode_idx, s->frame->getFrameCount());
+  std::future<Segment> next_segment;
+  auto prefetch = [&]() {
+    if (s->urls.size() > 1) {
+      next_segment = std::async(std::launch::async, load_segment, s, (segment + 1) % s->urls.size());
+    }
+  };
+  prefetch();
+
+  size_t frame_idx = 0;
+  uint64_t due_ns = 0, prev_ts = 0;
+  bool first = true;
   while (!do_exit) {
-    if (stream_frame_id == s->frame->getFrameCount()) {
-      // loop stream
-      stream_frame_id = 0;
+    if (frame_idx == s->frame->getFrameCount()) {
+      frame_idx = 0;
+      if (next_segment.valid()) {
+        segment = (segment + 1) % s->urls.size();
+        Segment seg = next_segment.get();
+        if (seg.frame && seg.frame->width == s->ci.frame_width && seg.frame->height == s->ci.frame_height) {
+          s->frame = std::move(seg.frame);
+          timestamps = std::move(seg.timestamps);
+        } else if (seg.frame) {
+          LOGE("skipping %s, %dx%d doesn't match %dx%d", s->urls[segment].c_str(), seg.frame->width, seg.frame->height, s->ci.frame_width, s->ci.frame_height);
+        }
+        prefetch();
+      }
+    }
+
+    int buf_idx;
+    if (!s->free_bufs.try_pop(buf_idx, 50)) continue;
+
+    uint8_t *dst = s->buf.map_camera_buf(buf_idx);
+    const bool decoded = s->frame->get(frame_idx, dst, nullptr);
+    s->buf.unmap_camera_buf(buf_idx, dst);
+    const uint64_t ts = timestamps[frame_idx++];
+    if (!decoded) {
+      s->free_bufs.push(buf_idx);
+      continue;
     }
-    if (s->frame->get(stream_frame_id++, rgb_buf.get(), yuv_buf.get())) {
-      s->buf.camera_bufs_metadata[buf_idx] = {.frame_id = frame_id};
-      auto &buf = s->buf.camera_bufs[buf_idx];
-      CL_CHECK(clEnqueueWriteBuffer(buf.copy_q, buf.buf_cl, CL_TRUE, 0, s->frame->getRGBSize(), rgb_buf.get(), 0, NULL, NULL));
-      s->buf.queue(buf_idx);
-      ++frame_id;
-      buf_idx = (buf_idx + 1) % FRAME_BUF_COUNT;
+
+    // the logged time since the frame before, the nominal period where the log has none or
+    // breaks off, as from the last frame of the list to the first
+    if (!first) {
+      due_ns += (prev_ts && ts > prev_ts && ts - prev_ts <= MAX_LAG_FRAMES * period_ns) ? ts - prev_ts : period_ns;
     }
-    util::sleep_for(1000 / s->fps);
+    first = false;
+    prev_ts = ts;
+    s->due_ns[buf_idx] = due_ns;
+    s->decoded_bufs.push(buf_idx);
   }
-}
 
-void road_camera_thread(CameraState *s) {
-  util::set_thread_name("replay_road_camera_thread");
-  run_camera(s);
+  if (next_segment.valid()) next_segment.wait();
 }
 
-// void driver_camera_thread(CameraState *s) {
-//   util::set_thread_name("replay_driver_camera_thread");
-//   run_camera(s);
-// }
+// hands decoded frames to the CameraBuf when they're due, at start_ns plus the logged time since
+// the first frame. start_ns is shared by all cameras, and frame ids count frame periods since
+// then, so the ids of frames taken together line up. sleeping until an absolute deadline keeps
+// the rate from drifting with the time spent per frame
+void pace_thread(CameraState *s, uint64_t start_ns) {
+  util::set_thread_name(util::string_format("replay_camera_%d", s->camera_num).c_str());
+
+  const uint64_t period_ns = 1e9 / s->fps;
+  uint64_t late_ns = 0;  // whole periods skipped after falling behind
+  uint64_t next_frame_id = 0;
+  while (!do_exit) {
+    int buf_idx;
+    if (!s->decoded_bufs.try_pop(buf_idx, 50)) continue;
+
+    const uint64_t deadline_ns = start_ns + s->due_ns[buf_idx] + late_ns;
+    const uint64_t now_ns = nanos_since_boot();
+    if (deadline_ns > now_ns) {
+      std::this_thread::sleep_for(std::chrono::nanoseconds(deadline_ns - now_ns));
+    } else if (now_ns - deadline_ns > MAX_LAG_FRAMES * period_ns) {
+      const uint64_t skipped = (now_ns - deadline_ns) / period_ns;
+      LOGW("camera %d: %lu frames behind, skipping ahead", s->camera_num, skipped);
+      late_ns += skipped * period_ns;
+    }
+
+    const uint64_t frame_id = std::max(next_frame_id, (s->due_ns[buf_idx] + late_ns + period_ns / 2) / period_ns);
+    next_frame_id = frame_id + 1;
+    const uint64_t ts = nanos_since_boot();
+    s->buf.camera_bufs_metadata[buf_idx] = {.frame_id = (uint32_t)frame_id, .timestamp_sof = ts, .timestamp_eof = ts};
+    s->buf.queue(buf_idx);
+  }
+}
 
 void process_road_camera(MultiCameraState *s, CameraState *c, int cnt) {
   const CameraBuf *b = &c->buf;
   MessageBuilder msg;
-  auto framed = msg.initEvent().initRoadCameraState();
+  auto framed = c == &s->road_cam ? msg.initEvent().initRoadCameraState() : msg.initEvent().initWideRoadCameraState();
   fill_frame_data(framed, b->cur_frame_data);
-  framed.setImage(kj::arrayPtr((const uint8_t *)b->cur_yuv_buf->addr, b->cur_yuv_buf->len));
-  framed.setTransform(b->yuv_transform.v);
-  s->pm->send("roadCameraState", msg);
+  if ((c == &s->road_cam && env_send_road) || (c == &s->wide_road_cam && env_send_wide_road)) {
+    framed.setImage(get_frame_image(b));
+  }
+  if (c == &s->road_cam) {
+    framed.setTransform(b->yuv_transform.v);
+  }
+  s->pm->send(c == &s->road_cam ? "roadCameraState" : "wideRoadCameraState", msg);
 }
 
-// void process_driver_camera(MultiCameraState *s, CameraState *c, int cnt) {
-//   MessageBuilder msg;
-//   auto framed = msg.initEvent().initDriverCameraState();
-//   framed.setFrameType(cereal::FrameData::FrameType::FRONT);
-//   fill_frame_data(framed, c->buf.cur_frame_data);
-//   s->pm->send("driverCameraState", msg);
-// }
+void process_driver_camera(MultiCameraState *s, CameraState *c, int cnt) {
+  MessageBuilder msg;
+  auto framed = msg.initEvent().initDriverCameraState();
+  framed.setFrameType(cereal::FrameData::FrameType::FRONT);
+  fill_frame_data(framed, c->buf.cur_frame_data);
+  if (env_send_driver) {
+    framed.setImage(get_frame_image(&c->buf));
+  }
+  s->pm->send("driverCameraState", msg);
+}
 
 }  // namespace
 
 void cameras_init(VisionIpcServer *v, MultiCameraState *s, cl_device_id device_id, cl_context ctx) {
+  const auto segments = get_segments();
   camera_init(v, &s->road_cam, CAMERA_ID_LGC920, 20, device_id, ctx,
-              VISION_STREAM_RGB_BACK, VISION_STREAM_ROAD, get_url(road_camera_route, "fcamera", 0));
-  // camera_init(v, &s->driver_cam, CAMERA_ID_LGC615, 10, device_id, ctx,
-  //             VISION_STREAM_RGB_FRONT, VISION_STREAM_DRIVER, get_url(driver_camera_route, "dcamera", 0));
-  s->pm = new PubMaster({"roadCameraState", "driverCameraState", "thumbnail"});
+              VISION_STREAM_RGB_BACK, VISION_STREAM_ROAD, segments, "fcamera", cereal::Event::ROAD_ENCODE_IDX);
+  camera_init(v, &s->driver_cam, CAMERA_ID_LGC615, 20, device_id, ctx,
+              VISION_STREAM_RGB_FRONT, VISION_STREAM_DRIVER, segments, "dcamera", cereal::Event::DRIVER_ENCODE_IDX);
+  camera_init(v, &s->wide_road_cam, CAMERA_ID_AR0231, 20, device_id, ctx,
+              VISION_STREAM_RGB_WIDE, VISION_STREAM_WIDE_ROAD, segments, "ecamera", cereal::Event::WIDE_ROAD_ENCODE_IDX);
+  assert(s->road_cam.enabled || s->driver_cam.enabled || s->wide_road_cam.enabled);
+  s->pm = new PubMaster({"roadCameraState", "driverCameraState", "wideRoadCameraState", "thumbnail"});
 }
 
 void cameras_open(MultiCameraState *s) {}
@@ -109,15 +265,23 @@ void cameras_open(MultiCameraState *s) {}
 void cameras_close(MultiCameraState *s) {
   camera_close(&s->road_cam);
   camera_close(&s->driver_cam);
+  camera_close(&s->wide_road_cam);
   delete s->pm;
 }
 
 void cameras_run(MultiCameraState *s) {
+  // leave the decoders some time to fill their bufs before the first frame is due
+  const uint64_t start_ns = nanos_since_boot() + 500e6;
+
   std::vector<std::thread> threads;
-  threads.push_back(start_process_thread(s, &s->road_cam, process_road_camera));
-  // threads.push_back(start_process_thread(s, &s->driver_cam, process_driver_camera));
-  // threads.push_back(std::thread(driver_camera_thread, &s->driver_cam));
-  road_camera_thread(&s->road_cam);
+  for (auto [cam, process] : {std::pair{&s->road_cam, process_road_camera},
+                              std::pair{&s->driver_cam, process_driver_camera},
+                              std::pair{&s->wide_road_cam, process_road_camera}}) {
+    if (!cam->enabled) continue;
+    threads.push_back(start_process_thread(s, cam, process));
+    threads.emplace_back(decode_thread, cam);
+    threads.emplace_back(pace_thread, cam, start_ns);
+  }
 
   for (auto &t : threads) t.join();
 
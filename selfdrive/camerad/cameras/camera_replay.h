@@ -1,8 +1,15 @@
 #pragma once
 
+#include <memory>
+#include <string>
+#include <vector>
+
 #include "selfdrive/camerad/cameras/camera_common.h"
+#include "cereal/gen/cpp/log.capnp.h"
+#include "selfdrive/common/ring_queue.h"
 #include "selfdrive/ui/replay/framereader.h"
 
+// camera bufs per camera, frames are decoded up to this far ahead of the pacing thread
 #define FRAME_BUF_COUNT 16
 
 typedef struct CameraState {
@@ -13,12 +20,23 @@ typedef struct CameraState {
   float digital_gain = 0;
 
   CameraBuf buf;
-  FrameReader *frame = nullptr;
+
+  bool enabled = false;
+  // one video file per segment, played in order and looped, and the qlog of each segment with
+  // the encodeIdx events of this camera
+  std::vector<std::string> urls, log_urls;
+  cereal::Event::Which encode_idx;
+  std::unique_ptr<FrameReader> frame;
+  // camera bufs ready to be decoded into, and decoded frames waiting for their time slot
+  RingQueue<int, FRAME_BUF_COUNT> free_bufs;
+  RingQueue<int, FRAME_BUF_COUNT> decoded_bufs;
+  uint64_t due_ns[FRAME_BUF_COUNT];  // when the frame decoded into a buf is due, after the start
 } CameraState;
 
 typedef struct MultiCameraState {
   CameraState road_cam;
   CameraState driver_cam;
+  CameraState wide_road_cam;
 
   SubMaster *sm = nullptr;
   PubMaster *pm = nullptr;
@@ -1,32 +1,40 @@
 #include "selfdrive/camerad/cameras/camera_webcam.h"
 
+#include <fcntl.h>
+#include <linux/videodev2.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <cstring>
 
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wundefined-inline"
-#include <opencv2/core.hpp>
-#include <opencv2/highgui.hpp>
-#include <opencv2/opencv.hpp>
-#include <opencv2/videoio.hpp>
-#pragma clang diagnostic pop
+#include "libyuv.h"
 
 #include "selfdrive/common/clutil.h"
 #include "selfdrive/common/swaglog.h"
 #include "selfdrive/common/timing.h"
 #include "selfdrive/common/util.h"
 
-// id of the video capturing device
+// id of the video capturing device, /dev/video<id>. v4l2loopback devices work too
 const int ROAD_CAMERA_ID = util::getenv("ROADCAM_ID", 1);
 const int DRIVER_CAMERA_ID = util::getenv("DRIVERCAM_ID", 2);
+// set if the camera is mounted upside down
+const bool ROAD_CAMERA_ROTATE = getenv("ROADCAM_ROTATE") != NULL;
+const bool DRIVER_CAMERA_ROTATE = getenv("DRIVERCAM_ROTATE") != NULL;
 
 #define FRAME_WIDTH  1164
 #define FRAME_HEIGHT 874
 #define FRAME_WIDTH_FRONT  1152
 #define FRAME_HEIGHT_FRONT 864
 
+// requested capture size, the driver picks the closest it supports
+#define CAPTURE_WIDTH 853
+#define CAPTURE_HEIGHT 480
+
 extern ExitHandler do_exit;
 
 namespace {
@@ -50,99 +58,294 @@ CameraInfo cameras_supported[CAMERA_ID_MAX] = {
   },
 };
 
-void camera_open(CameraState *s, bool rear) {
-  // empty
+// planes of an I420 image stored in one allocation
+struct I420Planes {
+  uint8_t *y, *u, *v;
+  int stride_y, stride_uv;
+
+  I420Planes(uint8_t *buf, int width, int height) {
+    stride_y = width;
+    stride_uv = (width + 1) / 2;
+    y = buf;
+    u = y + stride_y * height;
+    v = u + stride_uv * ((height + 1) / 2);
+  }
+  static size_t size(int width, int height) {
+    return width * height + 2 * ((width + 1) / 2) * ((height + 1) / 2);
+  }
+};
+
+int xioctl(int fd, unsigned long request, void *arg) {
+  return HANDLE_EINTR(ioctl(fd, request, arg));
+}
+
+// the first of the formats we decode that the device takes
+bool set_format(CameraState *s) {
+  for (uint32_t pixel_format : {V4L2_PIX_FMT_MJPEG, V4L2_PIX_FMT_YUYV}) {
+    struct v4l2_format fmt = {.type = V4L2_BUF_TYPE_VIDEO_CAPTURE};
+    fmt.fmt.pix.width = CAPTURE_WIDTH;
+    fmt.fmt.pix.height = CAPTURE_HEIGHT;
+    fmt.fmt.pix.pixelformat = pixel_format;
+    fmt.fmt.pix.field = V4L2_FIELD_NONE;
+    // a v4l2loopback device already fed by a producer keeps the producer's format
+    if (xioctl(s->video_fd, VIDIOC_S_FMT, &fmt) != 0) continue;
+    if (fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_MJPEG || fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_YUYV) {
+      s->pixel_format = fmt.fmt.pix.pixelformat;
+      s->capture_width = fmt.fmt.pix.width;
+      s->capture_height = fmt.fmt.pix.height;
+      s->capture_stride = fmt.fmt.pix.bytesperline;
+      return true;
+    }
+  }
+  return false;
+}
+
+void set_control(CameraState *s, uint32_t id, int32_t value) {
+  struct v4l2_control ctrl = {.id = id, .value = value};
+  if (xioctl(s->video_fd, VIDIOC_S_CTRL, &ctrl) != 0) {
+    LOGW("camera %d: can't set control 0x%x: %s", s->camera_num, id, strerror(errno));
+  }
+}
+
+// fit the capture into the frame: scale it to scaled_width, center it, and crop what falls outside.
+// offsets and sizes are even so the chroma planes line up
+void setup_geometry(CameraState *s) {
+  const float scale = (float)s->scaled_width / s->capture_width;
+  const int scaled_height = s->capture_height * scale;
+  const int frame_width = s->ci.frame_width, frame_height = s->ci.frame_height;
+
+  s->dst.w = std::min(frame_width, s->scaled_width) & ~1;
+  s->dst.h = std::min(frame_height, scaled_height) & ~1;
+  s->dst.x = ((frame_width - s->dst.w) / 2) & ~1;
+  s->dst.y = ((frame_height - s->dst.h) / 2) & ~1;
+
+  s->crop.w = std::min(s->capture_width, (int)(s->dst.w / scale)) & ~1;
+  s->crop.h = std::min(s->capture_height, (int)(s->dst.h / scale)) & ~1;
+  s->crop.x = ((s->capture_width - s->crop.w) / 2) & ~1;
+  s->crop.y = ((s->capture_height - s->crop.h) / 2) & ~1;
+
+  if (s->rotate) {
+    s->dst.x = frame_width - s->dst.x - s->dst.w;
+    s->dst.y = frame_height - s->dst.y - s->dst.h;
+  }
+}
+
+// v4l2 stamps buffers with CLOCK_MONOTONIC, frame metadata uses CLOCK_BOOTTIME.
+// returns 0 if the driver doesn't give a monotonic timestamp
+uint64_t boottime_timestamp(const struct v4l2_buffer &buf) {
+  const uint64_t ts = buf.timestamp.tv_sec * 1000000000ULL + buf.timestamp.tv_usec * 1000ULL;
+  if ((buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) != V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC || ts == 0) {
+    return 0;
+  }
+  return ts + (nanos_since_boot() - nanos_monotonic());
+}
+
+void camera_open(CameraState *s) {
+  const std::string path = util::string_format("/dev/video%d", s->video_id);
+  s->video_fd = HANDLE_EINTR(open(path.c_str(), O_RDWR | O_NONBLOCK));
+  if (s->video_fd < 0) {
+    LOGE("camera %d: can't open %s: %s", s->camera_num, path.c_str(), strerror(errno));
+    assert(false);
+  }
+
+  struct v4l2_capability cap = {};
+  int ret = xioctl(s->video_fd, VIDIOC_QUERYCAP, &cap);
+  assert(ret == 0);
+  const uint32_t caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS) ? cap.device_caps : cap.capabilities;
+  if (!(caps & V4L2_CAP_VIDEO_CAPTURE) || !(caps & V4L2_CAP_STREAMING)) {
+    LOGE("camera %d: %s (%s) can't stream video capture", s->camera_num, path.c_str(), cap.card);
+    assert(false);
+  }
+
+  if (!set_format(s)) {
+    LOGE("camera %d: %s (%s) supports neither MJPEG nor YUYV", s->camera_num, path.c_str(), cap.card);
+    assert(false);
+  }
+
+  struct v4l2_streamparm parm = {.type = V4L2_BUF_TYPE_VIDEO_CAPTURE};
+  parm.parm.capture.timeperframe = {.numerator = 1, .denominator = (uint32_t)s->fps};
+  if (xioctl(s->video_fd, VIDIOC_S_PARM, &parm) != 0) {
+    LOGW("camera %d: can't set %d fps: %s", s->camera_num, s->fps, strerror(errno));
+  }
+
+  LOG("camera %d: %s (%s), %dx%d %s", s->camera_num, path.c_str(), cap.card, s->capture_width, s->capture_height,
+      s->pixel_format == V4L2_PIX_FMT_MJPEG ? "MJPEG" : "YUYV");
+
+  // mmap the capture buffers and hand them all to the driver
+  struct v4l2_requestbuffers req = {.count = V4L2_BUF_COUNT, .type = V4L2_BUF_TYPE_VIDEO_CAPTURE, .memory = V4L2_MEMORY_MMAP};
+  ret = xioctl(s->video_fd, VIDIOC_REQBUFS, &req);
+  assert(ret == 0 && req.count > 0);
+  for (uint32_t i = 0; i < req.count; i++) {
+    struct v4l2_buffer buf = {.index = i, .type = V4L2_BUF_TYPE_VIDEO_CAPTURE, .memory = V4L2_MEMORY_MMAP};
+    ret = xioctl(s->video_fd, VIDIOC_QUERYBUF, &buf);
+    assert(ret == 0);
+    void *addr = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, s->video_fd, buf.m.offset);
+    assert(addr != MAP_FAILED);
+    s->capture_bufs.push_back({.addr = addr, .len = buf.length});
+    ret = xioctl(s->video_fd, VIDIOC_QBUF, &buf);
+    assert(ret == 0);
+  }
+
+  setup_geometry(s);
+  s->decoded = std::make_unique<uint8_t[]>(I420Planes::size(s->capture_width, s->capture_height));
+  s->scaled = std::make_unique<uint8_t[]>(I420Planes::size(s->dst.w, s->dst.h));
+  if (s->rotate) {
+    s->rotated = std::make_unique<uint8_t[]>(I420Planes::size(s->dst.w, s->dst.h));
+  }
+
+  // only the dst rect is written per frame, the borders stay black
+  for (int i = 0; i < FRAME_BUF_COUNT; i++) {
+    uint8_t *ptr = s->buf.map_camera_buf(i);
+    memset(ptr, 0, s->ci.frame_stride * s->ci.frame_height);
+    s->buf.unmap_camera_buf(i, ptr);
+  }
+
+  enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  ret = xioctl(s->video_fd, VIDIOC_STREAMON, &type);
+  assert(ret == 0);
 }
 
 void camera_close(CameraState *s) {
-  // empty
+  if (s->video_fd < 0) return;
+
+  enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  xioctl(s->video_fd, VIDIOC_STREAMOFF, &type);
+  for (auto &b : s->capture_bufs) {
+    munmap(b.addr, b.len);
+  }
+  s->capture_bufs.clear();
+  close(s->video_fd);
+  s->video_fd = -1;
 }
 
-void camera_init(VisionIpcServer * v, CameraState *s, int camera_id, unsigned int fps, cl_device_id device_id, cl_context ctx, VisionStreamType rgb_type, VisionStreamType yuv_type) {
+void camera_init(VisionIpcServer * v, CameraState *s, int camera_id, int video_id, unsigned int fps, int scaled_width, bool rotate,
+                 cl_device_id device_id, cl_context ctx, VisionStreamType rgb_type, VisionStreamType yuv_type) {
   assert(camera_id < std::size(cameras_supported));
   s->ci = cameras_supported[camera_id];
   assert(s->ci.frame_width != 0);
 
   s->camera_num = camera_id;
+  s->video_id = video_id;
   s->fps = fps;
+  s->scaled_width = scaled_width;
+  s->rotate = rotate;
   s->buf.init(device_id, ctx, s, v, FRAME_BUF_COUNT, rgb_type, yuv_type);
 }
 
-void run_camera(CameraState *s, cv::VideoCapture &video_cap, float *ts) {
-  assert(video_cap.isOpened());
+// decodes a capture buffer into s->decoded
+bool decode_capture(CameraState *s, const uint8_t *data, size_t size) {
+  I420Planes out(s->decoded.get(), s->capture_width, s->capture_height);
+  if (s->pixel_format == V4L2_PIX_FMT_MJPEG) {
+    // libyuv decodes with libjpeg-turbo
+    return libyuv::MJPGToI420(data, size, out.y, out.stride_y, out.u, out.stride_uv, out.v, out.stride_uv,
+                              s->capture_width, s->capture_height, s->capture_width, s->capture_height) == 0;
+  }
+  if (size < (size_t)s->capture_stride * s->capture_height) return false;
+  return libyuv::YUY2ToI420(data, s->capture_stride, out.y, out.stride_y, out.u, out.stride_uv, out.v, out.stride_uv,
+                            s->capture_width, s->capture_height) == 0;
+}
 
-  cv::Size size(s->ci.frame_width, s->ci.frame_height);
-  const cv::Mat transform = cv::Mat(3, 3, CV_32F, ts);
-  uint32_t frame_id = 0;
-  size_t buf_idx = 0;
+// scales the visible part of s->decoded into the camera buf as BGR
+void write_frame(CameraState *s, uint8_t *frame) {
+  const I420Planes src(s->decoded.get(), s->capture_width, s->capture_height);
+  const CropRect &c = s->crop, &d = s->dst;
+  const uint8_t *y = src.y + c.y * src.stride_y + c.x;
+  const uint8_t *u = src.u + (c.y / 2) * src.stride_uv + c.x / 2;
+  const uint8_t *v = src.v + (c.y / 2) * src.stride_uv + c.x / 2;
+  int stride_y = src.stride_y, stride_uv = src.stride_uv;
+
+  // skipped when the capture is already at frame scale
+  if (c.w != d.w || c.h != d.h) {
+    const I420Planes scaled(s->scaled.get(), d.w, d.h);
+    libyuv::I420Scale(y, stride_y, u, stride_uv, v, stride_uv, c.w, c.h,
+                      scaled.y, scaled.stride_y, scaled.u, scaled.stride_uv, scaled.v, scaled.stride_uv,
+                      d.w, d.h, libyuv::kFilterBilinear);
+    y = scaled.y, u = scaled.u, v = scaled.v;
+    stride_y = scaled.stride_y, stride_uv = scaled.stride_uv;
+  }
 
-  while (!do_exit) {
-    cv::Mat frame_mat, transformed_mat;
-    video_cap >> frame_mat;
-    if (frame_mat.empty()) continue;
+  if (s->rotate) {
+    const I420Planes rotated(s->rotated.get(), d.w, d.h);
+    libyuv::I420Rotate(y, stride_y, u, stride_uv, v, stride_uv,
+                       rotated.y, rotated.stride_y, rotated.u, rotated.stride_uv, rotated.v, rotated.stride_uv,
+                       d.w, d.h, libyuv::kRotate180);
+    y = rotated.y, u = rotated.u, v = rotated.v;
+    stride_y = rotated.stride_y, stride_uv = rotated.stride_uv;
+  }
 
-    cv::warpPerspective(frame_mat, transformed_mat, transform, size, cv::INTER_LINEAR, cv::BORDER_CONSTANT, 0);
+  // libyuv's RGB24 is B, G, R in memory, the channel order of the camera bufs
+  libyuv::I420ToRGB24(y, stride_y, u, stride_uv, v, stride_uv,
+                      frame + d.y * s->ci.frame_stride + d.x * 3, s->ci.frame_stride, d.w, d.h);
+}
 
-    s->buf.camera_bufs_metadata[buf_idx] = {.frame_id = frame_id};
+void run_camera(CameraState *s) {
+  size_t buf_idx = 0;
 
-    auto &buf = s->buf.camera_bufs[buf_idx];
-    int transformed_size = transformed_mat.total() * transformed_mat.elemSize();
-    CL_CHECK(clEnqueueWriteBuffer(buf.copy_q, buf.buf_cl, CL_TRUE, 0, transformed_size, transformed_mat.data, 0, NULL, NULL));
+  while (!do_exit) {
+    struct pollfd fds[1] = {{.fd = s->video_fd, .events = POLLIN}};
+    int ret = HANDLE_EINTR(poll(fds, 1, 100));
+    if (ret == 0) continue;
+    if (ret < 0) {
+      LOGE("camera %d: poll failed: %s", s->camera_num, strerror(errno));
+      break;
+    }
+
+    struct v4l2_buffer v4l_buf = {.type = V4L2_BUF_TYPE_VIDEO_CAPTURE, .memory = V4L2_MEMORY_MMAP};
+    if (xioctl(s->video_fd, VIDIOC_DQBUF, &v4l_buf) != 0) {
+      if (errno == EAGAIN) continue;
+      LOGE("camera %d: VIDIOC_DQBUF failed: %s", s->camera_num, strerror(errno));
+      break;
+    }
+    const uint64_t dequeued_ns = nanos_since_boot();
+
+    // decode straight out of the mmapped buffer, then give it back to the driver
+    bool decoded = !(v4l_buf.flags & V4L2_BUF_FLAG_ERROR) &&
+                   decode_capture(s, (const uint8_t *)s->capture_bufs[v4l_buf.index].addr, v4l_buf.bytesused);
+    ret = xioctl(s->video_fd, VIDIOC_QBUF, &v4l_buf);
+    assert(ret == 0);
+    if (!decoded) {
+      LOGW_100("camera %d: dropping corrupt frame %d", s->camera_num, v4l_buf.sequence);
+      continue;
+    }
+
+    uint8_t *frame = s->buf.map_camera_buf(buf_idx);
+    write_frame(s, frame);
+    s->buf.unmap_camera_buf(buf_idx, frame);
+
+    // the sequence counts frames the driver dropped, so gaps show up as skipped frame ids
+    FrameMetadata &meta = s->buf.camera_bufs_metadata[buf_idx];
+    meta = {.frame_id = v4l_buf.sequence};
+    const uint64_t ts = boottime_timestamp(v4l_buf);
+    if (ts && (v4l_buf.flags & V4L2_BUF_FLAG_TSTAMP_SRC_MASK) == V4L2_BUF_FLAG_TSTAMP_SRC_SOE) {
+      // uvcvideo stamps the start of exposure
+      meta.timestamp_sof = ts;
+      meta.timestamp_eof = dequeued_ns;
+    } else {
+      meta.timestamp_eof = ts ? ts : dequeued_ns;
+    }
 
     s->buf.queue(buf_idx);
-
-    ++frame_id;
     buf_idx = (buf_idx + 1) % FRAME_BUF_COUNT;
   }
 }
 
 static void road_camera_thread(CameraState *s) {
   util::set_thread_name("webcam_road_camera_thread");
-
-  cv::VideoCapture cap_road(ROAD_CAMERA_ID, cv::CAP_V4L2); // road
-  cap_road.set(cv::CAP_PROP_FRAME_WIDTH, 853);
-  cap_road.set(cv::CAP_PROP_FRAME_HEIGHT, 480);
-  cap_road.set(cv::CAP_PROP_FPS, s->fps);
-  cap_road.set(cv::CAP_PROP_AUTOFOCUS, 0); // off
-  cap_road.set(cv::CAP_PROP_FOCUS, 0); // 0 - 255?
-  // cv::Rect roi_rear(160, 0, 960, 720);
-
-  // transforms calculation see tools/webcam/warp_vis.py
-  float ts[9] = {1.50330396, 0.0, -59.40969163,
-                  0.0, 1.50330396, 76.20704846,
-                  0.0, 0.0, 1.0};
-  // if camera upside down:
-  // float ts[9] = {-1.50330396, 0.0, 1223.4,
-  //                 0.0, -1.50330396, 797.8,
-  //                 0.0, 0.0, 1.0};
-
-  run_camera(s, cap_road, ts);
+  run_camera(s);
 }
 
 void driver_camera_thread(CameraState *s) {
-  cv::VideoCapture cap_driver(DRIVER_CAMERA_ID, cv::CAP_V4L2); // driver
-  cap_driver.set(cv::CAP_PROP_FRAME_WIDTH, 853);
-  cap_driver.set(cv::CAP_PROP_FRAME_HEIGHT, 480);
-  cap_driver.set(cv::CAP_PROP_FPS, s->fps);
-  // cv::Rect roi_front(320, 0, 960, 720);
-
-  // transforms calculation see tools/webcam/warp_vis.py
-  float ts[9] = {1.42070485, 0.0, -30.16740088,
-                  0.0, 1.42070485, 91.030837,
-                  0.0, 0.0, 1.0};
-  // if camera upside down:
-  // float ts[9] = {-1.42070485, 0.0, 1182.2,
-  //                 0.0, -1.42070485, 773.0,
-  //                 0.0, 0.0, 1.0};
-  run_camera(s, cap_driver, ts);
+  run_camera(s);
 }
 
 }  // namespace
 
 void cameras_init(VisionIpcServer *v, MultiCameraState *s, cl_device_id device_id, cl_context ctx) {
-  camera_init(v, &s->road_cam, CAMERA_ID_LGC920, 20, device_id, ctx,
+  // scaled widths match the field of view of a C920/C615 to the frame's,
+  // see tools/webcam/warp_vis.py
+  camera_init(v, &s->road_cam, CAMERA_ID_LGC920, ROAD_CAMERA_ID, 20, 1282, ROAD_CAMERA_ROTATE, device_id, ctx,
               VISION_STREAM_RGB_BACK, VISION_STREAM_ROAD);
-  camera_init(v, &s->driver_cam, CAMERA_ID_LGC615, 10, device_id, ctx,
+  camera_init(v, &s->driver_cam, CAMERA_ID_LGC615, DRIVER_CAMERA_ID, 10, 1212, DRIVER_CAMERA_ROTATE, device_id, ctx,
               VISION_STREAM_RGB_FRONT, VISION_STREAM_DRIVER);
   s->pm = new PubMaster({"roadCameraState", "driverCameraState", "thumbnail"});
 }
@@ -150,10 +353,13 @@ void cameras_init(VisionIpcServer *v, MultiCameraState *s, cl_device_id device_i
 void camera_autoexposure(CameraState *s, float grey_frac) {}
 
 void cameras_open(MultiCameraState *s) {
-  // LOG("*** open driver camera ***");
-  camera_open(&s->driver_cam, false);
-  // LOG("*** open road camera ***");
-  camera_open(&s->road_cam, true);
+  LOG("*** open driver camera ***");
+  camera_open(&s->driver_cam);
+  LOG("*** open road camera ***");
+  camera_open(&s->road_cam);
+  // the road camera is focused at infinity
+  set_control(&s->road_cam, V4L2_CID_FOCUS_AUTO, 0);
+  set_control(&s->road_cam, V4L2_CID_FOCUS_ABSOLUTE, 0);
 }
 
 void cameras_close(MultiCameraState *s) {
@@ -175,7 +381,9 @@ void process_road_camera(MultiCameraState *s, CameraState *c, int cnt) {
   MessageBuilder msg;
   auto framed = msg.initEvent().initRoadCameraState();
   fill_frame_data(framed, b->cur_frame_data);
-  framed.setImage(kj::arrayPtr((const uint8_t *)b->cur_yuv_buf->addr, b->cur_yuv_buf->len));
+  if (env_send_road) {
+    framed.setImage(get_frame_image(b));
+  }
   framed.setTransform(b->yuv_transform.v);
   s->pm->send("roadCameraState", msg);
 }
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <memory>
+#include <vector>
+
 #ifdef __APPLE__
 #include <OpenCL/cl.h>
 #else
@@ -9,6 +12,18 @@
 #include "selfdrive/camerad/cameras/camera_common.h"
 
 #define FRAME_BUF_COUNT 16
+// mmapped V4L2 capture buffers, the driver fills the ones we're not decoding
+#define V4L2_BUF_COUNT 4
+
+// a buffer the driver captures into, mapped into our address space
+struct V4L2Buffer {
+  void *addr;
+  size_t len;
+};
+
+struct CropRect {
+  int x, y, w, h;
+};
 
 typedef struct CameraState {
   CameraInfo ci;
@@ -16,6 +31,22 @@ typedef struct CameraState {
   int fps;
   float digital_gain;
   CameraBuf buf;
+
+  // V4L2 capture device, /dev/video<video_id>
+  int video_id;
+  int video_fd = -1;
+  uint32_t pixel_format;  // V4L2_PIX_FMT_MJPEG or V4L2_PIX_FMT_YUYV
+  int capture_width, capture_height, capture_stride;
+  std::vector<V4L2Buffer> capture_bufs;
+
+  // the capture is scaled to scaled_width and centered in the frame, so it covers the
+  // field of view the models expect. rotate for a camera mounted upside down
+  int scaled_width;
+  bool rotate;
+  // part of the capture that stays in the frame, and where it goes
+  CropRect crop, dst;
+  // I420 scratch for the decoded capture, the scaled crop and its rotation
+  std::unique_ptr<uint8_t[]> decoded, scaled, rotated;
 } CameraState;
 
 
@@ -0,0 +1,217 @@
+#include "selfdrive/camerad/imgproc/cpu_isp.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <vector>
+
+#include "selfdrive/common/simd.h"
+#include "selfdrive/common/util.h"
+
+namespace {
+
+constexpr int LANES = 8;
+
+// same math as rgb_to_yuv.cl, for both scalars and u16x8.
+// the U/V intermediates stay within [0, 65535], so 16 bit lanes are exact
+template <typename T> inline T rgb_to_y(T r, T g, T b) { return ((b * 13 + g * 65 + r * 33 + 64) >> 7) + 16; }
+template <typename T> inline T rgb_to_u(T r, T g, T b) { return (b * 56 - g * 37 - r * 19 + 0x8080) >> 8; }
+template <typename T> inline T rgb_to_v(T r, T g, T b) { return (r * 56 - g * 47 - b * 9 + 0x8080) >> 8; }
+
+// max(lo, min(hi, v)) with bitwise selects, NaN -> lo
+inline f32x4 clamp4(f32x4 v, float lo, float hi) {
+  const f32x4 vlo = {lo, lo, lo, lo}, vhi = {hi, hi, hi, hi};
+  v = simd::select(v < vhi, v, vhi);
+  return simd::select(v > vlo, v, vlo);
+}
+
+const float color_correction[3][3] = {
+  // Matrix from WBraw -> sRGBD65 (normalized)
+  { 1.62393627, -0.2092988,  0.00119886},
+  {-0.45734315,  1.5534676, -0.59296798},
+  {-0.16659312, -0.3441688,  1.59176912},
+};
+
+}  // namespace
+
+// DebayerCpu
+
+DebayerCpu::DebayerCpu(int frame_stride, int rgb_width, int rgb_height, int rgb_stride, int bayer_flip, bool hdr)
+    : frame_stride(frame_stride), rgb_width(rgb_width), rgb_height(rgb_height), rgb_stride(rgb_stride), bayer_flip(bayer_flip), hdr(hdr) {
+  assert(rgb_width % 2 == 0);
+  // the table in debayer.cl: runs of 32, 32, 64, 64 and 64 entries stepping by 1, 16, 8, 4 and 2,
+  // each followed by its negation
+  const int bases[] = {0, 935, 419, 161, 32}, steps[] = {1, 16, 8, 4, 2}, counts[] = {32, 32, 64, 64, 64};
+  int i = 0;
+  for (int seg = 0; seg < 5; ++seg) {
+    for (int sign : {1, -1}) {
+      for (int j = 0; j < counts[seg]; ++j) {
+        dpcm_lookup[i++] = sign * (bases[seg] + j * steps[seg]);
+      }
+    }
+  }
+  assert(i == 512);
+}
+
+void DebayerCpu::run(const uint8_t *in, uint8_t *out, float gain) const {
+  util::parallel_for(rgb_height, 1, [=](int start, int end) { run_rows(in, out, gain, start, end); });
+}
+
+void DebayerCpu::run_rows(const uint8_t *in, uint8_t *out, float gain, int start, int end) const {
+  const float black_level = 56.0f;
+  const float max_level = hdr ? 16384.0f - black_level : 1024.0f - black_level;
+  const float fake_f = 700.0f;
+  // channel of the 2x2 block holding red, the two greens and blue
+  const int flip_idx[4][4] = {{0, 1, 2, 3}, {1, 0, 3, 2}, {2, 0, 3, 1}, {3, 1, 2, 0}};
+  const int *idx = flip_idx[bayer_flip];
+
+  // planar scratch, padded to whole vectors: the four samples of each 2x2 block,
+  // the vignetting gain and the output channels
+  const int width4 = (rgb_width + 3) & ~3;
+  std::vector<float> scratch(width4 * 8);
+  float *s[4] = {&scratch[0], &scratch[width4], &scratch[width4 * 2], &scratch[width4 * 3]};
+  float *lil_a = &scratch[width4 * 4];
+  float *c[3] = {&scratch[width4 * 5], &scratch[width4 * 6], &scratch[width4 * 7]};
+
+  for (int oy = start; oy < end; ++oy) {
+    const uint8_t *row0 = &in[oy * 2 * frame_stride];
+    const uint8_t *row1 = row0 + frame_stride;
+
+    // unpack RAW10 and decompress HDR, sequential along the row
+    uint32_t pint_last[4] = {};
+    for (int ox = 0; ox < rgb_width; ox += 2) {
+      const uint8_t *v1 = &row0[(ox / 2) * 5], *v2 = &row1[(ox / 2) * 5];
+      const uint8_t ex1 = v1[4], ex2 = v2[4];
+      for (int px = 0; px < 2; ++px) {
+        uint32_t pint[4] = {
+          ((uint32_t)v1[px * 2] << 2) + ((ex1 >> (px * 4)) & 3), ((uint32_t)v1[px * 2 + 1] << 2) + ((ex1 >> (px * 4 + 2)) & 3),
+          ((uint32_t)v2[px * 2] << 2) + ((ex2 >> (px * 4)) & 3), ((uint32_t)v2[px * 2 + 1] << 2) + ((ex2 >> (px * 4 + 2)) & 3),
+        };
+        for (int k = 0; k < 4; ++k) {
+          if (hdr) {
+            if (ox == 0 && px == 0) {
+              pint[k] = (pint[k] << 4) | 8;
+            } else if (pint[k] < 0x200) {
+              pint[k] = pint_last[k] + dpcm_lookup[pint[k]];
+            } else {
+              uint32_t r2 = ((pint[k] - 0x200) << 5) | 0xF;
+              pint[k] = r2 + (r2 <= pint_last[k] ? 1 : 0);
+            }
+            pint_last[k] = pint[k];
+          }
+          s[k][ox + px] = (float)pint[k];
+        }
+
+        // vignetting is evaluated once per pair of output pixels, like the kernel
+        const float r = ((oy - rgb_height / 2) * (oy - rgb_height / 2) + (ox - rgb_width / 2) * (ox - rgb_width / 2));
+        lil_a[ox + px] = (1.0f + r / (fake_f * fake_f));
+      }
+    }
+
+    // the float math, four output pixels at a time
+    for (int x = 0; x < width4; x += 4) {
+      const f32x4 la = simd::load<f32x4>(&lil_a[x]);
+      f32x4 p[4];
+      for (int k = 0; k < 4; ++k) {
+        p[k] = (simd::load<f32x4>(&s[k][x]) - black_level) * la * la;
+        p[k] /= max_level;
+        p[k] *= gain;
+      }
+
+      // use both green channels, white balance and color correction
+      const f32x4 xr = clamp4(p[idx[0]] / 0.4609375f, 0.0f, 1.0f);
+      const f32x4 xg = clamp4((p[idx[1]] + p[idx[2]]) / 2.0f / 1.0f, 0.0f, 1.0f);
+      const f32x4 xb = clamp4(p[idx[3]] / 0.546875f, 0.0f, 1.0f);
+      for (int j = 0; j < 3; ++j) {
+        simd::store(&c[j][x], xr * color_correction[0][j] + xg * color_correction[1][j] + xb * color_correction[2][j]);
+      }
+    }
+
+    if (hdr) {
+      for (int j = 0; j < 3; ++j) {
+        for (int x = 0; x < rgb_width; ++x) {
+          const float v = c[j][x];
+          c[j][x] = v <= 0.0031308f ? v * 12.92f : (1.0f + 0.055f) * powf(v, 1 / 2.4f) - 0.055f;
+        }
+      }
+    }
+
+    // output BGR, convert_uchar3_sat rounds toward zero and saturates
+    uint8_t *out_row = &out[oy * rgb_stride];
+    for (int x = 0; x < width4; x += 4) {
+      i32x4 bgr[3];
+      for (int j = 0; j < 3; ++j) {
+        bgr[j] = __builtin_convertvector(clamp4(simd::load<f32x4>(&c[2 - j][x]) * 255.0f, 0.0f, 255.0f), i32x4);
+      }
+      for (int i = 0; i < std::min(4, rgb_width - x); ++i) {
+        out_row[(x + i) * 3 + 0] = bgr[0][i];
+        out_row[(x + i) * 3 + 1] = bgr[1][i];
+        out_row[(x + i) * 3 + 2] = bgr[2][i];
+      }
+    }
+  }
+}
+
+// Rgb2YuvCpu
+
+Rgb2YuvCpu::Rgb2YuvCpu(int width, int height, int rgb_stride) : width(width), height(height), rgb_stride(rgb_stride) {
+  assert(width % 2 == 0 && height % 2 == 0);
+}
+
+void Rgb2YuvCpu::run(const uint8_t *rgb, uint8_t *yuv) const {
+  util::parallel_for(height, 2, [=](int start, int end) { run_rows(rgb, yuv, start, end); });
+}
+
+void Rgb2YuvCpu::run_rows(const uint8_t *rgb, uint8_t *yuv, int start, int end) const {
+  const int uv_width = width / 2;
+  uint8_t *u_plane = yuv + width * height;
+  uint8_t *v_plane = u_plane + uv_width * (height / 2);
+
+  // planar scratch: b, g, r of two rows, then the 2x2 sums
+  std::vector<uint16_t> scratch(width * 6 + uv_width * 3);
+  uint16_t *b[2] = {&scratch[0], &scratch[width]};
+  uint16_t *g[2] = {&scratch[width * 2], &scratch[width * 3]};
+  uint16_t *r[2] = {&scratch[width * 4], &scratch[width * 5]};
+  uint16_t *ab = &scratch[width * 6], *ag = ab + uv_width, *ar = ag + uv_width;
+
+  for (int row = start; row < end; row += 2) {
+    for (int i = 0; i < 2; ++i) {
+      const uint8_t *src = &rgb[(row + i) * rgb_stride];
+      for (int x = 0; x < width; ++x) {
+        b[i][x] = src[x * 3 + 0];
+        g[i][x] = src[x * 3 + 1];
+        r[i][x] = src[x * 3 + 2];
+      }
+
+      uint8_t *y_out = &yuv[(row + i) * width];
+      int x = 0;
+      for (; x + LANES <= width; x += LANES) {
+        const u16x8 vr = simd::load<u16x8>(&r[i][x]), vg = simd::load<u16x8>(&g[i][x]), vb = simd::load<u16x8>(&b[i][x]);
+        simd::store(&y_out[x], __builtin_convertvector(rgb_to_y(vr, vg, vb), u8x8));
+      }
+      for (; x < width; ++x) {
+        y_out[x] = rgb_to_y<uint16_t>(r[i][x], g[i][x], b[i][x]);
+      }
+    }
+
+    // U & V: the kernel's AVERAGE of 2x2 pixels is (sum + 1) >> 1
+    for (int x = 0; x < uv_width; ++x) {
+      ab[x] = (b[0][x * 2] + b[0][x * 2 + 1] + b[1][x * 2] + b[1][x * 2 + 1] + 1) >> 1;
+      ag[x] = (g[0][x * 2] + g[0][x * 2 + 1] + g[1][x * 2] + g[1][x * 2 + 1] + 1) >> 1;
+      ar[x] = (r[0][x * 2] + r[0][x * 2 + 1] + r[1][x * 2] + r[1][x * 2 + 1] + 1) >> 1;
+    }
+
+    uint8_t *u_out = &u_plane[(row / 2) * uv_width];
+    uint8_t *v_out = &v_plane[(row / 2) * uv_width];
+    int x = 0;
+    for (; x + LANES <= uv_width; x += LANES) {
+      const u16x8 vr = simd::load<u16x8>(&ar[x]), vg = simd::load<u16x8>(&ag[x]), vb = simd::load<u16x8>(&ab[x]);
+      simd::store(&u_out[x], __builtin_convertvector(rgb_to_u(vr, vg, vb), u8x8));
+      simd::store(&v_out[x], __builtin_convertvector(rgb_to_v(vr, vg, vb), u8x8));
+    }
+    for (; x < uv_width; ++x) {
+      u_out[x] = rgb_to_u<uint16_t>(ar[x], ag[x], ab[x]);
+      v_out[x] = rgb_to_v<uint16_t>(ar[x], ag[x], ab[x]);
+    }
+  }
+}
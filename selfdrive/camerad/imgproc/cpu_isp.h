@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// CPU implementations of the camerad image pipeline, for hosts without an OpenCL GPU.
+// Both produce the same output as their kernels in cameras/debayer.cl and transforms/rgb_to_yuv.cl,
+// and split the frame into row bands processed by one thread per core.
+
+// port of debayer.cl (the non-TICI debayer, 2x downscaling RAW10 -> BGR)
+class DebayerCpu {
+public:
+  DebayerCpu(int frame_stride, int rgb_width, int rgb_height, int rgb_stride, int bayer_flip, bool hdr);
+  void run(const uint8_t *in, uint8_t *out, float gain) const;
+
+private:
+  void run_rows(const uint8_t *in, uint8_t *out, float gain, int start, int end) const;
+
+  const int frame_stride, rgb_width, rgb_height, rgb_stride;
+  const int bayer_flip;
+  const bool hdr;
+  int dpcm_lookup[512];
+};
+
+// port of rgb_to_yuv.cl (BGR -> I420), bit exact
+class Rgb2YuvCpu {
+public:
+  Rgb2YuvCpu(int width, int height, int rgb_stride);
+  void run(const uint8_t *rgb, uint8_t *yuv) const;
+
+private:
+  void run_rows(const uint8_t *rgb, uint8_t *yuv, int start, int end) const;
+
+  const int width, height, rgb_stride;
+};
@@ -0,0 +1,141 @@
+#include "selfdrive/camerad/imgproc/image_stats.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "selfdrive/common/simd.h"
+
+namespace {
+
+// four interleaved histograms, so runs of the same value don't serialize on one counter.
+// scattered increments don't vectorize, this is what the loop is bound by instead
+typedef uint32_t SubHistograms[4][256];
+
+struct LaplacianSums {
+  int64_t sum = 0;
+  double sum_sq = 0;
+  int max = 0;
+  uint32_t count = 0;
+};
+
+template <int SKIP>
+void histogram_row(const uint8_t *p, int n, int skip, SubHistograms &h) {
+  const int s = SKIP ? SKIP : skip;
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    h[0][p[i * s]]++;
+    h[1][p[(i + 1) * s]]++;
+    h[2][p[(i + 2) * s]]++;
+    h[3][p[(i + 3) * s]]++;
+  }
+  for (; i < n; ++i) {
+    h[0][p[i * s]]++;
+  }
+}
+
+inline i16x8 load8(const uint8_t *p) {
+  return __builtin_convertvector(simd::load<u8x8>(p), i16x8);
+}
+
+// 4-neighbour laplacian of row p over [x1, x2), the caller keeps x1 - 1 and x2 inside the image.
+// the laplacian fits in 16 bits, its square is summed as float to stay clear of 32 bit multiplies
+void laplacian_row(const uint8_t *p, int stride, int x1, int x2, LaplacianSums &sums) {
+  i32x8 vsum = {};
+  f32x8 vsum_sq = {};
+  i16x8 vmax = {};
+  int x = x1;
+  for (; x + 8 <= x2; x += 8) {
+    const i16x8 lap = load8(p + x - 1) + load8(p + x + 1) + load8(p + x - stride) + load8(p + x + stride) - 4 * load8(p + x);
+    const i32x8 lap32 = __builtin_convertvector(lap, i32x8);
+    const f32x8 lapf = __builtin_convertvector(lap32, f32x8);
+    vsum += lap32;
+    vsum_sq += lapf * lapf;
+    vmax = simd::select(lap > vmax, lap, vmax);
+  }
+
+  int64_t sum = 0;
+  double sum_sq = 0;
+  int max = sums.max;
+  for (int i = 0; i < 8; ++i) {
+    sum += vsum[i];
+    sum_sq += vsum_sq[i];
+    max = std::max(max, (int)vmax[i]);
+  }
+  for (; x < x2; ++x) {
+    const int lap = p[x - 1] + p[x + 1] + p[x - stride] + p[x + stride] - 4 * p[x];
+    sum += lap;
+    sum_sq += lap * lap;
+    max = std::max(max, lap);
+  }
+
+  sums.sum += sum;
+  sums.sum_sq += sum_sq;
+  sums.max = max;
+  sums.count += std::max(x2 - x1, 0);
+}
+
+}  // namespace
+
+int ImageStats::percentile(int p) const {
+  const uint64_t threshold = (uint64_t)count * (100 - p) / 100;
+  uint64_t cur = 0;
+  int v = 255;
+  for (; v >= 0; --v) {
+    cur += histogram[v];
+    if (cur >= threshold) break;
+  }
+  return v;
+}
+
+void image_stats(const uint8_t *y, int stride, const StatsRect *rects, ImageStats *stats, int num_rects) {
+  std::vector<SubHistograms> hist(num_rects);
+  std::vector<LaplacianSums> lap(num_rects);
+  memset(hist.data(), 0, hist.size() * sizeof(hist[0]));
+
+  int y_start = INT32_MAX, y_end = 0;
+  for (int i = 0; i < num_rects; ++i) {
+    y_start = std::min(y_start, rects[i].y1);
+    y_end = std::max(y_end, rects[i].y2);
+  }
+
+  // row major over the union of the rects, so each row is read from memory once
+  // while it's histogrammed and filtered for every rect that covers it
+  for (int row = y_start; row < y_end; ++row) {
+    const uint8_t *p = y + (size_t)row * stride;
+    for (int i = 0; i < num_rects; ++i) {
+      const StatsRect &r = rects[i];
+      if (row < r.y1 || row >= r.y2) continue;
+
+      if ((row - r.y1) % r.y_skip == 0 && r.x2 > r.x1) {
+        const int n = (r.x2 - r.x1 + r.x_skip - 1) / r.x_skip;
+        switch (r.x_skip) {
+          case 1: histogram_row<1>(p + r.x1, n, 1, hist[i]); break;
+          case 2: histogram_row<2>(p + r.x1, n, 2, hist[i]); break;
+          default: histogram_row<0>(p + r.x1, n, r.x_skip, hist[i]); break;
+        }
+      }
+      if (r.sharpness && row > r.y1 && row < r.y2 - 1) {
+        laplacian_row(p, stride, r.x1 + 1, r.x2 - 1, lap[i]);
+      }
+    }
+  }
+
+  for (int i = 0; i < num_rects; ++i) {
+    ImageStats &s = stats[i];
+    s.count = 0;
+    s.sum = 0;
+    for (int v = 0; v < 256; ++v) {
+      s.histogram[v] = hist[i][0][v] + hist[i][1][v] + hist[i][2][v] + hist[i][3][v];
+      s.count += s.histogram[v];
+      s.sum += (uint64_t)v * s.histogram[v];
+    }
+
+    s.sharpness = 0;
+    if (const LaplacianSums &l = lap[i]; l.count > 0) {
+      const float mean = (float)l.sum / l.count;
+      const float var = l.sum_sq / l.count - mean * mean;
+      s.sharpness = std::min(5 * var + l.max, 65535.f);
+    }
+  }
+}
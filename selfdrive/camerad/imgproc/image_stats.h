@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+
+// luminance statistics of rectangles in a Y plane, for auto exposure.
+// all the rectangles are gathered in a single pass over the rows of the image
+
+struct StatsRect {
+  // half open ranges, sampling every x_skip'th column of every y_skip'th row
+  int x1, x2, x_skip;
+  int y1, y2, y_skip;
+  // also score the sharpness of the rect. this uses every pixel, not just the sampled ones
+  bool sharpness = false;
+};
+
+struct ImageStats {
+  uint32_t histogram[256];
+  uint32_t count;
+  uint64_t sum;
+  // 5 * variance + max of the laplacian, the score get_lapmap_one gives the rgb ROIs
+  uint16_t sharpness;
+
+  float mean() const { return count ? (float)sum / count : 0; }
+  // the highest value with at least (100 - p)% of the samples at or above it, percentile(50) is the median
+  int percentile(int p) const;
+};
+
+void image_stats(const uint8_t *y, int stride, const StatsRect *rects, ImageStats *stats, int num_rects);
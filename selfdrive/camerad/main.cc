@@ -52,7 +52,13 @@ int main(int argc, char *argv[]) {
     assert(ret == 0 || Params().getBool("IsOffroad")); // failure ok while offroad due to offlining cores
   }
 
-  cl_device_id device_id = cl_get_device_id(CL_DEVICE_TYPE_DEFAULT);
+  // on PC, fall back to the CPU image pipeline when there is no OpenCL GPU
+  cl_device_id device_id = Hardware::PC() ? cl_find_device_id(CL_DEVICE_TYPE_GPU) : cl_get_device_id(CL_DEVICE_TYPE_DEFAULT);
+  if (!device_id) {
+    LOGW("no OpenCL GPU found, debayering and converting frames on the CPU");
+    party(nullptr, nullptr);
+    return 0;
+  }
 
    // TODO: do this for QCOM2 too
 #if defined(QCOM)
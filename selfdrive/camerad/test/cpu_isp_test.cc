@@ -0,0 +1,127 @@
+// compares the CPU image pipeline (imgproc/cpu_isp.cc) against the OpenCL kernels,
+// and benchmarks both at 1928x1208
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "selfdrive/camerad/imgproc/cpu_isp.h"
+#include "selfdrive/camerad/transforms/rgb_to_yuv.h"
+#include "selfdrive/common/tests/cpu_port_test.h"
+
+const int BENCHMARK_WIDTH = 1928, BENCHMARK_HEIGHT = 1208;
+const int BENCHMARK_FRAMES = 50;
+
+std::vector<uint8_t> random_bytes(size_t size, uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::vector<uint8_t> v(size);
+  for (auto &b : v) b = rng();
+  return v;
+}
+
+int max_diff(const std::vector<uint8_t> &a, const std::vector<uint8_t> &b) {
+  assert(a.size() == b.size());
+  int diff = 0;
+  for (size_t i = 0; i < a.size(); ++i) diff = std::max(diff, std::abs(a[i] - b[i]));
+  return diff;
+}
+
+// rgb_to_yuv has integer math only, the CPU port must be bit exact
+bool test_rgb2yuv(ClEnv &cl, int width, int height, int stride, bool benchmark) {
+  const size_t yuv_size = width * height * 3 / 2;
+  // the kernel reads up to 4 bytes past the last pixel
+  auto rgb = random_bytes(stride * height + 4, width);
+
+  std::vector<uint8_t> cpu_yuv(yuv_size);
+  Rgb2YuvCpu rgb2yuv_cpu(width, height, stride);
+  rgb2yuv_cpu.run(rgb.data(), cpu_yuv.data());
+
+  Rgb2Yuv rgb2yuv(cl.ctx, cl.device_id, width, height, stride);
+  cl_mem rgb_cl = cl.create(rgb.size(), rgb.data()), yuv_cl = cl.create(yuv_size);
+  rgb2yuv.queue(cl.q, rgb_cl, yuv_cl);
+
+  const int diff = max_diff(cpu_yuv, cl.read(yuv_cl, yuv_size));
+  printf("rgb_to_yuv %dx%d: max diff %d\n", width, height, diff);
+  if (benchmark) {
+    printf("  cpu %.2f ms/frame, opencl %.2f ms/frame\n",
+           time_ms(BENCHMARK_FRAMES, [&] { rgb2yuv_cpu.run(rgb.data(), cpu_yuv.data()); }),
+           time_ms(BENCHMARK_FRAMES, [&] { rgb2yuv.queue(cl.q, rgb_cl, yuv_cl); }));
+  }
+
+  CL_CHECK(clReleaseMemObject(rgb_cl));
+  CL_CHECK(clReleaseMemObject(yuv_cl));
+  return diff == 0;
+}
+
+// debayer.cl is built with -cl-fast-relaxed-math, allow off by one
+bool test_debayer(ClEnv &cl, int frame_width, int frame_height, int bayer_flip, bool hdr, bool benchmark) {
+  const int frame_stride = frame_width * 10 / 8;
+  const int rgb_width = frame_width / 2, rgb_height = frame_height / 2, rgb_stride = rgb_width * 3;
+  const float gain = 1.5;
+  auto raw = random_bytes(frame_stride * frame_height, frame_width + bayer_flip);
+
+  std::vector<uint8_t> cpu_rgb(rgb_stride * rgb_height);
+  DebayerCpu debayer_cpu(frame_stride, rgb_width, rgb_height, rgb_stride, bayer_flip, hdr);
+  debayer_cpu.run(raw.data(), cpu_rgb.data(), gain);
+
+  char args[4096];
+  snprintf(args, sizeof(args),
+           "-cl-fast-relaxed-math -cl-denorms-are-zero "
+           "-DFRAME_WIDTH=%d -DFRAME_HEIGHT=%d -DFRAME_STRIDE=%d "
+           "-DRGB_WIDTH=%d -DRGB_HEIGHT=%d -DRGB_STRIDE=%d "
+           "-DBAYER_FLIP=%d -DHDR=%d -DCAM_NUM=0",
+           frame_width, frame_height, frame_stride, rgb_width, rgb_height, rgb_stride, bayer_flip, hdr);
+  cl_program prg = cl_program_from_file(cl.ctx, cl.device_id, "cameras/debayer.cl", args);
+  cl_kernel krnl = CL_CHECK_ERR(clCreateKernel(prg, "debayer10", &err));
+  CL_CHECK(clReleaseProgram(prg));
+
+  cl_mem raw_cl = cl.create(raw.size(), raw.data()), rgb_cl = cl.create(cpu_rgb.size());
+  CL_CHECK(clSetKernelArg(krnl, 0, sizeof(cl_mem), &raw_cl));
+  CL_CHECK(clSetKernelArg(krnl, 1, sizeof(cl_mem), &rgb_cl));
+  CL_CHECK(clSetKernelArg(krnl, 2, sizeof(float), &gain));
+  auto run_cl = [&]() {
+    const size_t work_size = rgb_height;
+    CL_CHECK(clEnqueueNDRangeKernel(cl.q, krnl, 1, NULL, &work_size, NULL, 0, 0, NULL));
+    CL_CHECK(clFinish(cl.q));
+  };
+  run_cl();
+
+  const int diff = max_diff(cpu_rgb, cl.read(rgb_cl, cpu_rgb.size()));
+  printf("debayer %dx%d flip %d hdr %d: max diff %d\n", frame_width, frame_height, bayer_flip, hdr, diff);
+  if (benchmark) {
+    printf("  cpu %.2f ms/frame, opencl %.2f ms/frame\n",
+           time_ms(BENCHMARK_FRAMES, [&] { debayer_cpu.run(raw.data(), cpu_rgb.data(), gain); }), time_ms(BENCHMARK_FRAMES, run_cl));
+  }
+
+  CL_CHECK(clReleaseMemObject(raw_cl));
+  CL_CHECK(clReleaseMemObject(rgb_cl));
+  CL_CHECK(clReleaseKernel(krnl));
+  return diff <= 1;
+}
+
+int main() {
+  chdir_to_daemon();
+  ClEnv cl;
+  if (!cl.device_id) {
+    printf("no OpenCL device, skipping\n");
+    return 0;
+  }
+
+  bool passed = true;
+  // road camera on tici, eon road and driver cameras, and an odd multiple of 2
+  passed &= test_rgb2yuv(cl, BENCHMARK_WIDTH, BENCHMARK_HEIGHT, BENCHMARK_WIDTH * 3, true);
+  passed &= test_rgb2yuv(cl, 1164, 874, 1164 * 3 + 12, false);
+  passed &= test_rgb2yuv(cl, 816, 612, 816 * 3, false);
+  passed &= test_rgb2yuv(cl, 30, 6, 30 * 3, false);
+
+  for (int bayer_flip = 0; bayer_flip < 4; ++bayer_flip) {
+    passed &= test_debayer(cl, 1632, 1224, bayer_flip, false, false);
+  }
+  passed &= test_debayer(cl, 1632, 1224, 0, true, false);
+  passed &= test_debayer(cl, BENCHMARK_WIDTH * 2, BENCHMARK_HEIGHT * 2, 0, false, true);
+
+  return test_result(passed);
+}
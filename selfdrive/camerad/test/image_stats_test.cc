@@ -0,0 +1,161 @@
+// checks imgproc/image_stats.cc against straightforward scalar loops, and benchmarks it
+// against the per-pixel loop set_exposure_target used before, at 1928x1208
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "selfdrive/camerad/imgproc/image_stats.h"
+
+const int WIDTH = 1928, HEIGHT = 1208;
+const int BENCHMARK_FRAMES = 200;
+
+// the previous set_exposure_target, minus the CameraBuf
+int scalar_median(const uint8_t *pix_ptr, int stride, int x_start, int x_end, int x_skip, int y_start, int y_end, int y_skip) {
+  int lum_med;
+  uint32_t lum_binning[256] = {0};
+  unsigned int lum_total = 0;
+  for (int y = y_start; y < y_end; y += y_skip) {
+    for (int x = x_start; x < x_end; x += x_skip) {
+      uint8_t lum = pix_ptr[(y * stride) + x];
+      lum_binning[lum]++;
+      lum_total += 1;
+    }
+  }
+
+  unsigned int lum_cur = 0;
+  for (lum_med = 255; lum_med >= 0; lum_med--) {
+    lum_cur += lum_binning[lum_med];
+    if (lum_cur >= lum_total / 2) {
+      break;
+    }
+  }
+  return lum_med;
+}
+
+ImageStats scalar_stats(const uint8_t *y, int stride, const StatsRect &r) {
+  ImageStats s = {};
+  for (int row = r.y1; row < r.y2; row += r.y_skip) {
+    for (int x = r.x1; x < r.x2; x += r.x_skip) {
+      s.histogram[y[row * stride + x]]++;
+      s.count++;
+      s.sum += y[row * stride + x];
+    }
+  }
+
+  if (r.sharpness) {
+    std::vector<int> lap;
+    for (int row = r.y1 + 1; row < r.y2 - 1; ++row) {
+      for (int x = r.x1 + 1; x < r.x2 - 1; ++x) {
+        const uint8_t *p = &y[row * stride + x];
+        lap.push_back(p[-1] + p[1] + p[-stride] + p[stride] - 4 * p[0]);
+      }
+    }
+    double mean = 0, var = 0;
+    int max = 0;
+    for (int v : lap) {
+      mean += v;
+      max = std::max(max, v);
+    }
+    mean /= lap.size();
+    for (int v : lap) var += (v - mean) * (v - mean);
+    var /= lap.size();
+    s.sharpness = std::min(5 * var + max, 65535.);
+  }
+  return s;
+}
+
+// smooth gradients plus noise, so the histogram isn't flat and the laplacian isn't constant
+std::vector<uint8_t> test_image(int seed) {
+  std::mt19937 rng(seed);
+  std::vector<uint8_t> img(WIDTH * HEIGHT);
+  for (int y = 0; y < HEIGHT; ++y) {
+    for (int x = 0; x < WIDTH; ++x) {
+      img[y * WIDTH + x] = std::clamp<int>(128 + 100 * std::sin(x * 0.01 * seed) * std::cos(y * 0.007) + (rng() % 17) - 8, 0, 255);
+    }
+  }
+  return img;
+}
+
+bool check(const uint8_t *img, const StatsRect &r, const ImageStats &s) {
+  const ImageStats ref = scalar_stats(img, WIDTH, r);
+  const int ref_median = scalar_median(img, WIDTH, r.x1, r.x2, r.x_skip, r.y1, r.y2, r.y_skip);
+  bool ok = memcmp(s.histogram, ref.histogram, sizeof(ref.histogram)) == 0 &&
+            s.count == ref.count && s.sum == ref.sum && s.percentile(50) == ref_median;
+  // float vs double variance
+  ok &= std::abs(s.sharpness - ref.sharpness) <= std::max(1, ref.sharpness / 1000);
+  printf("[%d, %d) x%d [%d, %d) x%d: median %d/%d, mean %.2f, p90 %d, sharpness %d/%d %s\n",
+         r.x1, r.x2, r.x_skip, r.y1, r.y2, r.y_skip, s.percentile(50), ref_median, s.mean(),
+         s.percentile(90), s.sharpness, ref.sharpness, ok ? "ok" : "FAILED");
+  return ok;
+}
+
+template <typename F>
+double time_us(F fn) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < BENCHMARK_FRAMES; ++i) {
+    fn();
+    // the image "changes" every frame, so nothing is hoisted out of the loop
+    asm volatile("" ::: "memory");
+  }
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / BENCHMARK_FRAMES;
+}
+
+int main() {
+  // the road and wide road AE rects on tici, the tici driver rect, and some odd shapes
+  const std::vector<StatsRect> rects = {
+    {96, 96 + 1734, 2, 160, 160 + 986, 2},
+    {96, 96 + 1734, 2, 250, 250 + 524, 2, true},
+    {96, 1832, 2, 242, 1148, 4},
+    {0, WIDTH, 1, 0, HEIGHT, 1},
+    {1, WIDTH - 1, 1, 1, HEIGHT - 1, 1, true},
+    {7, 150, 3, 11, 300, 5, true},
+    {500, 505, 1, 600, 603, 1, true},
+    {10, 10, 1, 10, 20, 1},
+  };
+
+  bool passed = true;
+  for (int seed = 1; seed <= 3; ++seed) {
+    const auto img = test_image(seed);
+    // every rect on its own, and all of them in one call
+    std::vector<ImageStats> all(rects.size());
+    image_stats(img.data(), WIDTH, rects.data(), all.data(), rects.size());
+    for (size_t i = 0; i < rects.size(); ++i) {
+      ImageStats one;
+      image_stats(img.data(), WIDTH, &rects[i], &one, 1);
+      passed &= check(img.data(), rects[i], one);
+      passed &= memcmp(one.histogram, all[i].histogram, sizeof(one.histogram)) == 0 && one.sharpness == all[i].sharpness;
+    }
+  }
+
+  const auto img = test_image(1);
+  ImageStats s[3];
+  int median = 0;
+  printf("\nbenchmark %dx%d, us/frame:\n", WIDTH, HEIGHT);
+  for (auto &r : {rects[0], rects[2], rects[3]}) {
+    printf("  [%d, %d) x%d [%d, %d) x%d: scalar %.1f, image_stats %.1f\n", r.x1, r.x2, r.x_skip, r.y1, r.y2, r.y_skip,
+           time_us([&] { median += scalar_median(img.data(), WIDTH, r.x1, r.x2, r.x_skip, r.y1, r.y2, r.y_skip); }),
+           time_us([&] { image_stats(img.data(), WIDTH, &r, s, 1); median += s[0].percentile(50); }));
+  }
+  StatsRect ae_rects[3] = {rects[0], rects[1], rects[2]};
+  ae_rects[1].sharpness = false;
+  printf("  road, wide road and driver rects in one pass: %.1f, scalar %.1f\n",
+         time_us([&] { image_stats(img.data(), WIDTH, ae_rects, s, 3); }),
+         time_us([&] {
+           for (const StatsRect &r : ae_rects) {
+             median += scalar_median(img.data(), WIDTH, r.x1, r.x2, r.x_skip, r.y1, r.y2, r.y_skip);
+           }
+         }));
+  StatsRect sharp = rects[0];
+  sharp.sharpness = true;
+  printf("  road rect with sharpness: %.1f\n", time_us([&] { image_stats(img.data(), WIDTH, &sharp, s, 1); }));
+  // keeps the timed loops from being optimized out
+  printf("  (%d)\n", median);
+
+  printf(passed ? "all tests passed\n" : "TEST FAILED\n");
+  return passed ? 0 : -1;
+}
@@ -1,10 +1,18 @@
 #include "selfdrive/common/clutil.h"
 
+#include <unistd.h>
+
 #include <cassert>
+#include <cstring>
+#include <iomanip>
 #include <iostream>
 #include <memory>
+#include <sstream>
 
+#include "selfdrive/common/clutil_cache.h"
+#include "selfdrive/common/timing.h"
 #include "selfdrive/common/util.h"
+#include "selfdrive/hardware/hw.h"
 
 namespace {  // helper functions
 
@@ -52,11 +60,112 @@ void cl_print_build_errors(cl_program program, cl_device_id device) {
   std::cout << "build failed; status=" << status << ", log:" << std::endl << log << std::endl; 
 }
 
+std::string cl_cache_key(cl_device_id device_id, const std::string &src, const char *args) {
+  cl_platform_id platform;
+  CL_CHECK(clGetDeviceInfo(device_id, CL_DEVICE_PLATFORM, sizeof(platform), &platform, NULL));
+  return get_platform_info(platform, CL_PLATFORM_VERSION) + get_device_info(device_id, CL_DEVICE_NAME) +
+         get_device_info(device_id, CL_DEVICE_VERSION) + get_device_info(device_id, CL_DRIVER_VERSION) +
+         (args ? args : "") + '\0' + src;
+}
+
+std::string cl_cache_path(const std::string &key) {
+  std::ostringstream path;
+  path << Path::cl_cache() << "/" << std::hex << std::setw(16) << std::setfill('0') << fnv1a(key.data(), key.size()) << ".bin";
+  return path.str();
+}
+
+// returns an empty string on a miss, a stale entry or a corrupt file
+std::string cl_cache_load(const std::string &path, const std::string &key) {
+  std::string file = util::read_file(path);
+  CLCacheHeader header;
+  if (file.size() < sizeof(header)) return "";
+
+  memcpy(&header, file.data(), sizeof(header));
+  std::string binary = file.substr(sizeof(header));
+  if (memcmp(header.magic, CL_CACHE_MAGIC, sizeof(CL_CACHE_MAGIC)) != 0 ||
+      header.key_hash != fnv1a(key.data(), key.size(), ~0ULL) ||
+      header.binary_size != binary.size() ||
+      header.binary_hash != fnv1a(binary.data(), binary.size())) {
+    return "";
+  }
+  return binary;
+}
+
+void cl_cache_store(cl_program prg, const std::string &path, const std::string &key) {
+  size_t binary_size = 0;
+  CL_CHECK(clGetProgramInfo(prg, CL_PROGRAM_BINARY_SIZES, sizeof(binary_size), &binary_size, NULL));
+  if (binary_size == 0) return;
+
+  std::string file(sizeof(CLCacheHeader) + binary_size, '\0');
+  uint8_t *binary = (uint8_t *)&file[sizeof(CLCacheHeader)];
+  CL_CHECK(clGetProgramInfo(prg, CL_PROGRAM_BINARIES, sizeof(binary), &binary, NULL));
+
+  CLCacheHeader header = {.key_hash = fnv1a(key.data(), key.size(), ~0ULL),
+                          .binary_hash = fnv1a(binary, binary_size),
+                          .binary_size = binary_size};
+  memcpy(header.magic, CL_CACHE_MAGIC, sizeof(CL_CACHE_MAGIC));
+  memcpy(&file[0], &header, sizeof(header));
+
+  // other processes may be loading the same program, write to a temp file and rename it into place
+  const std::string tmp_path = path + "." + std::to_string(getpid());
+  if (!util::create_directories(Path::cl_cache(), 0775) ||
+      util::write_file(tmp_path.c_str(), file.data(), file.size(), O_WRONLY | O_CREAT | O_TRUNC) != 0 ||
+      rename(tmp_path.c_str(), path.c_str()) != 0) {
+    std::cout << "failed to write OpenCL program cache " << path << std::endl;
+    unlink(tmp_path.c_str());
+  }
+}
+
+// nullptr if the driver rejects the binary, e.g. one it can't load anymore after an update
+cl_program cl_cache_program(cl_context ctx, cl_device_id device_id, const std::string &binary, const char *args) {
+  const uint8_t *binary_ptr = (const uint8_t *)binary.data();
+  const size_t binary_size = binary.size();
+  cl_int binary_status = CL_SUCCESS, err = CL_SUCCESS;
+  cl_program prg = clCreateProgramWithBinary(ctx, 1, &device_id, &binary_size, &binary_ptr, &binary_status, &err);
+  if (err != CL_SUCCESS || binary_status != CL_SUCCESS) {
+    if (prg) clReleaseProgram(prg);
+    return nullptr;
+  }
+  if (clBuildProgram(prg, 1, &device_id, args, NULL, NULL) != CL_SUCCESS) {
+    clReleaseProgram(prg);
+    return nullptr;
+  }
+  return prg;
+}
+
+cl_program build_program(cl_context ctx, cl_device_id device_id, const std::string &src, const char *args, const char *name) {
+  const std::string key = cl_cache_key(device_id, src, args);
+  const std::string path = cl_cache_path(key);
+  const double start_ms = millis_since_boot();
+
+  if (std::string binary = cl_cache_load(path, key); !binary.empty()) {
+    if (cl_program prg = cl_cache_program(ctx, device_id, binary, args)) {
+      std::cout << name << ": loaded from the OpenCL program cache in " << millis_since_boot() - start_ms << " ms" << std::endl;
+      return prg;
+    }
+    std::cout << name << ": the driver rejected the cached binary " << path << ", compiling again" << std::endl;
+    unlink(path.c_str());
+  }
+
+  cl_program prg = CL_CHECK_ERR(clCreateProgramWithSource(ctx, 1, (const char*[]){src.c_str()}, NULL, &err));
+  if (int err = clBuildProgram(prg, 1, &device_id, args, NULL, NULL); err != 0) {
+    cl_print_build_errors(prg, device_id);
+    assert(0);
+  }
+  const double compile_ms = millis_since_boot() - start_ms;
+  cl_cache_store(prg, path, key);
+  std::cout << name << ": compiled in " << compile_ms << " ms, cached to " << path << std::endl;
+  return prg;
+}
+
 }  // namespace
 
-cl_device_id cl_get_device_id(cl_device_type device_type) {
+cl_device_id cl_find_device_id(cl_device_type device_type) {
+  // the ICD loader returns CL_PLATFORM_NOT_FOUND_KHR when there are no platforms
   cl_uint num_platforms = 0;
-  CL_CHECK(clGetPlatformIDs(0, NULL, &num_platforms));
+  if (clGetPlatformIDs(0, NULL, &num_platforms) != CL_SUCCESS || num_platforms == 0) {
+    return nullptr;
+  }
   std::unique_ptr<cl_platform_id[]> platform_ids = std::make_unique<cl_platform_id[]>(num_platforms);
   CL_CHECK(clGetPlatformIDs(num_platforms, &platform_ids[0], NULL));
 
@@ -68,22 +177,24 @@ cl_device_id cl_get_device_id(cl_device_type device_type) {
       return device_id;
     }
   }
-  std::cout << "No valid openCL platform found" << std::endl;
-  assert(0);
   return nullptr;
 }
 
+cl_device_id cl_get_device_id(cl_device_type device_type) {
+  cl_device_id device_id = cl_find_device_id(device_type);
+  if (!device_id) {
+    std::cout << "No valid openCL platform found" << std::endl;
+    assert(0);
+  }
+  return device_id;
+}
+
 cl_program cl_program_from_file(cl_context ctx, cl_device_id device_id, const char* path, const char* args) {
-  return cl_program_from_source(ctx, device_id, util::read_file(path), args);
+  return build_program(ctx, device_id, util::read_file(path), args, path);
 }
 
 cl_program cl_program_from_source(cl_context ctx, cl_device_id device_id, const std::string& src, const char* args) {
-  cl_program prg = CL_CHECK_ERR(clCreateProgramWithSource(ctx, 1, (const char*[]){src.c_str()}, NULL, &err));
-  if (int err = clBuildProgram(prg, 1, &device_id, args, NULL, NULL); err != 0) {
-    cl_print_build_errors(prg, device_id);
-    assert(0);
-  }
-  return prg;
+  return build_program(ctx, device_id, src, args, "OpenCL program");
 }
 
 cl_program cl_program_from_binary(cl_context ctx, cl_device_id device_id, const uint8_t* binary, size_t length, const char* args) {
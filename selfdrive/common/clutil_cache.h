@@ -0,0 +1,24 @@
+#pragma once
+
+// the format of the program binary cache of clutil.cc, for it and its tests
+
+#include <cstddef>
+#include <cstdint>
+
+// Compiled programs are cached in Path::cl_cache(), keyed by the source, the build options and
+// the device and driver versions, so an OTA or a driver update compiles again.
+// a cache file is a CLCacheHeader followed by the CL_PROGRAM_BINARIES of the program
+struct CLCacheHeader {
+  char magic[4];
+  uint64_t key_hash;  // a second hash of the key, the file name is the first
+  uint64_t binary_hash;
+  uint64_t binary_size;
+};
+inline constexpr char CL_CACHE_MAGIC[4] = {'C', 'L', 'C', '1'};
+
+inline uint64_t fnv1a(const void *data, size_t size, uint64_t hash = 0xcbf29ce484222325) {
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ ((const uint8_t *)data)[i]) * 0x100000001b3;
+  }
+  return hash;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+
+// Fixed size, allocation free histogram of latencies in ms.
+// Buckets are log-scaled with 8 buckets per doubling (~9% resolution) from 1us to ~16s.
+// Not thread safe, keep one per thread and merge() when reporting.
+class LatencyHistogram {
+public:
+  inline void add(double ms) {
+    int idx = 0;
+    if (ms > MIN_MS) {
+      idx = std::min((int)(std::log2(ms / MIN_MS) * BUCKETS_PER_DOUBLING) + 1, NUM_BUCKETS - 1);
+    }
+    buckets[idx]++;
+    cnt++;
+    sum += ms;
+    max_ms = std::max(max_ms, ms);
+  }
+
+  inline void merge(const LatencyHistogram &other) {
+    for (int i = 0; i < NUM_BUCKETS; ++i) buckets[i] += other.buckets[i];
+    cnt += other.cnt;
+    sum += other.sum;
+    max_ms = std::max(max_ms, other.max_ms);
+  }
+
+  // upper bound of the bucket containing the p-th percentile, p in [0, 100]
+  double percentile(double p) const {
+    if (cnt == 0) return 0.;
+
+    uint64_t target = std::max<uint64_t>(1, std::ceil(cnt * p / 100.));
+    uint64_t seen = 0;
+    for (int i = 0; i < NUM_BUCKETS; ++i) {
+      seen += buckets[i];
+      if (seen >= target) {
+        return std::min(MIN_MS * std::exp2((double)i / BUCKETS_PER_DOUBLING), max_ms);
+      }
+    }
+    return max_ms;
+  }
+
+  inline uint64_t count() const { return cnt; }
+  inline double mean() const { return cnt > 0 ? sum / cnt : 0.; }
+  inline double max() const { return max_ms; }
+  inline void reset() { *this = LatencyHistogram(); }
+
+private:
+  static constexpr double MIN_MS = 0.001;
+  static constexpr int BUCKETS_PER_DOUBLING = 8;
+  static constexpr int NUM_BUCKETS = 24 * BUCKETS_PER_DOUBLING + 1;
+
+  std::array<uint64_t, NUM_BUCKETS> buckets = {};
+  uint64_t cnt = 0;
+  double sum = 0.;
+  double max_ms = 0.;
+};
@@ -0,0 +1,218 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <new>
+#include <optional>
+#include <utility>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <condition_variable>
+#include <mutex>
+#endif
+
+// what push() does when the queue is full
+enum class OverflowPolicy {
+  Block,       // wait for a pop
+  DropOldest,  // discard the oldest item to make room
+  DropNewest,  // discard the item being pushed, push() returns false
+};
+
+// A 32 bit counter threads can sleep on until it changes. On linux this is a futex,
+// elsewhere a mutex and condition variable that are only touched by sleepers and wakers.
+class WaitCounter {
+public:
+  uint32_t load() const { return value.load(std::memory_order_seq_cst); }
+
+  // increments the counter and wakes a sleeper if there is one
+  void increment() {
+    value.fetch_add(1, std::memory_order_seq_cst);
+    if (waiters.load(std::memory_order_seq_cst) > 0) wake();
+  }
+
+  // sleeps until the counter isn't `expected`, returns false on timeout (timeout_ms < 0 waits forever).
+  // may return early, callers recheck their condition
+  bool wait(uint32_t expected, int timeout_ms) {
+    waiters.fetch_add(1, std::memory_order_seq_cst);
+    bool ret = true;
+    if (value.load(std::memory_order_seq_cst) == expected) {
+#ifdef __linux__
+      struct timespec ts = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+      ret = syscall(SYS_futex, (uint32_t *)&value, FUTEX_WAIT_PRIVATE, expected, timeout_ms < 0 ? nullptr : &ts, nullptr, 0) == 0 ||
+            errno != ETIMEDOUT;
+#else
+      std::unique_lock lk(m);
+      auto changed = [&] { return value.load(std::memory_order_seq_cst) != expected; };
+      if (timeout_ms < 0) {
+        cv.wait(lk, changed);
+      } else {
+        ret = cv.wait_for(lk, std::chrono::milliseconds(timeout_ms), changed);
+      }
+#endif
+    }
+    waiters.fetch_sub(1, std::memory_order_seq_cst);
+    return ret;
+  }
+
+private:
+  void wake() {
+#ifdef __linux__
+    syscall(SYS_futex, (uint32_t *)&value, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#else
+    { std::scoped_lock lk(m); }
+    cv.notify_one();
+#endif
+  }
+
+  static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t));
+  std::atomic<uint32_t> value = 0;
+  std::atomic<int> waiters = 0;
+#ifndef __linux__
+  std::mutex m;
+  std::condition_variable cv;
+#endif
+};
+
+// Bounded lock-free MPMC queue (Vyukov's sequenced ring), a drop-in for SafeQueue on hot paths.
+// Slots are preallocated, push and pop never allocate and only enter the kernel to sleep or
+// to wake a sleeper. Single producer/consumer use is the same code without contention.
+template <typename T, size_t Capacity>
+class RingQueue {
+public:
+  explicit RingQueue(OverflowPolicy policy = OverflowPolicy::Block) : policy(policy) {
+    for (size_t i = 0; i < Capacity; ++i) {
+      slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+  ~RingQueue() {
+    while (try_dequeue([](T &&) {})) {}
+  }
+  RingQueue(const RingQueue &) = delete;
+  RingQueue &operator=(const RingQueue &) = delete;
+
+  // returns false if the item was dropped
+  bool push(const T &v) {
+    while (!try_enqueue(v)) {
+      switch (policy) {
+        case OverflowPolicy::DropNewest:
+          dropped_count.fetch_add(1, std::memory_order_relaxed);
+          return false;
+        case OverflowPolicy::DropOldest:
+          if (try_dequeue([](T &&) {})) {
+            dropped_count.fetch_add(1, std::memory_order_relaxed);
+          }
+          break;
+        case OverflowPolicy::Block:
+          if (uint32_t seq = popped.load(); !try_enqueue(v)) {
+            popped.wait(seq, -1);
+            continue;
+          }
+          pushed.increment();
+          return true;
+      }
+    }
+    pushed.increment();
+    return true;
+  }
+
+  T pop() {
+    std::optional<T> v;
+    wait_dequeue([&](T &&item) { v.emplace(std::move(item)); }, -1);
+    return std::move(*v);
+  }
+
+  // waits up to timeout_ms for an item, forever if timeout_ms < 0
+  bool try_pop(T &v, int timeout_ms = 0) {
+    return wait_dequeue([&](T &&item) { v = std::move(item); }, timeout_ms);
+  }
+
+  bool empty() const { return size() == 0; }
+  size_t size() const {
+    const size_t tail = dequeue_pos.load(std::memory_order_acquire);
+    const size_t head = enqueue_pos.load(std::memory_order_acquire);
+    return head > tail ? head - tail : 0;
+  }
+  // items discarded by the overflow policy
+  uint64_t dropped() const { return dropped_count.load(std::memory_order_relaxed); }
+
+private:
+  bool try_enqueue(const T &v) {
+    size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    while (true) {
+      Slot &slot = slots[pos % Capacity];
+      const intptr_t diff = (intptr_t)slot.seq.load(std::memory_order_acquire) - (intptr_t)pos;
+      if (diff == 0) {
+        if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          new (slot.storage) T(v);
+          slot.seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;  // full
+      } else {
+        pos = enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  template <typename F>
+  bool wait_dequeue(F &&consume, int timeout_ms) {
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (!try_dequeue(consume)) {
+      const uint32_t seq = pushed.load();
+      if (try_dequeue(consume)) break;
+
+      int wait_ms = -1;
+      if (timeout_ms >= 0) {
+        auto remaining = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        if (remaining <= 0) return false;
+        wait_ms = remaining;
+      }
+      pushed.wait(seq, wait_ms);
+    }
+    if (policy == OverflowPolicy::Block) popped.increment();
+    return true;
+  }
+
+  // moves the oldest item into consume(T &&), so T doesn't need to be default constructible or assignable
+  template <typename F>
+  bool try_dequeue(F &&consume) {
+    size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+    while (true) {
+      Slot &slot = slots[pos % Capacity];
+      const intptr_t diff = (intptr_t)slot.seq.load(std::memory_order_acquire) - (intptr_t)(pos + 1);
+      if (diff == 0) {
+        if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          T *item = std::launder(reinterpret_cast<T *>(slot.storage));
+          consume(std::move(*item));
+          item->~T();
+          slot.seq.store(pos + Capacity, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;  // empty
+      } else {
+        pos = dequeue_pos.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  struct Slot {
+    std::atomic<size_t> seq;
+    alignas(T) unsigned char storage[sizeof(T)];
+  };
+
+  const OverflowPolicy policy;
+  Slot slots[Capacity];
+  // producers and consumers on separate cache lines
+  alignas(64) std::atomic<size_t> enqueue_pos = 0;
+  alignas(64) std::atomic<size_t> dequeue_pos = 0;
+  alignas(64) WaitCounter pushed, popped;
+  std::atomic<uint64_t> dropped_count = 0;
+};
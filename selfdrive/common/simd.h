@@ -0,0 +1,66 @@
+#pragma once
+
+// GCC/clang vector extensions, lowered to SSE/AVX2 or NEON depending on the target. loads and
+// stores go through memcpy, pointers need no alignment
+
+#include <cstdint>
+#include <cstring>
+
+typedef uint8_t u8x8 __attribute__((vector_size(8)));
+typedef uint8_t u8x16 __attribute__((vector_size(16)));
+typedef int16_t i16x8 __attribute__((vector_size(16)));
+typedef uint16_t u16x8 __attribute__((vector_size(16)));
+typedef uint16_t u16x16 __attribute__((vector_size(32)));
+typedef int32_t i32x4 __attribute__((vector_size(16)));
+typedef int32_t i32x8 __attribute__((vector_size(32)));
+typedef float f32x4 __attribute__((vector_size(16)));
+typedef float f32x8 __attribute__((vector_size(32)));
+
+namespace simd {
+
+template <typename V, typename T>
+inline V load(const T *p) {
+  V v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+template <typename V, typename T>
+inline void store(T *p, const V &v) {
+  memcpy(p, &v, sizeof(v));
+}
+
+// a where mask is set, else b. mask is the result of a comparison of vectors of the same width
+template <typename V, typename M>
+inline V select(M mask, V a, V b) {
+  return (V)(((M)a & mask) | ((M)b & ~mask));
+}
+
+// (src - offset) * scale as floats
+inline void bytes_to_float(const uint8_t *src, float *dst, int n, float offset = 0.f, float scale = 1.f) {
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    store(&dst[i], (__builtin_convertvector(load<u8x8>(&src[i]), f32x8) - offset) * scale);
+  }
+  for (; i < n; ++i) {
+    dst[i] = (src[i] - offset) * scale;
+  }
+}
+
+// the even and odd bytes of src, as (src - offset) * scale
+inline void deinterleave_to_float(const uint8_t *src, float *even, float *odd, int n, float offset = 0.f, float scale = 1.f) {
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const u8x16 v = load<u8x16>(&src[i * 2]);
+    const u8x8 e = __builtin_shufflevector(v, v, 0, 2, 4, 6, 8, 10, 12, 14);
+    const u8x8 o = __builtin_shufflevector(v, v, 1, 3, 5, 7, 9, 11, 13, 15);
+    store(&even[i], (__builtin_convertvector(e, f32x8) - offset) * scale);
+    store(&odd[i], (__builtin_convertvector(o, f32x8) - offset) * scale);
+  }
+  for (; i < n; ++i) {
+    even[i] = (src[i * 2] - offset) * scale;
+    odd[i] = (src[i * 2 + 1] - offset) * scale;
+  }
+}
+
+}  // namespace simd
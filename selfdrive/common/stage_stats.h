@@ -0,0 +1,57 @@
+#pragma once
+
+#include <array>
+
+#include "json11.hpp"
+#include "selfdrive/common/histogram.h"
+#include "selfdrive/common/timing.h"
+
+// Rolling latency histograms of the stages a frame goes through in a process like modeld, e.g.
+// receive, prepare and execute. Stages are the indices of an enum of the caller, named once.
+// Like LatencyHistogram not thread safe: stages can be timed anywhere, but add() them from one thread.
+template <int N>
+class StageStats {
+public:
+  StageStats(const std::array<const char *, N> &names) : names(names) {}
+
+  inline void add(int stage, double ms) { hist[stage].add(ms); }
+  inline const LatencyHistogram &operator[](int stage) const { return hist[stage]; }
+
+  // {"<stage>": {"count", "mean", "p50", "p90", "p99", "max"}} in ms for the stages seen since the last
+  // report, and starts over
+  json11::Json::object report() {
+    json11::Json::object stages;
+    for (int i = 0; i < N; ++i) {
+      if (hist[i].count() == 0) continue;
+
+      stages[names[i]] = json11::Json::object{
+        {"count", (double)hist[i].count()},
+        {"mean", hist[i].mean()},
+        {"p50", hist[i].percentile(50)},
+        {"p90", hist[i].percentile(90)},
+        {"p99", hist[i].percentile(99)},
+        {"max", hist[i].max()},
+      };
+      hist[i].reset();
+    }
+    return stages;
+  }
+
+private:
+  const std::array<const char *, N> names;
+  std::array<LatencyHistogram, N> hist;
+};
+
+// times consecutive stages: each lap() is the time since the previous one
+class StageClock {
+public:
+  inline double lap() {
+    const double now = millis_since_boot();
+    const double ms = now - last;
+    last = now;
+    return ms;
+  }
+
+private:
+  double last = millis_since_boot();
+};
@@ -0,0 +1,94 @@
+// Compares RingQueue against SafeQueue: throughput with 1 and 4 producers/consumers,
+// and how long a consumer blocked in pop() takes to wake up after a push.
+//
+// usage: benchmark_queue [--items 1000000] [--wakeups 2000]
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "selfdrive/common/queue.h"
+#include "selfdrive/common/ring_queue.h"
+#include "selfdrive/common/timing.h"
+#include "selfdrive/common/util.h"
+
+// SafeQueue is unbounded, the producers are throttled to the same depth as the ring
+const int CAPACITY = 64;
+
+template <typename Queue>
+double throughput(Queue &q, int threads, int items) {
+  std::atomic<int> in_flight = 0, received = 0;
+  std::vector<std::thread> workers;
+  const double start_ms = millis_since_boot();
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([&] {
+      for (int i = 0; i < items / threads; ++i) {
+        while (in_flight >= CAPACITY) std::this_thread::yield();
+        ++in_flight;
+        q.push(i);
+      }
+    });
+    workers.emplace_back([&] {
+      int v;
+      while (received < items / threads * threads) {
+        if (q.try_pop(v, 1)) {
+          --in_flight;
+          ++received;
+        }
+      }
+    });
+  }
+  for (auto &w : workers) w.join();
+  return received / ((millis_since_boot() - start_ms) / 1000.) / 1e6;
+}
+
+// the consumer sleeps in pop(), the producer pushes its timestamp after a pause
+template <typename Queue>
+std::vector<double> wakeup_latency(Queue &q, int wakeups) {
+  std::vector<double> latency_us;
+  std::thread consumer([&] {
+    for (int i = 0; i < wakeups; ++i) {
+      uint64_t sent_ns = q.pop();
+      latency_us.push_back((nanos_since_boot() - sent_ns) / 1e3);
+    }
+  });
+  for (int i = 0; i < wakeups; ++i) {
+    std::this_thread::sleep_for(std::chrono::microseconds(200));
+    q.push(nanos_since_boot());
+  }
+  consumer.join();
+  std::sort(latency_us.begin(), latency_us.end());
+  return latency_us;
+}
+
+void print_latency(const char *name, const std::vector<double> &us) {
+  printf("  %-10s p50 %6.1f us, p99 %6.1f us, max %7.1f us\n", name,
+         us[us.size() / 2], us[us.size() * 99 / 100], us.back());
+}
+
+int main(int argc, char *argv[]) {
+  int items = 1000000, wakeups = 2000;
+  for (int i = 1; i < argc - 1; i += 2) {
+    std::string arg = argv[i];
+    if (arg == "--items") items = atoi(argv[i + 1]);
+    else if (arg == "--wakeups") wakeups = atoi(argv[i + 1]);
+  }
+
+  printf("throughput, million items/sec:\n");
+  for (int threads : {1, 4}) {
+    SafeQueue<int> safe_queue;
+    RingQueue<int, CAPACITY> ring_queue;
+    printf("  %d producer(s), %d consumer(s): SafeQueue %.2f, RingQueue %.2f\n", threads, threads,
+           throughput(safe_queue, threads, items), throughput(ring_queue, threads, items));
+  }
+
+  printf("wakeup latency of a blocked consumer:\n");
+  SafeQueue<uint64_t> safe_queue;
+  RingQueue<uint64_t, CAPACITY> ring_queue;
+  print_latency("SafeQueue", wakeup_latency(safe_queue, wakeups));
+  print_latency("RingQueue", wakeup_latency(ring_queue, wakeups));
+  return 0;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+// shared by the tests that compare a CPU port of the frame pipeline against what it replaced and
+// benchmark both: camerad/test/cpu_isp_test, modeld/test/transform_cpu_test and
+// modeld/test/crop_resize_cpu_test. modeld/test/thneed_replay_test uses the OpenCL part
+
+#include <unistd.h>
+
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "selfdrive/common/clutil.h"
+#include "selfdrive/common/util.h"
+
+// mean ms of `frames` calls
+template <typename F>
+double time_ms(int frames, F fn) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < frames; ++i) fn();
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / frames;
+}
+
+// a smooth yuv image like a camera frame, or noise
+inline std::vector<uint8_t> test_frame(int width, int height, bool noise) {
+  std::mt19937 rng(width);
+  std::vector<uint8_t> yuv(width * height * 3 / 2);
+  uint8_t *u = &yuv[width * height], *v = u + (width / 2) * (height / 2);
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      yuv[y * width + x] = noise ? rng() : 128 + 100 * sinf(x * 0.02f) * cosf(y * 0.03f);
+    }
+  }
+  for (int i = 0; i < (width / 2) * (height / 2); ++i) {
+    u[i] = noise ? rng() : 96 + i % 64;
+    v[i] = noise ? rng() : 160 - i % 64;
+  }
+  return yuv;
+}
+
+// the kernels are loaded relative to the daemon's directory, the parent of test/
+inline void chdir_to_daemon() {
+  int err = chdir((util::dir_name(util::readlink("/proc/self/exe")) + "/..").c_str());
+  assert(err == 0);
+}
+
+// any device works, including a CPU OpenCL runtime like pocl. device_id is nullptr without one
+struct ClEnv {
+  ClEnv(cl_command_queue_properties props = 0) : device_id(cl_find_device_id(CL_DEVICE_TYPE_ALL)) {
+    if (!device_id) return;
+    ctx = CL_CHECK_ERR(clCreateContext(NULL, 1, &device_id, NULL, NULL, &err));
+    q = CL_CHECK_ERR(clCreateCommandQueue(ctx, device_id, props, &err));
+  }
+  ~ClEnv() {
+    if (q) CL_CHECK(clReleaseCommandQueue(q));
+    if (ctx) CL_CHECK(clReleaseContext(ctx));
+  }
+  ClEnv(const ClEnv &) = delete;
+  ClEnv &operator=(const ClEnv &) = delete;
+
+  cl_mem create(size_t size, const void *host = nullptr) {
+    return CL_CHECK_ERR(clCreateBuffer(ctx, CL_MEM_READ_WRITE | (host ? CL_MEM_COPY_HOST_PTR : 0), size, (void *)host, &err));
+  }
+  std::vector<uint8_t> read(cl_mem buf, size_t size) {
+    std::vector<uint8_t> v(size);
+    CL_CHECK(clEnqueueReadBuffer(q, buf, CL_TRUE, 0, size, v.data(), 0, NULL, NULL));
+    return v;
+  }
+
+  cl_device_id device_id;
+  cl_context ctx = nullptr;
+  cl_command_queue q = nullptr;
+};
+
+// the exit code of the test
+inline int test_result(bool passed) {
+  printf(passed ? "all tests passed\n" : "TEST FAILED\n");
+  return passed ? 0 : -1;
+}
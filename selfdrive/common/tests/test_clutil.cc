@@ -0,0 +1,100 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#define CATCH_CONFIG_MAIN
+#include "catch2/catch.hpp"
+#include "selfdrive/common/clutil.h"
+#include "selfdrive/common/clutil_cache.h"
+#include "selfdrive/common/util.h"
+
+const char *KERNEL_SRC = R"(
+__kernel void add(__global int *buf, int value) {
+  buf[get_global_id(0)] += value * SCALE;
+}
+)";
+
+// runs the kernel over 4 ints and returns the first one
+int run_add(cl_context ctx, cl_device_id device_id, cl_program prg) {
+  cl_command_queue q = CL_CHECK_ERR(clCreateCommandQueue(ctx, device_id, 0, &err));
+  cl_kernel krnl = CL_CHECK_ERR(clCreateKernel(prg, "add", &err));
+  int data[4] = {1, 1, 1, 1}, value = 2;
+  cl_mem buf = CL_CHECK_ERR(clCreateBuffer(ctx, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(data), data, &err));
+  CL_CHECK(clSetKernelArg(krnl, 0, sizeof(cl_mem), &buf));
+  CL_CHECK(clSetKernelArg(krnl, 1, sizeof(int), &value));
+  const size_t work_size = 4;
+  CL_CHECK(clEnqueueNDRangeKernel(q, krnl, 1, NULL, &work_size, NULL, 0, NULL, NULL));
+  CL_CHECK(clEnqueueReadBuffer(q, buf, CL_TRUE, 0, sizeof(data), data, 0, NULL, NULL));
+  CL_CHECK(clReleaseMemObject(buf));
+  CL_CHECK(clReleaseKernel(krnl));
+  CL_CHECK(clReleaseCommandQueue(q));
+  return data[0];
+}
+
+std::vector<std::string> cache_files(const std::string &dir) {
+  std::vector<std::string> files;
+  for (auto &f : util::read_files_in_dir(dir)) files.push_back(dir + "/" + f.first);
+  return files;
+}
+
+TEST_CASE("cl_program_from_source caches binaries") {
+  cl_device_id device_id = cl_find_device_id(CL_DEVICE_TYPE_ALL);
+  if (!device_id) {
+    WARN("no OpenCL device, skipping");
+    return;
+  }
+  cl_context ctx = CL_CHECK_ERR(clCreateContext(NULL, 1, &device_id, NULL, NULL, &err));
+
+  char cache_dir[] = "/tmp/test_cl_cache_XXXXXX";
+  REQUIRE(mkdtemp(cache_dir) != nullptr);
+  setenv("CL_CACHE_DIR", cache_dir, 1);
+
+  // compiles and stores
+  cl_program prg = cl_program_from_source(ctx, device_id, KERNEL_SRC, "-DSCALE=3");
+  REQUIRE(run_add(ctx, device_id, prg) == 7);
+  CL_CHECK(clReleaseProgram(prg));
+  auto files = cache_files(cache_dir);
+  REQUIRE(files.size() == 1);
+
+  SECTION("loads the cached binary") {
+    prg = cl_program_from_source(ctx, device_id, KERNEL_SRC, "-DSCALE=3");
+    REQUIRE(run_add(ctx, device_id, prg) == 7);
+    REQUIRE(cache_files(cache_dir).size() == 1);
+  }
+  SECTION("different options are a different program") {
+    prg = cl_program_from_source(ctx, device_id, KERNEL_SRC, "-DSCALE=5");
+    REQUIRE(run_add(ctx, device_id, prg) == 11);
+    REQUIRE(cache_files(cache_dir).size() == 2);
+  }
+  SECTION("recompiles over a corrupt cache file") {
+    std::string content = util::read_file(files[0]);
+    content.back() ^= 0xff;
+    REQUIRE(util::write_file(files[0].c_str(), content.data(), content.size(), O_WRONLY | O_TRUNC) == 0);
+
+    prg = cl_program_from_source(ctx, device_id, KERNEL_SRC, "-DSCALE=3");
+    REQUIRE(run_add(ctx, device_id, prg) == 7);
+    REQUIRE(util::read_file(files[0]).back() != content.back());
+  }
+  SECTION("recompiles over a binary the driver rejects") {
+    // a valid cache file, as after a driver update that can't load what the old one built
+    std::string content = util::read_file(files[0]);
+    CLCacheHeader header;
+    memcpy(&header, content.data(), sizeof(header));
+    const std::string binary(256, 'x');
+    header.binary_hash = fnv1a(binary.data(), binary.size());
+    header.binary_size = binary.size();
+    content = std::string((const char *)&header, sizeof(header)) + binary;
+    REQUIRE(util::write_file(files[0].c_str(), content.data(), content.size(), O_WRONLY | O_TRUNC) == 0);
+
+    prg = cl_program_from_source(ctx, device_id, KERNEL_SRC, "-DSCALE=3");
+    REQUIRE(run_add(ctx, device_id, prg) == 7);
+    REQUIRE(util::read_file(files[0]) != content);
+  }
+  CL_CHECK(clReleaseProgram(prg));
+  CL_CHECK(clReleaseContext(ctx));
+
+  for (auto &f : cache_files(cache_dir)) unlink(f.c_str());
+  rmdir(cache_dir);
+  unsetenv("CL_CACHE_DIR");
+}
@@ -0,0 +1,108 @@
+#include <numeric>
+#include <thread>
+#include <vector>
+
+#define CATCH_CONFIG_MAIN
+#include "catch2/catch.hpp"
+#include "selfdrive/common/ring_queue.h"
+#include "selfdrive/common/timing.h"
+#include "selfdrive/common/util.h"
+
+TEST_CASE("RingQueue is FIFO") {
+  RingQueue<int, 5> q;
+  REQUIRE(q.empty());
+  for (int round = 0; round < 3; ++round) {
+    for (int i = 0; i < 5; ++i) REQUIRE(q.push(i));
+    REQUIRE(q.size() == 5);
+    for (int i = 0; i < 5; ++i) REQUIRE(q.pop() == i);
+    REQUIRE(q.empty());
+  }
+}
+
+TEST_CASE("RingQueue overflow policies") {
+  SECTION("drop newest") {
+    RingQueue<int, 4> q(OverflowPolicy::DropNewest);
+    for (int i = 0; i < 4; ++i) REQUIRE(q.push(i));
+    REQUIRE_FALSE(q.push(4));
+    REQUIRE(q.dropped() == 1);
+    for (int i = 0; i < 4; ++i) REQUIRE(q.pop() == i);
+  }
+  SECTION("drop oldest") {
+    RingQueue<int, 4> q(OverflowPolicy::DropOldest);
+    for (int i = 0; i < 6; ++i) REQUIRE(q.push(i));
+    REQUIRE(q.dropped() == 2);
+    for (int i = 2; i < 6; ++i) REQUIRE(q.pop() == i);
+  }
+  SECTION("block") {
+    RingQueue<int, 4> q(OverflowPolicy::Block);
+    for (int i = 0; i < 4; ++i) REQUIRE(q.push(i));
+    std::thread producer([&] { q.push(4); });
+    util::sleep_for(50);
+    REQUIRE(q.size() == 4);
+    REQUIRE(q.pop() == 0);
+    producer.join();
+    for (int i = 1; i < 5; ++i) REQUIRE(q.pop() == i);
+    REQUIRE(q.dropped() == 0);
+  }
+}
+
+TEST_CASE("RingQueue try_pop") {
+  RingQueue<int, 4> q;
+  int v = -1;
+  REQUIRE_FALSE(q.try_pop(v));
+
+  double start_ms = millis_since_boot();
+  REQUIRE_FALSE(q.try_pop(v, 20));
+  REQUIRE(millis_since_boot() - start_ms >= 19);
+
+  std::thread producer([&] {
+    util::sleep_for(10);
+    q.push(42);
+  });
+  REQUIRE(q.try_pop(v, 1000));
+  REQUIRE(v == 42);
+  producer.join();
+}
+
+TEST_CASE("RingQueue holds types that aren't default constructible or assignable") {
+  struct Item {
+    Item(int v) : v(v) {}
+    const int v;
+  };
+  RingQueue<std::pair<const Item, std::vector<int>>, 2> q;
+  q.push({Item(7), {1, 2, 3}});
+  auto [item, vec] = q.pop();
+  REQUIRE(item.v == 7);
+  REQUIRE(vec.size() == 3);
+}
+
+TEST_CASE("RingQueue with multiple producers and consumers") {
+  const int producers = 4, consumers = 4, items = 100000;
+  RingQueue<int, 64> q;
+  std::atomic<int64_t> sum = 0;
+  std::atomic<int> received = 0;
+
+  std::vector<std::thread> threads;
+  for (int p = 0; p < producers; ++p) {
+    threads.emplace_back([&, p] {
+      for (int i = 0; i < items; ++i) q.push(p * items + i);
+    });
+  }
+  for (int c = 0; c < consumers; ++c) {
+    threads.emplace_back([&] {
+      int v;
+      while (received < producers * items) {
+        if (q.try_pop(v, 10)) {
+          sum += v;
+          ++received;
+        }
+      }
+    });
+  }
+  for (auto &t : threads) t.join();
+
+  const int64_t n = (int64_t)producers * items;
+  REQUIRE(received == n);
+  REQUIRE(sum == n * (n - 1) / 2);
+  REQUIRE(q.empty());
+}
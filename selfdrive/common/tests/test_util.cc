@@ -4,9 +4,12 @@
 #include <sys/types.h>
 
 #include <algorithm>
+#include <atomic>
 #include <climits>
 #include <random>
 #include <string>
+#include <thread>
+#include <vector>
 
 #define CATCH_CONFIG_MAIN
 #include "catch2/catch.hpp"
@@ -143,3 +146,37 @@ TEST_CASE("util::create_directories") {
     REQUIRE(util::create_directories("", 0755) == false);
   }
 }
+
+TEST_CASE("util::parallel_for") {
+  auto covered = [](int n, int align) {
+    std::vector<std::atomic<int>> hits(n);
+    std::atomic<bool> aligned = true;
+    util::parallel_for(n, align, [&](int start, int end) {
+      aligned = aligned && start % align == 0;
+      for (int i = start; i < end; ++i) hits[i]++;
+    });
+    return aligned && std::all_of(hits.begin(), hits.end(), [](auto &h) { return h == 1; });
+  };
+
+  SECTION("every index once, bands aligned") {
+    for (int n : {1, 2, 3, 7, 64, 1208, 1209}) {
+      REQUIRE(covered(n, 1));
+      REQUIRE(covered(n, 2));
+    }
+  }
+  SECTION("concurrent and nested calls") {
+    std::vector<std::thread> threads;
+    std::atomic<int> ok = 0;
+    for (int t = 0; t < 4; ++t) {
+      threads.emplace_back([&] {
+        for (int i = 0; i < 100; ++i) {
+          std::atomic<bool> nested_ok = true;
+          util::parallel_for(8, 1, [&](int, int) { nested_ok = nested_ok && covered(100, 2); });
+          ok += nested_ok;
+        }
+      });
+    }
+    for (auto &t : threads) t.join();
+    REQUIRE(ok == 400);
+  }
+}
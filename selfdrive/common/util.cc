@@ -5,9 +5,12 @@
 
 #include <cassert>
 #include <cerrno>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
 #include <dirent.h>
 #include <fstream>
+#include <mutex>
 #include <iomanip>
 #include <sstream>
 
@@ -235,6 +238,85 @@ struct tm get_time() {
   return sys_time;
 }
 
+namespace {
+
+// the workers parallel_for hands its bands to. started on first use and never stopped, so a
+// frame doesn't pay for creating and joining threads. callers run bands of their own job too,
+// which keeps concurrent and nested calls from waiting on each other
+class ParallelPool {
+public:
+  struct Job {
+    const std::function<void(int, int)> *fn;
+    int n, per_thread, bands;
+    int claimed = 0, pending = 0;
+  };
+
+  static ParallelPool &instance() {
+    // leaked, workers may still be waiting for jobs while the process exits
+    static ParallelPool *pool = new ParallelPool();
+    return *pool;
+  }
+  int threads() const { return num_workers + 1; }
+
+  void run(Job &job) {
+    std::unique_lock lk(m);
+    job.pending = job.bands;
+    jobs.push_back(&job);
+    cv.notify_all();
+    while (job.claimed < job.bands) {
+      run_band(lk, job);
+    }
+    done_cv.wait(lk, [&] { return job.pending == 0; });
+  }
+
+private:
+  ParallelPool() : num_workers(std::max(1u, std::thread::hardware_concurrency()) - 1) {
+    for (int i = 0; i < num_workers; ++i) {
+      std::thread([this] {
+        set_thread_name("parallel_for");
+        std::unique_lock lk(m);
+        while (true) {
+          cv.wait(lk, [&] { return !jobs.empty(); });
+          run_band(lk, *jobs.front());
+        }
+      }).detach();
+    }
+  }
+
+  // claims the next band of job and runs it with the lock released
+  void run_band(std::unique_lock<std::mutex> &lk, Job &job) {
+    const int start = job.claimed++ * job.per_thread;
+    if (job.claimed == job.bands) {
+      jobs.erase(std::find(jobs.begin(), jobs.end(), &job));
+    }
+    lk.unlock();
+    (*job.fn)(start, std::min(start + job.per_thread, job.n));
+    lk.lock();
+    if (--job.pending == 0) {
+      done_cv.notify_all();
+    }
+  }
+
+  const int num_workers;
+  std::mutex m;
+  std::condition_variable cv, done_cv;
+  std::deque<Job *> jobs;
+};
+
+}  // namespace
+
+void parallel_for(int n, int align, const std::function<void(int, int)> &fn) {
+  if (n <= 0) return;
+  ParallelPool &pool = ParallelPool::instance();
+  const int per_thread = ((n + align - 1) / align + pool.threads() - 1) / pool.threads() * align;
+  ParallelPool::Job job = {.fn = &fn, .n = n, .per_thread = per_thread, .bands = (n + per_thread - 1) / per_thread};
+  if (job.bands == 1) {
+    fn(0, n);
+    return;
+  }
+  pool.run(job);
+}
+
 bool time_valid(struct tm sys_time) {
   int year = 1900 + sys_time.tm_year;
   int month = 1 + sys_time.tm_mon;
@@ -9,6 +9,7 @@
 #include <chrono>
 #include <csignal>
 #include <ctime>
+#include <functional>
 #include <map>
 #include <memory>
 #include <string>
@@ -90,6 +91,10 @@ bool create_directories(const std::string &dir, mode_t mode);
 
 std::string check_output(const std::string& command);
 
+// calls fn(start, end) on disjoint ranges covering [0, n), aligned to `align`, one per core. the
+// ranges run on a pool of threads that lives as long as the process, and on the calling thread
+void parallel_for(int n, int align, const std::function<void(int, int)> &fn);
+
 inline void sleep_for(const int milliseconds) {
   std::this_thread::sleep_for(std::chrono::milliseconds(milliseconds));
 }
@@ -0,0 +1,210 @@
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+
+#include "selfdrive/loggerd/ffmpeg_encoder.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+
+#define __STDC_CONSTANT_MACROS
+
+#include "libyuv.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/opt.h>
+}
+
+#include "selfdrive/common/swaglog.h"
+#include "selfdrive/common/util.h"
+
+FfmpegEncoder::FfmpegEncoder(const char* filename, int width, int height, int fps,
+                             int bitrate, bool h265, bool downscale, bool write)
+  : filename(filename), width(width), height(height), fps(fps), bitrate(bitrate), downscale(downscale), write(write) {
+
+  av_register_all();
+  // prefer x264/x265, fall back to whatever encoder libavcodec has for the codec
+  codec = avcodec_find_encoder_by_name(h265 ? "libx265" : "libx264");
+  if (!codec) {
+    codec = avcodec_find_encoder(h265 ? AV_CODEC_ID_HEVC : AV_CODEC_ID_H264);
+  }
+  assert(codec);
+  LOG("%s encoder: %s %dx%d %d kbps", filename, codec->name, width, height, bitrate / 1000);
+
+  frame = av_frame_alloc();
+  assert(frame);
+  frame->format = AV_PIX_FMT_YUV420P;
+  frame->width = width;
+  frame->height = height;
+  frame->linesize[0] = width;
+  frame->linesize[1] = width/2;
+  frame->linesize[2] = width/2;
+
+  pkt = av_packet_alloc();
+  assert(pkt);
+
+  if (downscale) {
+    downscale_buf = std::make_unique<uint8_t[]>(width * height * 3 / 2);
+  }
+}
+
+FfmpegEncoder::~FfmpegEncoder() {
+  assert(!is_open);
+  av_packet_free(&pkt);
+  av_frame_free(&frame);
+}
+
+void FfmpegEncoder::encoder_open(const char* path) {
+  vid_path = util::string_format("%s/%s", path, filename);
+
+  // create camera lock file
+  lock_path = util::string_format("%s/%s.lock", path, filename);
+
+  LOG("open %s\n", lock_path.c_str());
+
+  int lock_fd = HANDLE_EINTR(open(lock_path.c_str(), O_RDWR | O_CREAT, 0664));
+  assert(lock_fd >= 0);
+  close(lock_fd);
+
+  // a drained encoder can't take new frames, start a fresh one for every segment
+  codec_ctx = avcodec_alloc_context3(codec);
+  assert(codec_ctx);
+  codec_ctx->width = width;
+  codec_ctx->height = height;
+  codec_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+  codec_ctx->bit_rate = bitrate;
+  codec_ctx->time_base = (AVRational){ 1, fps };
+  codec_ctx->framerate = (AVRational){ fps, 1 };
+  // one keyframe per second and no B-frames, like the hardware encoder
+  codec_ctx->gop_size = fps;
+  codec_ctx->max_b_frames = 0;
+
+  codec_ctx->thread_count = 0;  // one per core
+  codec_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+  av_opt_set(codec_ctx->priv_data, "preset", "veryfast", 0);
+
+  int err = avcodec_open2(codec_ctx, codec, NULL);
+  assert(err >= 0);
+
+  if (write) {
+    // the muxer follows the extension, raw annex-b for .hevc and mpegts for .ts
+    format_ctx = NULL;
+    avformat_alloc_output_context2(&format_ctx, NULL, NULL, vid_path.c_str());
+    assert(format_ctx);
+
+    stream = avformat_new_stream(format_ctx, codec);
+    assert(stream);
+    stream->id = 0;
+    stream->time_base = (AVRational){ 1, fps };
+
+    err = avcodec_parameters_from_context(stream->codecpar, codec_ctx);
+    assert(err >= 0);
+
+    err = avio_open(&format_ctx->pb, vid_path.c_str(), AVIO_FLAG_WRITE);
+    assert(err >= 0);
+
+    err = avformat_write_header(format_ctx, NULL);
+    assert(err >= 0);
+  }
+
+  is_open = true;
+  counter = 0;
+}
+
+void FfmpegEncoder::encoder_close() {
+  if (!is_open) return;
+
+  // drain the frames still in flight in the encoder threads
+  int err = avcodec_send_frame(codec_ctx, NULL);
+  if (err >= 0) {
+    write_packets();
+  }
+  avcodec_free_context(&codec_ctx);
+
+  if (format_ctx) {
+    err = av_write_trailer(format_ctx);
+    assert(err == 0);
+
+    err = avio_closep(&format_ctx->pb);
+    assert(err == 0);
+
+    avformat_free_context(format_ctx);
+    format_ctx = NULL;
+    stream = NULL;
+  }
+
+  unlink(lock_path.c_str());
+  is_open = false;
+}
+
+// write out everything the encoder has finished, returns -1 on error
+int FfmpegEncoder::write_packets() {
+  while (true) {
+    int err = avcodec_receive_packet(codec_ctx, pkt);
+    if (err == AVERROR(EAGAIN) || err == AVERROR_EOF) {
+      return 0;
+    } else if (err < 0) {
+      LOGE("encoding error\n");
+      return -1;
+    }
+
+    if (format_ctx) {
+      av_packet_rescale_ts(pkt, codec_ctx->time_base, stream->time_base);
+      pkt->stream_index = 0;
+      err = av_interleaved_write_frame(format_ctx, pkt);
+      if (err < 0) {
+        LOGE("encoder writer error\n");
+        av_packet_unref(pkt);
+        return -1;
+      }
+    }
+    av_packet_unref(pkt);
+  }
+}
+
+int FfmpegEncoder::encode_frame(const uint8_t *y_ptr, const uint8_t *u_ptr, const uint8_t *v_ptr,
+                                int in_width, int in_height, uint64_t ts) {
+  if (!is_open) {
+    return -1;
+  }
+
+  if (downscale) {
+    uint8_t *y = downscale_buf.get();
+    uint8_t *u = y + width * height;
+    uint8_t *v = u + (width / 2) * (height / 2);
+    libyuv::I420Scale(y_ptr, in_width,
+                      u_ptr, in_width/2,
+                      v_ptr, in_width/2,
+                      in_width, in_height,
+                      y, width,
+                      u, width/2,
+                      v, width/2,
+                      width, height,
+                      libyuv::kFilterNone);
+    y_ptr = y;
+    u_ptr = u;
+    v_ptr = v;
+  }
+
+  frame->data[0] = (uint8_t*)y_ptr;
+  frame->data[1] = (uint8_t*)u_ptr;
+  frame->data[2] = (uint8_t*)v_ptr;
+  frame->pts = counter;
+
+  // with frame threading the packet for this frame comes out a few frames later
+  int err = avcodec_send_frame(codec_ctx, frame);
+  if (err < 0) {
+    LOGE("encoding error\n");
+    return -1;
+  }
+  if (write_packets() < 0) {
+    return -1;
+  }
+
+  return counter++;
+}
@@ -2,6 +2,7 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -13,20 +14,24 @@ extern "C" {
 
 #include "selfdrive/loggerd/encoder.h"
 
-class RawLogger : public VideoEncoder {
+// FfmpegEncoder, lossy software encoder for PC. writes the same files as OmxEncoder
+class FfmpegEncoder : public VideoEncoder {
  public:
-  RawLogger(const char* filename, int width, int height, int fps,
-            int bitrate, bool h265, bool downscale, bool write = true);
-  ~RawLogger();
+  FfmpegEncoder(const char* filename, int width, int height, int fps,
+                int bitrate, bool h265, bool downscale, bool write = true);
+  ~FfmpegEncoder();
   int encode_frame(const uint8_t *y_ptr, const uint8_t *u_ptr, const uint8_t *v_ptr,
                    int in_width, int in_height, uint64_t ts);
   void encoder_open(const char* path);
   void encoder_close();
 
 private:
+  int write_packets();
+
   const char* filename;
-  //bool write;
-  int fps;
+  int width, height, fps, bitrate;
+  bool downscale;
+  bool write;
   int counter = 0;
   bool is_open = false;
 
@@ -39,4 +44,6 @@ private:
   AVFormatContext *format_ctx = NULL;
 
   AVFrame *frame = NULL;
+  AVPacket *pkt = NULL;
+  std::unique_ptr<uint8_t[]> downscale_buf;
 };
@@ -165,7 +165,7 @@ static LoggerHandle* logger_open(LoggerState *s, const char* root_path) {
 
   h->log = std::make_unique<BZFile>(h->log_path);
   if (s->has_qlog) {
-    h->q_log = std::make_unique<BZFile>(h->qlog_path);
+    h->q_log = std::make_unique<BZFile>(h->qlog_path, true, LOGGER_QLOG_CHUNK_MS);
   }
 
   pthread_mutex_init(&h->lock, NULL);
@@ -227,6 +227,28 @@ void logger_log(LoggerState *s, uint8_t* data, size_t data_size, bool in_qlog) {
   pthread_mutex_unlock(&s->lock);
 }
 
+static void bz_file_stats(BZFile *f, LogFileStats *stats) {
+  if (f) {
+    *stats = {.bytes_in = f->bytes_in, .bytes_out = f->bytes_out(), .write_ns = f->write_ns, .chunks = f->chunks};
+  }
+}
+
+// snapshot of the counters of the current segment's log files, returns the segment number
+int logger_get_stats(LoggerState *s, LogFileStats *rlog, LogFileStats *qlog) {
+  *rlog = *qlog = {};
+  pthread_mutex_lock(&s->lock);
+  LoggerHandle *h = s->cur_handle;
+  if (h) {
+    pthread_mutex_lock(&h->lock);
+    bz_file_stats(h->log.get(), rlog);
+    bz_file_stats(h->q_log.get(), qlog);
+    pthread_mutex_unlock(&h->lock);
+  }
+  int part = s->part;
+  pthread_mutex_unlock(&s->lock);
+  return part;
+}
+
 void logger_close(LoggerState *s, ExitHandler *exit_handler) {
   pthread_mutex_lock(&s->lock);
   if (s->cur_handle) {
@@ -2,10 +2,16 @@
 
 #include <cassert>
 #include <pthread.h>
+#include <unistd.h>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
 #include <memory>
+#include <mutex>
+#include <thread>
 
 #include <bzlib.h>
 #include <capnp/serialize.h>
@@ -14,48 +20,137 @@
 #include "cereal/messaging/messaging.h"
 #include "selfdrive/common/util.h"
 #include "selfdrive/common/swaglog.h"
+#include "selfdrive/common/timing.h"
 #include "selfdrive/hardware/hw.h"
 
 const std::string LOG_ROOT = Path::log_root();
 
 #define LOGGER_MAX_HANDLES 16
 
+// Logs are written as a sequence of independent bz2 streams (chunks). Each chunk carries its
+// own header and CRCs and is synced to disk when it's finished, so a power loss only costs the
+// chunk in progress. Concatenated bz2 streams are still a valid .bz2 file for existing readers.
+#define LOGGER_CHUNK_MS 1000
+// the qlog is a subset of the rlog, longer chunks keep its small blocks compressing well
+#define LOGGER_QLOG_CHUNK_MS 10000
+#define LOGGER_CHUNK_SIZE (900 * 1000)  // one bz2 block at level 9, so chunking doesn't hurt compression
+
 class BZFile {
  public:
-  BZFile(const char* path) {
+  BZFile(const char* path, bool chunked = true, int chunk_ms = LOGGER_CHUNK_MS) : chunked(chunked), chunk_ms(chunk_ms) {
     file = util::safe_fopen(path, "wb");
     assert(file != nullptr);
-    int bzerror;
-    bz_file = BZ2_bzWriteOpen(&bzerror, file, 9, 0, 30);
-    assert(bzerror == BZ_OK);
+    open_chunk();
+    if (chunked) {
+      sync_thread = std::thread(&BZFile::sync_loop, this);
+    }
   }
   ~BZFile() {
-    int bzerror;
-    BZ2_bzWriteClose(&bzerror, bz_file, 0, nullptr, nullptr);
-    if (bzerror != BZ_OK) {
-      LOGE("BZ2_bzWriteClose error, bzerror=%d", bzerror);
+    if (sync_thread.joinable()) {
+      {
+        std::lock_guard lk(lock);
+        exit = true;
+      }
+      cv.notify_one();
+      sync_thread.join();
     }
+    close_chunk();
     util::safe_fflush(file);
     int err = fclose(file);
     assert(err == 0);
   }
   inline void write(void* data, size_t size) {
+    std::lock_guard lk(lock);
     int bzerror;
+    uint64_t start_ns = nanos_since_boot();
     do {
       BZ2_bzWrite(&bzerror, bz_file, data, size);
     } while (bzerror == BZ_IO_ERROR && errno == EINTR);
+    bytes_in += size;
+    chunk_bytes += size;
 
     if (bzerror != BZ_OK && !error_logged) {
       LOGE("BZ2_bzWrite error, bzerror=%d", bzerror);
       error_logged = true;
     }
+
+    // a full block is compressed by BZ2_bzWrite anyway, finishing its stream here is cheap.
+    // the sync is left to sync_loop
+    if (chunked && chunk_bytes >= LOGGER_CHUNK_SIZE) {
+      next_chunk();
+      cv.notify_one();
+    }
+    write_ns += nanos_since_boot() - start_ns;
   }
   inline void write(kj::ArrayPtr<capnp::byte> array) { write(array.begin(), array.size()); }
+  // compressed bytes that reached the file so far. bzip2 holds back up to one block (900kB)
+  inline uint64_t bytes_out() const { long pos = ftell(file); return pos > 0 ? pos : 0; }
+
+  uint64_t bytes_in = 0;
+  uint64_t write_ns = 0;  // time spent in write(), syncs happen on sync_thread
+  std::atomic<uint64_t> chunks = 0;
 
  private:
+  inline void open_chunk() {
+    int bzerror;
+    bz_file = BZ2_bzWriteOpen(&bzerror, file, 9, 0, 30);
+    assert(bzerror == BZ_OK);
+    chunk_start = std::chrono::steady_clock::now();
+    chunk_bytes = 0;
+  }
+  inline void close_chunk() {
+    int bzerror;
+    BZ2_bzWriteClose(&bzerror, bz_file, 0, nullptr, nullptr);
+    if (bzerror != BZ_OK) {
+      LOGE("BZ2_bzWriteClose error, bzerror=%d", bzerror);
+    }
+    bz_file = nullptr;
+    chunks++;
+  }
+  // finish the current bz2 stream and hand it to the file, sync_loop makes it durable
+  inline void next_chunk() {
+    close_chunk();
+    util::safe_fflush(file);
+    unsynced = true;
+    open_chunk();
+  }
+  // closes a chunk that has been open for chunk_ms, so an idle log is synced too, and syncs
+  // finished chunks without holding the lock writers wait on
+  void sync_loop() {
+    util::set_thread_name("bzfile_sync");
+    std::unique_lock lk(lock);
+    while (!exit) {
+      cv.wait_until(lk, chunk_start + std::chrono::milliseconds(chunk_ms), [&] { return exit || unsynced; });
+      if (!exit && chunk_bytes > 0 && std::chrono::steady_clock::now() - chunk_start >= std::chrono::milliseconds(chunk_ms)) {
+        next_chunk();
+      } else if (chunk_bytes == 0) {
+        chunk_start = std::chrono::steady_clock::now();
+      }
+      if (unsynced) {
+        unsynced = false;
+        lk.unlock();
+#ifdef __APPLE__
+        fsync(fileno(file));
+#else
+        fdatasync(fileno(file));
+#endif
+        lk.lock();
+      }
+    }
+  }
+
+  const bool chunked;
+  const int chunk_ms;
   bool error_logged = false;
   FILE* file = nullptr;
   BZFILE* bz_file = nullptr;
+  std::chrono::steady_clock::time_point chunk_start;
+  size_t chunk_bytes = 0;
+
+  std::mutex lock;
+  std::condition_variable cv;
+  bool unsynced = false, exit = false;
+  std::thread sync_thread;
 };
 
 typedef cereal::Sentinel::SentinelType SentinelType;
@@ -72,6 +167,10 @@ typedef struct LoggerHandle {
   std::unique_ptr<BZFile> log, q_log;
 } LoggerHandle;
 
+typedef struct LogFileStats {
+  uint64_t bytes_in, bytes_out, write_ns, chunks;
+} LogFileStats;
+
 typedef struct LoggerState {
   pthread_mutex_t lock;
   int part;
@@ -93,6 +192,7 @@ int logger_next(LoggerState *s, const char* root_path,
 LoggerHandle* logger_get_handle(LoggerState *s);
 void logger_close(LoggerState *s, ExitHandler *exit_handler=nullptr);
 void logger_log(LoggerState *s, uint8_t* data, size_t data_size, bool in_qlog);
+int logger_get_stats(LoggerState *s, LogFileStats *rlog, LogFileStats *qlog);
 
 void lh_log(LoggerHandle* h, uint8_t* data, size_t data_size, bool in_qlog);
 void lh_close(LoggerHandle* h);
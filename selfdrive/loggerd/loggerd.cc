@@ -1,5 +1,7 @@
 #include "selfdrive/loggerd/loggerd.h"
 
+#include "json11.hpp"
+
 ExitHandler do_exit;
 
 // Handle initial encoder syncing by waiting for all encoders to reach the same frame id
@@ -37,13 +39,97 @@ bool trigger_rotate_if_needed(LoggerdState *s, int cur_seg, uint32_t frame_id) {
   return false;
 }
 
+// encodes frames from the queue until a null buffer is pushed
+void encoder_worker(LoggerdState *s, const LogCameraInfo &cam_info, int encoder_idx, Encoder *encoder, EncoderQueue *queue) {
+  util::set_thread_name(encoder_idx == 0 ? cam_info.filename : qcam_info.filename);
+
+  int cur_seg = -1;
+  LoggerHandle *lh = NULL;
+  EncoderStats &es = s->encoder_stats[cam_info.type][encoder_idx];
+
+  while (true) {
+    EncoderFrame frame = queue->pop();
+    if (frame.buf == nullptr) break;
+
+    VisionBuf *buf = frame.buf;
+    const VisionIpcBufExtra &extra = frame.extra;
+
+    // rotate the encoder once frames of the next segment arrive
+    if (frame.segment > cur_seg) {
+      cur_seg = frame.segment;
+
+      LOGW("camera %d rotate encoder to %s", cam_info.type, frame.segment_path->c_str());
+      encoder->encoder_close();
+      encoder->encoder_open(frame.segment_path->c_str());
+      if (encoder_idx == 0) {
+        if (lh) {
+          lh_close(lh);
+        }
+        lh = logger_get_handle(&s->logger);
+      }
+    }
+
+    // encode a frame
+    uint64_t start_ns = nanos_since_boot();
+    int out_id = encoder->encode_frame(buf->y, buf->u, buf->v,
+                                       buf->width, buf->height, extra.timestamp_eof);
+    uint64_t encode_ns = nanos_since_boot() - start_ns;
+
+    es.frames++;
+    es.encode_ns += encode_ns;
+    update_max_atomic(es.max_encode_ns, encode_ns);
+
+    // camerad reuses the buffer once it wraps around, it may have been overwritten while queued or encoding
+    bool valid = (buf->get_frame_id() == extra.frame_id);
+    if (!valid) {
+      es.overwritten_frames++;
+    }
+
+    if (out_id == -1) {
+      LOGE("Failed to encode frame. frame_id: %d encode_id: %d", extra.frame_id, frame.encode_idx);
+    }
+
+    // publish encode index
+    if (encoder_idx == 0 && out_id != -1) {
+      MessageBuilder msg;
+      // this is really ugly
+      auto eidx = cam_info.type == DriverCam ? msg.initEvent(valid).initDriverEncodeIdx() :
+                 (cam_info.type == WideRoadCam ? msg.initEvent(valid).initWideRoadEncodeIdx() : msg.initEvent(valid).initRoadEncodeIdx());
+      eidx.setFrameId(extra.frame_id);
+      eidx.setTimestampSof(extra.timestamp_sof);
+      eidx.setTimestampEof(extra.timestamp_eof);
+      if (Hardware::TICI()) {
+        eidx.setType(cereal::EncodeIndex::Type::FULL_H_E_V_C);
+      } else {
+        eidx.setType(cam_info.type == DriverCam ? cereal::EncodeIndex::Type::FRONT : cereal::EncodeIndex::Type::FULL_H_E_V_C);
+      }
+      eidx.setEncodeId(frame.encode_idx);
+      eidx.setSegmentNum(cur_seg);
+      eidx.setSegmentId(out_id);
+      if (lh) {
+        auto bytes = msg.toBytes();
+        lh_log(lh, bytes.begin(), bytes.size(), true);
+      }
+    }
+  }
+
+  if (lh) {
+    lh_close(lh);
+  }
+  encoder->encoder_close();
+}
+
 void encoder_thread(LoggerdState *s, const LogCameraInfo &cam_info) {
   util::set_thread_name(cam_info.filename);
 
   int cur_seg = -1;
+  std::shared_ptr<const std::string> cur_seg_path;
   int encode_idx = 0;
-  LoggerHandle *lh = NULL;
+  uint32_t last_frame_id = 0;
+  bool has_last_frame = false;
   std::vector<Encoder *> encoders;
+  std::vector<std::unique_ptr<EncoderQueue>> queues;
+  std::vector<std::thread> workers;
   VisionIpcClient vipc_client = VisionIpcClient("camerad", cam_info.stream_type, false);
 
   while (!do_exit) {
@@ -66,6 +152,12 @@ void encoder_thread(LoggerdState *s, const LogCameraInfo &cam_info) {
         encoders.push_back(new Encoder(qcam_info.filename, qcam_info.frame_width, qcam_info.frame_height,
                                        qcam_info.fps, qcam_info.bitrate, qcam_info.is_h265, qcam_info.downscale));
       }
+
+      // each encoder runs on its own thread, so a slow frame doesn't block receiving the next one
+      for (int i = 0; i < encoders.size(); ++i) {
+        queues.push_back(std::make_unique<EncoderQueue>(OverflowPolicy::DropNewest));
+        workers.push_back(std::thread(encoder_worker, s, std::cref(cam_info), i, encoders[i], queues[i].get()));
+      }
     }
 
     while (!do_exit) {
@@ -73,6 +165,14 @@ void encoder_thread(LoggerdState *s, const LogCameraInfo &cam_info) {
       VisionBuf* buf = vipc_client.recv(&extra);
       if (buf == nullptr) continue;
 
+      if (has_last_frame && extra.frame_id > last_frame_id + 1) {
+        for (int i = 0; i < encoders.size(); ++i) {
+          s->encoder_stats[cam_info.type][i].dropped_frames += extra.frame_id - last_frame_id - 1;
+        }
+      }
+      last_frame_id = extra.frame_id;
+      has_last_frame = true;
+
       if (cam_info.trigger_rotate) {
         s->last_camera_seen_tms = millis_since_boot();
         if (!sync_encoders(s, cam_info.type, extra.frame_id)) {
@@ -84,72 +184,40 @@ void encoder_thread(LoggerdState *s, const LogCameraInfo &cam_info) {
         if (do_exit) break;
       }
 
-      // rotate the encoder if the logger is on a newer segment
+      // the segment and its path change together under rotate_lock
       if (s->rotate_segment > cur_seg) {
+        std::unique_lock lk(s->rotate_lock);
         cur_seg = s->rotate_segment;
-
-        LOGW("camera %d rotate encoder to %s", cam_info.type, s->segment_path);
-        for (auto &e : encoders) {
-          e->encoder_close();
-          e->encoder_open(s->segment_path);
-        }
-        if (lh) {
-          lh_close(lh);
-        }
-        lh = logger_get_handle(&s->logger);
+        cur_seg_path = std::make_shared<const std::string>(s->segment_path);
       }
 
-      // encode a frame
+      // hand the frame to the encoders, drop it if an encoder has fallen too far behind
       for (int i = 0; i < encoders.size(); ++i) {
-        int out_id = encoders[i]->encode_frame(buf->y, buf->u, buf->v,
-                                               buf->width, buf->height, extra.timestamp_eof);
-
-        if (out_id == -1) {
-          LOGE("Failed to encode frame. frame_id: %d encode_id: %d", extra.frame_id, encode_idx);
-        }
-
-        // publish encode index
-        if (i == 0 && out_id != -1) {
-          MessageBuilder msg;
-          // this is really ugly
-          bool valid = (buf->get_frame_id() == extra.frame_id);
-          auto eidx = cam_info.type == DriverCam ? msg.initEvent(valid).initDriverEncodeIdx() :
-                     (cam_info.type == WideRoadCam ? msg.initEvent(valid).initWideRoadEncodeIdx() : msg.initEvent(valid).initRoadEncodeIdx());
-          eidx.setFrameId(extra.frame_id);
-          eidx.setTimestampSof(extra.timestamp_sof);
-          eidx.setTimestampEof(extra.timestamp_eof);
-          if (Hardware::TICI()) {
-            eidx.setType(cereal::EncodeIndex::Type::FULL_H_E_V_C);
-          } else {
-            eidx.setType(cam_info.type == DriverCam ? cereal::EncodeIndex::Type::FRONT : cereal::EncodeIndex::Type::FULL_H_E_V_C);
-          }
-          eidx.setEncodeId(encode_idx);
-          eidx.setSegmentNum(cur_seg);
-          eidx.setSegmentId(out_id);
-          if (lh) {
-            auto bytes = msg.toBytes();
-            lh_log(lh, bytes.begin(), bytes.size(), true);
-          }
+        EncoderStats &es = s->encoder_stats[cam_info.type][i];
+        if (!queues[i]->push({.buf = buf, .extra = extra, .segment = cur_seg, .segment_path = cur_seg_path, .encode_idx = encode_idx})) {
+          es.queue_drops++;
+          LOGE_100("camera %d encoder %d queue full, dropping frame %d", cam_info.type, i, extra.frame_id);
         }
+        update_max_atomic(es.max_queue_depth, (uint64_t)queues[i]->size());
       }
 
       encode_idx++;
     }
-
-    if (lh) {
-      lh_close(lh);
-      lh = NULL;
-    }
   }
 
   LOG("encoder destroy");
-  for(auto &e : encoders) {
-    e->encoder_close();
+  // the null frame stopping the worker can't be dropped, wait for room
+  for (auto &q : queues) {
+    while (!q->push({})) util::sleep_for(1);
+  }
+  for (auto &t : workers) t.join();
+  for (auto &e : encoders) {
     delete e;
   }
 }
 
 void logger_rotate(LoggerdState *s) {
+  double start_tms = millis_since_boot();
   {
     std::unique_lock lk(s->rotate_lock);
     int segment = -1;
@@ -160,6 +228,7 @@ void logger_rotate(LoggerdState *s) {
     s->last_rotate_tms = millis_since_boot();
   }
   s->rotate_cv.notify_all();
+  s->rotate_stall.add(millis_since_boot() - start_tms);
   LOGW((s->logger.part == 0) ? "logging to %s" : "rotated to %s", s->segment_path);
 }
 
@@ -177,11 +246,83 @@ void rotate_if_needed(LoggerdState *s) {
   }
 }
 
-void loggerd_thread() {
+static json11::Json log_file_stats_json(const LogFileStats &cur, LogFileStats &last, bool new_segment, double seconds) {
+  // counters restart with every segment
+  if (new_segment) last = {};
+  uint64_t bytes_in = cur.bytes_in - last.bytes_in;
+  uint64_t bytes_out = cur.bytes_out - last.bytes_out;
+  double write_ms = (cur.write_ns - last.write_ns) * 1e-6;
+  uint64_t chunks = cur.chunks - last.chunks;
+  last = cur;
+  return json11::Json::object{
+    {"bytes_per_sec", bytes_in / seconds},
+    {"compressed_bytes_per_sec", bytes_out / seconds},
+    {"compression_ratio", cur.bytes_out > 0 ? (double)cur.bytes_in / cur.bytes_out : 0.},
+    {"bz_write_ms", write_ms},
+    {"bz_write_load", write_ms / (seconds * 1000.)},
+    {"chunks", (double)chunks},
+  };
+}
+
+std::string loggerd_stats_json(LoggerdState *s, const std::vector<std::pair<std::string, ServiceStats *>> &services, double seconds) {
+  json11::Json::object services_j;
+  for (auto &[name, stats] : services) {
+    if (stats->msgs == 0) continue;
+
+    services_j[name] = json11::Json::object{
+      {"msgs_per_sec", stats->msgs / seconds},
+      {"bytes_per_sec", stats->bytes / seconds},
+      {"qlog_msgs", (double)stats->qlog_msgs},
+      {"avg_drain", stats->drains > 0 ? (double)stats->msgs / stats->drains : 0.},
+      {"max_drain", (double)stats->max_drain},
+      {"cap_hits", (double)stats->cap_hits},
+    };
+    *stats = {};
+  }
+
+  json11::Json::object encoders_j;
+  for (const auto &cam : cameras_logged) {
+    if (!cam.enable) continue;
+
+    for (int i = 0; i < (cam.has_qcamera ? 2 : 1); ++i) {
+      EncoderStats &es = s->encoder_stats[cam.type][i];
+      uint64_t frames = es.frames.exchange(0);
+      uint64_t encode_ns = es.encode_ns.exchange(0);
+      encoders_j[i == 0 ? cam.filename : qcam_info.filename] = json11::Json::object{
+        {"fps", frames / seconds},
+        {"dropped_frames", (double)es.dropped_frames.exchange(0)},
+        {"queue_drops", (double)es.queue_drops.exchange(0)},
+        {"overwritten_frames", (double)es.overwritten_frames.exchange(0)},
+        {"max_queue_depth", (double)es.max_queue_depth.exchange(0)},
+        {"avg_encode_ms", frames > 0 ? encode_ns * 1e-6 / frames : 0.},
+        {"max_encode_ms", es.max_encode_ns.exchange(0) * 1e-6},
+      };
+    }
+  }
+
+  LogFileStats rlog, qlog;
+  int segment = logger_get_stats(&s->logger, &rlog, &qlog);
+  bool new_segment = std::exchange(s->stats_segment, segment) != segment;
+
+  json11::Json stats_j = json11::Json::object{
+    {"loggerd_stats", json11::Json::object{
+      {"interval", seconds},
+      {"segment", segment},
+      {"services", services_j},
+      {"rlog", log_file_stats_json(rlog, s->last_rlog_stats, new_segment, seconds)},
+      {"qlog", log_file_stats_json(qlog, s->last_qlog_stats, new_segment, seconds)},
+      {"encoders", encoders_j},
+    }},
+  };
+  return stats_j.dump();
+}
+
+void loggerd_thread(LoggerdState *s) {
   // setup messaging
   typedef struct QlogState {
     std::string name;
     int counter, freq;
+    ServiceStats stats;
   } QlogState;
   std::unordered_map<SubSocket*, QlogState> qlog_states;
 
@@ -199,27 +340,30 @@ void loggerd_thread() {
       .name = it.name,
       .counter = 0,
       .freq = it.decimation,
+      .stats = {},
     };
   }
 
-  LoggerdState s;
   // init logger
-  logger_init(&s.logger, "rlog", true);
-  logger_rotate(&s);
-  Params().put("CurrentRoute", s.logger.route_name);
+  logger_init(&s->logger, "rlog", true);
+  logger_rotate(s);
+  Params().put("CurrentRoute", s->logger.route_name);
 
   // init encoders
-  s.last_camera_seen_tms = millis_since_boot();
+  s->last_camera_seen_tms = millis_since_boot();
   std::vector<std::thread> encoder_threads;
   for (const auto &cam : cameras_logged) {
     if (cam.enable) {
-      encoder_threads.push_back(std::thread(encoder_thread, &s, cam));
-      if (cam.trigger_rotate) s.max_waiting++;
+      encoder_threads.push_back(std::thread(encoder_thread, s, cam));
+      if (cam.trigger_rotate) s->max_waiting++;
     }
   }
 
-  uint64_t msg_count = 0, bytes_count = 0;
+  std::vector<std::pair<std::string, ServiceStats *>> service_stats;
+  for (auto &[sock, qs] : qlog_states) service_stats.push_back({qs.name, &qs.stats});
+
   double start_ts = millis_since_boot();
+  double last_stats_ts = start_ts;
   while (!do_exit) {
     // poll for new messages on all sockets
     for (auto sock : poller->poll(1000)) {
@@ -231,32 +375,49 @@ void loggerd_thread() {
       Message *msg = nullptr;
       while (!do_exit && (msg = sock->receive(true))) {
         const bool in_qlog = qs.freq != -1 && (qs.counter++ % qs.freq == 0);
-        logger_log(&s.logger, (uint8_t *)msg->getData(), msg->getSize(), in_qlog);
-        bytes_count += msg->getSize();
+        double log_start_tms = millis_since_boot();
+        logger_log(&s->logger, (uint8_t *)msg->getData(), msg->getSize(), in_qlog);
+        s->log_latency.add(millis_since_boot() - log_start_tms);
+        s->bytes_count += msg->getSize();
+        qs.stats.msgs++;
+        qs.stats.bytes += msg->getSize();
+        qs.stats.qlog_msgs += in_qlog;
         delete msg;
 
-        rotate_if_needed(&s);
+        rotate_if_needed(s);
 
-        if ((++msg_count % 1000) == 0) {
+        if ((++s->msg_count % 1000) == 0) {
           double seconds = (millis_since_boot() - start_ts) / 1000.0;
-          LOGD("%lu messages, %.2f msg/sec, %.2f KB/sec", msg_count, msg_count / seconds, bytes_count * 0.001 / seconds);
+          LOGD("%lu messages, %.2f msg/sec, %.2f KB/sec", s->msg_count, s->msg_count / seconds, s->bytes_count * 0.001 / seconds);
         }
 
         count++;
         if (count >= 200) {
           LOGE("large volume of '%s' messages", qs.name.c_str());
+          qs.stats.cap_hits++;
           break;
         }
       }
+      if (count > 0) {
+        qs.stats.drains++;
+        qs.stats.max_drain = std::max(qs.stats.max_drain, (uint64_t)count);
+      }
+    }
+
+    // periodic stats, published as a logMessage which ends up in the rlog
+    double cur_ts = millis_since_boot();
+    if ((cur_ts - last_stats_ts) > STATS_INTERVAL * 1000) {
+      LOG("%s", loggerd_stats_json(s, service_stats, (cur_ts - last_stats_ts) / 1000.0).c_str());
+      last_stats_ts = cur_ts;
     }
   }
 
   LOGW("closing encoders");
-  s.rotate_cv.notify_all();
+  s->rotate_cv.notify_all();
   for (auto &t : encoder_threads) t.join();
 
   LOGW("closing logger");
-  logger_close(&s.logger, &do_exit);
+  logger_close(&s->logger, &do_exit);
 
   if (do_exit.power_failure) {
     LOGE("power failure");
@@ -6,17 +6,22 @@
 #include <cassert>
 #include <cerrno>
 #include <condition_variable>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "cereal/messaging/messaging.h"
 #include "cereal/services.h"
 #include "cereal/visionipc/visionipc.h"
 #include "cereal/visionipc/visionipc_client.h"
 #include "selfdrive/camerad/cameras/camera_common.h"
+#include "selfdrive/common/histogram.h"
 #include "selfdrive/common/params.h"
+#include "selfdrive/common/ring_queue.h"
 #include "selfdrive/common/swaglog.h"
 #include "selfdrive/common/timing.h"
 #include "selfdrive/common/util.h"
@@ -28,8 +33,8 @@
 #include "selfdrive/loggerd/omx_encoder.h"
 #define Encoder OmxEncoder
 #else
-#include "selfdrive/loggerd/raw_logger.h"
-#define Encoder RawLogger
+#include "selfdrive/loggerd/ffmpeg_encoder.h"
+#define Encoder FfmpegEncoder
 #endif
 
 constexpr int MAIN_FPS = 20;
@@ -38,6 +43,9 @@ const int DCAM_BITRATE = Hardware::TICI() ? MAIN_BITRATE : 2500000;
 
 #define NO_CAMERA_PATIENCE 500 // fall back to time-based rotation if all cameras are dead
 
+#define ENCODER_QUEUE_SIZE 10 // frames, well below YUV_BUFFER_COUNT so queued buffers aren't reused by camerad
+#define STATS_INTERVAL 10 // seconds between loggerd stats reports
+
 const bool LOGGERD_TEST = getenv("LOGGERD_TEST");
 const int SEGMENT_LENGTH = LOGGERD_TEST ? atoi(getenv("LOGGERD_SEGMENT_LENGTH")) : 60;
 
@@ -107,6 +115,32 @@ const LogCameraInfo qcam_info = {
   .frame_height = Hardware::TICI() ? 330 : 360 // keep pixel count the same?
 };
 
+struct EncoderStats {
+  std::atomic<uint64_t> frames = 0;
+  std::atomic<uint64_t> dropped_frames = 0;  // gaps in frame_id seen by the encoder thread
+  std::atomic<uint64_t> queue_drops = 0;     // frames dropped because the encoder fell behind
+  std::atomic<uint64_t> overwritten_frames = 0;  // buffer reused by camerad before it was encoded
+  std::atomic<uint64_t> max_queue_depth = 0;
+  std::atomic<uint64_t> encode_ns = 0;       // total time spent in encode_frame
+  std::atomic<uint64_t> max_encode_ns = 0;
+};
+
+struct EncoderFrame {
+  VisionBuf *buf;
+  VisionIpcBufExtra extra;
+  int segment;
+  std::shared_ptr<const std::string> segment_path;  // of `segment`, s->segment_path moves on with rotation
+  int encode_idx;
+};
+// frames past ENCODER_QUEUE_SIZE are dropped instead of queued
+typedef RingQueue<EncoderFrame, ENCODER_QUEUE_SIZE> EncoderQueue;
+
+struct ServiceStats {
+  uint64_t msgs, bytes, qlog_msgs;
+  uint64_t drains, max_drain;  // socket drain batch sizes
+  uint64_t cap_hits;           // drain stopped at the per-poll message cap
+};
+
 struct LoggerdState {
   LoggerState logger = {};
   char segment_path[4096];
@@ -123,9 +157,20 @@ struct LoggerdState {
   std::atomic<uint32_t> start_frame_id = 0;
   bool camera_ready[WideRoadCam + 1] = {};
   bool camera_synced[WideRoadCam + 1] = {};
+
+  // stats, reset on each report
+  EncoderStats encoder_stats[WideRoadCam + 1][2];  // main and qcamera encoder
+  int stats_segment = -1;
+  LogFileStats last_rlog_stats = {}, last_qlog_stats = {};
+
+  // cumulative, only touched by the loggerd thread
+  uint64_t msg_count = 0, bytes_count = 0;
+  LatencyHistogram log_latency;    // logger_log
+  LatencyHistogram rotate_stall;   // logger_rotate
 };
 
 bool sync_encoders(LoggerdState *s, CameraType cam_type, uint32_t frame_id);
 bool trigger_rotate_if_needed(LoggerdState *s, int cur_seg, uint32_t frame_id);
 void rotate_if_needed(LoggerdState *s);
-void loggerd_thread();
+std::string loggerd_stats_json(LoggerdState *s, const std::vector<std::pair<std::string, ServiceStats *>> &services, double seconds);
+void loggerd_thread(LoggerdState *s);
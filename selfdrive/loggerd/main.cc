@@ -14,7 +14,8 @@ int main(int argc, char** argv) {
     //assert(ret == 0);
   }
 
-  loggerd_thread();
+  LoggerdState s;
+  loggerd_thread(&s);
 
   return 0;
 }
@@ -0,0 +1,216 @@
+// Synthetic load for loggerd: publishes all logged services at a multiple of their
+// real frequency plus a fake road camera, runs loggerd_thread against a tmpfs LOG_ROOT,
+// and reports throughput, drops, logger_log latency and rotation stalls.
+//
+// usage: benchmark_loggerd [--rate 1.0] [--size 1.0] [--duration 30] [--segment-length 10] [--sizes-from rlog.bz2]
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <capnp/dynamic.h>
+#include <random>
+
+#include "selfdrive/loggerd/loggerd.h"
+#include "selfdrive/ui/replay/util.h"
+
+const std::string BENCH_LOG_ROOT = "/dev/shm/loggerd_benchmark";
+const int DEFAULT_MSG_SIZE = 1024;
+const int CAMERA_WIDTH = 1928, CAMERA_HEIGHT = 1208;
+
+struct BenchmarkArgs {
+  double rate = 1.0;
+  double size = 1.0;
+  int duration = 30;
+  int segment_length = 10;
+  std::string sizes_from;
+};
+
+// average serialized message size per service, from an existing rlog
+std::map<std::string, size_t> message_sizes(const std::string &rlog) {
+  std::map<std::string, std::pair<size_t, size_t>> sums;
+  std::string log = decompressBZ2(util::read_file(rlog));
+  kj::ArrayPtr<const capnp::word> words((const capnp::word *)log.data(), log.size() / sizeof(capnp::word));
+  while (words.size() > 0) {
+    try {
+      capnp::FlatArrayMessageReader reader(words);
+      auto event = capnp::toDynamic(reader.getRoot<cereal::Event>());
+      KJ_IF_MAYBE(field, event.which()) {
+        auto &[bytes, cnt] = sums[field->getProto().getName().cStr()];
+        bytes += (reader.getEnd() - words.begin()) * sizeof(capnp::word);
+        cnt++;
+      }
+      words = kj::arrayPtr(reader.getEnd(), words.end());
+    } catch (const kj::Exception &e) {
+      printf("failed to parse %s: %s\n", rlog.c_str(), e.getDescription().cStr());
+      break;
+    }
+  }
+
+  std::map<std::string, size_t> sizes;
+  for (auto &[name, sum] : sums) sizes[name] = sum.first / sum.second;
+  return sizes;
+}
+
+// a valid event with a mildly compressible payload, so the bz2 cost is realistic
+kj::Array<capnp::byte> build_message(size_t size) {
+  std::mt19937 rng(size);
+  std::normal_distribution<float> noise(0., 1.);
+  std::string text;
+  float x = 0.;
+  while (text.size() < size) {
+    x += noise(rng);
+    text += std::to_string(x) + ",";
+  }
+  text.resize(size);
+
+  MessageBuilder msg;
+  msg.initEvent().setLogMessage(text);
+  return msg.toBytes();
+}
+
+void publisher_thread(const service &srv, double freq, size_t size, double duration, std::atomic<uint64_t> *sent) {
+  std::unique_ptr<Context> ctx(Context::create());
+  std::unique_ptr<PubSocket> sock(PubSocket::create(ctx.get(), srv.name));
+  auto bytes = build_message(size);
+
+  const double interval_ms = 1000. / freq;
+  const double start_tms = millis_since_boot();
+  double next_tms = start_tms;
+  while (millis_since_boot() - start_tms < duration * 1000) {
+    if (sock->send((char *)bytes.begin(), bytes.size()) >= 0) {
+      ++(*sent);
+    }
+    next_tms += interval_ms;
+    double sleep_ms = next_tms - millis_since_boot();
+    if (sleep_ms > 0) {
+      util::sleep_for(sleep_ms);
+    }
+  }
+}
+
+void camera_thread(double fps, double duration, std::atomic<uint64_t> *sent) {
+  VisionIpcServer vipc_server("camerad");
+  vipc_server.create_buffers(VISION_STREAM_ROAD, YUV_BUFFER_COUNT, false, CAMERA_WIDTH, CAMERA_HEIGHT);
+  vipc_server.start_listener();
+
+  std::mt19937 rng(0);
+  const double start_tms = millis_since_boot();
+  double next_tms = start_tms;
+  uint32_t frame_id = 0;
+  while (millis_since_boot() - start_tms < duration * 1000) {
+    VisionBuf *buf = vipc_server.get_buffer(VISION_STREAM_ROAD);
+    // a moving gradient with some noise, roughly as hard to encode as a real frame
+    for (int i = 0; i < buf->len; i += 64) {
+      buf->addr[i] = (uint8_t)(i / 64 + frame_id + (rng() & 0xf));
+    }
+    uint64_t ts = nanos_since_boot();
+    VisionIpcBufExtra extra = {.frame_id = frame_id++, .timestamp_sof = ts, .timestamp_eof = ts};
+    vipc_server.send(buf, &extra, false);
+    ++(*sent);
+
+    next_tms += 1000. / fps;
+    double sleep_ms = next_tms - millis_since_boot();
+    if (sleep_ms > 0) {
+      util::sleep_for(sleep_ms);
+    }
+  }
+}
+
+// runs in a forked child, so the parent's rusage only covers loggerd
+uint64_t run_publishers(const BenchmarkArgs &args) {
+  std::map<std::string, size_t> sizes;
+  if (!args.sizes_from.empty()) {
+    sizes = message_sizes(args.sizes_from);
+  }
+
+  std::atomic<uint64_t> sent = 0, frames = 0;
+  std::vector<std::thread> threads;
+  for (const auto &it : services) {
+    if (!it.should_log || it.frequency <= 0) continue;
+
+    auto size_it = sizes.find(it.name);
+    size_t size = (size_it != sizes.end() ? size_it->second : DEFAULT_MSG_SIZE) * args.size;
+    threads.emplace_back(publisher_thread, std::cref(it), it.frequency * args.rate, size, args.duration, &sent);
+  }
+  threads.emplace_back(camera_thread, MAIN_FPS * args.rate, args.duration, &frames);
+  for (auto &t : threads) t.join();
+
+  printf("published %lu messages and %lu frames\n", sent.load(), frames.load());
+  return sent;
+}
+
+int main(int argc, char *argv[]) {
+  BenchmarkArgs args;
+  for (int i = 1; i < argc - 1; i += 2) {
+    std::string arg = argv[i];
+    if (arg == "--rate") args.rate = atof(argv[i + 1]);
+    else if (arg == "--size") args.size = atof(argv[i + 1]);
+    else if (arg == "--duration") args.duration = atoi(argv[i + 1]);
+    else if (arg == "--segment-length") args.segment_length = atoi(argv[i + 1]);
+    else if (arg == "--sizes-from") args.sizes_from = argv[i + 1];
+  }
+
+  // LOG_ROOT and the segment length are read during static init, re-exec with them set
+  if (!LOGGERD_TEST || LOG_ROOT != BENCH_LOG_ROOT) {
+    setenv("LOG_ROOT", BENCH_LOG_ROOT.c_str(), 1);
+    setenv("LOGGERD_TEST", "1", 1);
+    setenv("LOGGERD_SEGMENT_LENGTH", std::to_string(args.segment_length).c_str(), 1);
+    execv("/proc/self/exe", argv);
+    perror("execv");
+    return 1;
+  }
+  if (system(("rm -rf " + BENCH_LOG_ROOT).c_str()) != 0) {
+    printf("failed to clear %s\n", BENCH_LOG_ROOT.c_str());
+    return 1;
+  }
+
+  int fds[2];
+  int err = pipe(fds);
+  assert(err == 0);
+
+  pid_t pid = fork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    close(fds[0]);
+    // give loggerd time to subscribe before publishing
+    util::sleep_for(2000);
+    uint64_t sent = run_publishers(args);
+    const bool written = HANDLE_EINTR(write(fds[1], &sent, sizeof(sent))) == sizeof(sent);
+    _exit(written ? 0 : 1);
+  }
+  close(fds[1]);
+
+  LoggerdState s;
+  std::thread logger(loggerd_thread, &s);
+
+  uint64_t sent = 0;
+  const bool counted = HANDLE_EINTR(read(fds[0], &sent, sizeof(sent))) == sizeof(sent);
+  waitpid(pid, nullptr, 0);
+  // let loggerd drain the sockets
+  util::sleep_for(1000);
+
+  ExitHandler do_exit;
+  do_exit = true;
+  logger.join();
+  if (!counted) {
+    printf("publishers exited without a message count\n");
+    return 1;
+  }
+
+  struct rusage usage = {};
+  getrusage(RUSAGE_SELF, &usage);
+  double cpu_ms = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000. + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.;
+  double mb = s.bytes_count / 1e6;
+
+  printf("\n***** loggerd benchmark, %.1fx rate, %.1fx size, %ds *****\n", args.rate, args.size, args.duration);
+  printf("logged: %lu messages, %.2f MB\n", s.msg_count, mb);
+  printf("throughput: %.1f msg/sec, %.2f MB/sec\n", s.msg_count / (double)args.duration, mb / args.duration);
+  printf("dropped: %ld messages (%.2f%%)\n", (int64_t)sent - (int64_t)s.msg_count,
+         sent > 0 ? 100. * ((int64_t)sent - (int64_t)s.msg_count) / sent : 0.);
+  printf("logger_log latency: mean %.3f ms, p99 %.3f ms, max %.3f ms\n",
+         s.log_latency.mean(), s.log_latency.percentile(99), s.log_latency.max());
+  printf("rotation stall: %lu rotations, mean %.2f ms, max %.2f ms\n",
+         s.rotate_stall.count(), s.rotate_stall.mean(), s.rotate_stall.max());
+  printf("cpu: %.0f ms total, %.1f ms/MB logged (including the encoder)\n", cpu_ms, mb > 0 ? cpu_ms / mb : 0.);
+  return 0;
+}
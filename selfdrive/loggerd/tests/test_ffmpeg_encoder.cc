@@ -0,0 +1,86 @@
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "selfdrive/common/util.h"
+#include "selfdrive/loggerd/ffmpeg_encoder.h"
+
+const int FRAME_WIDTH = 320, FRAME_HEIGHT = 240, FPS = 20;
+const int SEGMENT_FRAMES = 2 * FPS;
+
+struct VideoInfo {
+  int frames = 0, keyframes = 0;
+  bool starts_with_keyframe = false;
+};
+
+VideoInfo read_video(const std::string &path) {
+  VideoInfo info;
+  AVFormatContext *ctx = NULL;
+  REQUIRE(avformat_open_input(&ctx, path.c_str(), NULL, NULL) == 0);
+  REQUIRE(avformat_find_stream_info(ctx, NULL) >= 0);
+  AVPacket *pkt = av_packet_alloc();
+  while (av_read_frame(ctx, pkt) >= 0) {
+    const bool key = pkt->flags & AV_PKT_FLAG_KEY;
+    if (info.frames == 0) info.starts_with_keyframe = key;
+    info.frames++;
+    info.keyframes += key;
+    av_packet_unref(pkt);
+  }
+  av_packet_free(&pkt);
+  avformat_close_input(&ctx);
+  return info;
+}
+
+// a new encoder is opened for every segment, each segment must be a whole video of its own
+void encode_segments(const char *filename, bool h265, bool downscale, bool write, int in_width, int in_height) {
+  const std::string log_root = "/tmp/test_ffmpeg_encoder";
+  REQUIRE(system(("rm " + log_root + " -rf").c_str()) == 0);
+  REQUIRE(util::create_directories(log_root, 0775));
+
+  std::vector<uint8_t> yuv(in_width * in_height * 3 / 2);
+  uint8_t *y = yuv.data(), *u = y + in_width * in_height, *v = u + (in_width / 2) * (in_height / 2);
+
+  FfmpegEncoder encoder(filename, FRAME_WIDTH, FRAME_HEIGHT, FPS, 1000000, h265, downscale, write);
+  for (int segment = 0; segment < 3; ++segment) {
+    const std::string segment_path = log_root + "/" + std::to_string(segment);
+    REQUIRE(mkdir(segment_path.c_str(), 0775) == 0);
+    encoder.encoder_open(segment_path.c_str());
+    REQUIRE(util::file_exists(segment_path + "/" + filename + ".lock"));
+    for (int i = 0; i < SEGMENT_FRAMES; ++i) {
+      // a moving gradient, so the frames differ
+      for (size_t p = 0; p < yuv.size(); ++p) yuv[p] = p + i * 4;
+      REQUIRE(encoder.encode_frame(y, u, v, in_width, in_height, i * 50000000ULL) == i);
+    }
+    encoder.encoder_close();
+
+    // the frames in flight are drained into the file when it's closed
+    REQUIRE(!util::file_exists(segment_path + "/" + filename + ".lock"));
+    const std::string video_path = segment_path + "/" + filename;
+    if (write) {
+      VideoInfo info = read_video(video_path);
+      REQUIRE(info.frames == SEGMENT_FRAMES);
+      REQUIRE(info.starts_with_keyframe);
+      REQUIRE(info.keyframes >= SEGMENT_FRAMES / FPS);
+    } else {
+      REQUIRE(!util::file_exists(video_path));
+    }
+  }
+  // a closed encoder takes no frames
+  REQUIRE(encoder.encode_frame(y, u, v, in_width, in_height, 0) == -1);
+}
+
+TEST_CASE("FfmpegEncoder segments") {
+  av_register_all();
+
+  SECTION("fcamera, hevc") {
+    encode_segments("fcamera.hevc", true, false, true, FRAME_WIDTH, FRAME_HEIGHT);
+  }
+  SECTION("qcamera, h264 downscaled") {
+    encode_segments("qcamera.ts", false, true, true, FRAME_WIDTH * 2, FRAME_HEIGHT * 2);
+  }
+  SECTION("not written") {
+    encode_segments("fcamera.hevc", true, false, false, FRAME_WIDTH, FRAME_HEIGHT);
+  }
+}
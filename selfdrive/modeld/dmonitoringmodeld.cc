@@ -1,34 +1,71 @@
 #include <sys/resource.h>
 #include <limits.h>
 
+#include <array>
 #include <cstdio>
 #include <cstdlib>
 
+#include "json11.hpp"
+
 #include "cereal/visionipc/visionipc_client.h"
+#include "selfdrive/common/stage_stats.h"
 #include "selfdrive/common/swaglog.h"
 #include "selfdrive/common/util.h"
 #include "selfdrive/modeld/models/dmonitoring.h"
 
 ExitHandler do_exit;
 
+enum Stage {
+  STAGE_RECV,     // in vipc_client.recv, for the next frame
+  STAGE_PREPARE,  // dmonitoring_eval_frame, see DMonitoringTimes
+  STAGE_EXECUTE,
+  STAGE_DECODE,
+  STAGE_PUBLISH,  // driverState, built and sent
+  STAGE_LATENCY,  // from the end of the frame until driverState is sent
+  STAGE_COUNT,
+};
+const std::array<const char *, STAGE_COUNT> STAGE_NAMES = {
+  "recv", "prepare", "execute", "decode", "publish", "latency",
+};
+const double STATS_INTERVAL = 10.; // seconds between stats reports
+
 void run_model(DMonitoringModelState &model, VisionIpcClient &vipc_client) {
   PubMaster pm({"driverState"});
-  double last = 0;
+  StageStats<STAGE_COUNT> stats(STAGE_NAMES);
+  double last_stats = millis_since_boot();
 
+  StageClock clock;
   while (!do_exit) {
     VisionIpcBufExtra extra = {};
     VisionBuf *buf = vipc_client.recv(&extra);
     if (buf == nullptr) continue;
+    stats.add(STAGE_RECV, clock.lap());
 
-    double t1 = millis_since_boot();
     DMonitoringResult res = dmonitoring_eval_frame(&model, buf->addr, buf->width, buf->height);
-    double t2 = millis_since_boot();
+    const double eval_ms = clock.lap();
+    const DMonitoringTimes &t = model.times;
+    stats.add(STAGE_PREPARE, t.prepare);
+    stats.add(STAGE_EXECUTE, t.execute);
+    stats.add(STAGE_DECODE, t.decode);
 
     // send dm packet
-    dmonitoring_publish(pm, extra.frame_id, res, (t2 - t1) / 1000.0, model.output);
+    dmonitoring_publish(pm, extra.frame_id, res, eval_ms / 1000.0, model.output);
+    stats.add(STAGE_PUBLISH, clock.lap());
+    stats.add(STAGE_LATENCY, millis_since_boot() - extra.timestamp_eof / 1e6);
 
-    //printf("dmonitoring process: %.2fms, from last %.2fms\n", t2 - t1, t1 - last);
-    last = t1;
+    const double now = millis_since_boot();
+    if (now - last_stats > STATS_INTERVAL * 1000) {
+      json11::Json stats_j = json11::Json::object{
+        {"dmonitoringmodeld_stats", json11::Json::object{
+          {"interval", (now - last_stats) / 1000.},
+          {"stages", stats.report()},
+        }},
+      };
+      LOG("%s", stats_j.dump().c_str());
+      last_stats = now;
+    }
+    // the wait for the next frame starts here
+    clock.lap();
   }
 }
 
@@ -1,13 +1,17 @@
+#include <algorithm>
+#include <array>
 #include <cstdio>
 #include <cstdlib>
-#include <mutex>
+#include <thread>
 
-#include <eigen3/Eigen/Dense>
+#include "json11.hpp"
 
 #include "cereal/messaging/messaging.h"
 #include "cereal/visionipc/visionipc_client.h"
 #include "selfdrive/common/clutil.h"
 #include "selfdrive/common/params.h"
+#include "selfdrive/common/ring_queue.h"
+#include "selfdrive/common/stage_stats.h"
 #include "selfdrive/common/swaglog.h"
 #include "selfdrive/common/util.h"
 #include "selfdrive/hardware/hw.h"
@@ -15,41 +19,85 @@
 
 ExitHandler do_exit;
 
-mat3 update_calibration(cereal::LiveCalibrationData::Reader live_calib, bool wide_camera) {
-  /*
-     import numpy as np
-     from common.transformations.model import medmodel_frame_from_road_frame
-     medmodel_frame_from_ground = medmodel_frame_from_road_frame[:, (0, 1, 3)]
-     ground_from_medmodel_frame = np.linalg.inv(medmodel_frame_from_ground)
-  */
-  static const auto ground_from_medmodel_frame = (Eigen::Matrix<float, 3, 3>() << 
-    0.00000000e+00, 0.00000000e+00, 1.00000000e+00,
-    -1.09890110e-03, 0.00000000e+00, 2.81318681e-01,
-    -1.84808520e-20, 9.00738606e-04, -4.28751576e-02).finished();
-
-  static const auto cam_intrinsics = Eigen::Matrix<float, 3, 3, Eigen::RowMajor>(wide_camera ? ecam_intrinsic_matrix.v : fcam_intrinsic_matrix.v);
-  static const mat3 yuv_transform = get_model_yuv_transform();
-
-  auto extrinsic_matrix = live_calib.getExtrinsicMatrix();
-  Eigen::Matrix<float, 3, 4> extrinsic_matrix_eigen;
-  for (int i = 0; i < 4*3; i++) {
-    extrinsic_matrix_eigen(i / 4, i % 4) = extrinsic_matrix[i];
-  }
+// the stages of a frame, timed on the thread doing them and added to the histograms when it's published
+enum Stage {
+  STAGE_WAIT_INPUT,     // for an input buffer to prepare into
+  STAGE_RECV,           // in vipc_client.recv, for the next frame
+  STAGE_SM_UPDATE,      // sm.update and the calibration
+  STAGE_WARP,           // model_prepare_frame, see PrepareTimes
+  STAGE_LOAD,
+  STAGE_FINISH,
+  STAGE_WAIT_EXECUTE,   // prepared, until the previous frame is executed
+  STAGE_EXECUTE,
+  STAGE_OUTPUT_COPY,
+  STAGE_WAIT_PUBLISH,   // executed, until the previous frame is published
+  STAGE_BUILD,          // modelV2
+  STAGE_SEND,
+  STAGE_POSENET,        // cameraOdometry, built and sent
+  STAGE_LATENCY,        // from the end of the frame until modelV2 is sent
+  STAGE_COUNT,
+};
+const std::array<const char *, STAGE_COUNT> STAGE_NAMES = {
+  "wait_input", "recv", "sm_update", "warp", "load", "finish", "wait_execute",
+  "execute", "output_copy", "wait_publish", "build", "send", "posenet", "latency",
+};
+const int STATS_FRAMES = MODEL_FREQ * 10;
 
-  auto camera_frame_from_road_frame = cam_intrinsics * extrinsic_matrix_eigen;
-  Eigen::Matrix<float, 3, 3> camera_frame_from_ground;
-  camera_frame_from_ground.col(0) = camera_frame_from_road_frame.col(0);
-  camera_frame_from_ground.col(1) = camera_frame_from_road_frame.col(1);
-  camera_frame_from_ground.col(2) = camera_frame_from_road_frame.col(3);
+// a frame on its way through the pipeline
+struct ModelJob {
+  bool stop = false;
+  ModelInput input;
+  VisionIpcBufExtra extra;
+  uint32_t frame_id;
+  uint32_t vipc_dropped_frames;
+  float frame_drop_ratio;
+  bool live_calib_seen;
+  // millis_since_boot when it's handed to the next thread
+  double t_prepared, t_executed;
+  std::array<double, STAGE_COUNT> stage_ms;
+};
 
-  auto warp_matrix = camera_frame_from_ground * ground_from_medmodel_frame;
-  mat3 transform = {};
-  for (int i=0; i<3*3; i++) {
-    transform.v[i] = warp_matrix(i / 3, i % 3);
-  }
-  return matmul3(yuv_transform, transform);
+struct ModelResult {
+  ModelJob job;
+  std::array<float, NET_OUTPUT_SIZE> output;
+};
+
+// logs the stage histograms with the fps the pipeline could sustain, that of its slowest thread
+void log_stats(StageStats<STAGE_COUNT> &stats, bool overlap) {
+  auto mean = [&](std::initializer_list<Stage> stages) {
+    double ms = 0;
+    for (Stage s : stages) ms += stats[s].mean();
+    return ms;
+  };
+  const double prepare = mean({STAGE_WARP, STAGE_LOAD, STAGE_FINISH});
+  const double execute = mean({STAGE_EXECUTE, STAGE_OUTPUT_COPY});
+  const double publish = mean({STAGE_BUILD, STAGE_SEND, STAGE_POSENET});
+  const double busiest = overlap ? std::max({prepare, execute, publish}) : std::max(prepare + execute, publish);
+
+  json11::Json stats_j = json11::Json::object{
+    {"modeld_stats", json11::Json::object{
+      {"frames", STATS_FRAMES},
+      {"max_fps", busiest > 0 ? 1000. / busiest : 0.},
+      {"stages", stats.report()},
+    }},
+  };
+  LOG("%s", stats_j.dump().c_str());
+}
+
+// the stages on the path from a frame to the model's output run realtime, on modeld's core.
+// each thread sets this itself, so the publish thread doesn't inherit it
+void set_realtime_stage() {
+  if (Hardware::PC()) return;
+  int ret = util::set_realtime_priority(54);
+  assert(ret == 0);
+  ret = util::set_core_affinity({Hardware::EON() ? 2 : 7});
+  assert(ret == 0);
 }
 
+// Three stages, each on its own thread: this one receives and prepares frames, the model executes
+// them in order, and their messages are built and sent while the next frame executes. Inputs alternate
+// between the two buffers of ModelFrame, so with a runner that doesn't read the frame from its own
+// buffer, the next frame is prepared while the current one executes.
 void run_model(ModelState &model, VisionIpcClient &vipc_client, bool wide_camera) {
   // messaging
   PubMaster pm({"modelV2", "cameraOdometry"});
@@ -59,16 +107,92 @@ void run_model(ModelState &model, VisionIpcClient &vipc_client, bool wide_camera
   FirstOrderFilter frame_dropped_filter(0., 10., 1. / MODEL_FREQ);
 
   uint32_t frame_id = 0, last_vipc_frame_id = 0;
-  double last = 0;
   uint32_t run_count = 0;
 
   mat3 model_transform = {};
   bool live_calib_seen = false;
 
+  // a token per input buffer that can be prepared into, returned when its frame is executed
+  const bool overlap = model_overlaps_frames(&model);
+  RingQueue<int, 2> free_inputs;
+  for (int i = 0; i < (overlap ? 2 : 1); i++) free_inputs.push(i);
+  RingQueue<ModelJob, 1> prepared;
+  RingQueue<ModelResult, 2> executed;
+
+  std::thread execute_thread([&]() {
+    util::set_thread_name("modeld_execute");
+    set_realtime_stage();
+    ModelResult result;
+    while (true) {
+      result.job = prepared.pop();
+      if (!result.job.stop) {
+        ModelJob &job = result.job;
+        StageClock clock;
+        job.stage_ms[STAGE_WAIT_EXECUTE] = millis_since_boot() - job.t_prepared;
+        model_execute(&model, job.input);
+        job.stage_ms[STAGE_EXECUTE] = clock.lap();
+        result.output = model.output;
+        job.stage_ms[STAGE_OUTPUT_COPY] = clock.lap();
+        job.t_executed = millis_since_boot();
+        free_inputs.push(0);
+      }
+      executed.push(result);
+      if (result.job.stop) break;
+    }
+  });
+
+  std::thread publish_thread([&]() {
+    util::set_thread_name("modeld_publish");
+    // left at normal priority on any core, building a message never delays the next frame
+    PublishState ps = {};
+    StageStats<STAGE_COUNT> stats(STAGE_NAMES);
+    int frames = 0;
+    while (true) {
+      ModelResult result = executed.pop();
+      ModelJob &job = result.job;
+      if (job.stop) break;
+
+      StageClock clock;
+      job.stage_ms[STAGE_WAIT_PUBLISH] = millis_since_boot() - job.t_executed;
+      const ModelOutput &model_output = *(const ModelOutput *)result.output.data();
+      const PrepareTimes &prepare = job.input.prepare_times;
+      const float model_execution_time = (prepare.warp + prepare.load + prepare.finish + job.stage_ms[STAGE_EXECUTE]) / 1000.0;
+      fill_model_msg(ps, job.extra.frame_id, job.frame_id, job.frame_drop_ratio, model_output, job.extra.timestamp_eof, model_execution_time,
+                     kj::ArrayPtr<const float>(result.output.data(), result.output.size()), job.live_calib_seen);
+      auto bytes = ps.msg.toBytes();
+      job.stage_ms[STAGE_BUILD] = clock.lap();
+      pm.send("modelV2", bytes.begin(), bytes.size());
+      job.stage_ms[STAGE_SEND] = clock.lap();
+      job.stage_ms[STAGE_LATENCY] = millis_since_boot() - job.extra.timestamp_eof / 1e6;
+      posenet_publish(pm, job.extra.frame_id, job.vipc_dropped_frames, model_output, job.extra.timestamp_eof, job.live_calib_seen);
+      job.stage_ms[STAGE_POSENET] = clock.lap();
+
+      for (int i = 0; i < STAGE_COUNT; i++) {
+        stats.add(i, job.stage_ms[i]);
+      }
+      if (++frames == STATS_FRAMES) {
+        log_stats(stats, overlap);
+        frames = 0;
+      }
+    }
+  });
+
+  // this thread prepares the frames
+  set_realtime_stage();
+  StageClock clock;
   while (!do_exit) {
-    VisionIpcBufExtra extra = {};
-    VisionBuf *buf = vipc_client.recv(&extra);
-    if (buf == nullptr) continue;
+    // wait for an input to prepare into before taking the newest frame
+    int token;
+    if (!free_inputs.try_pop(token, 100)) continue;
+
+    ModelJob job = {};
+    job.stage_ms[STAGE_WAIT_INPUT] = clock.lap();
+    VisionBuf *buf = nullptr;
+    while (!do_exit && buf == nullptr) {
+      buf = vipc_client.recv(&job.extra);
+    }
+    if (buf == nullptr) break;
+    job.stage_ms[STAGE_RECV] = clock.lap();
 
     // TODO: path planner timeout?
     sm.update(0);
@@ -78,53 +202,57 @@ void run_model(ModelState &model, VisionIpcClient &vipc_client, bool wide_camera
       model_transform = update_calibration(sm["liveCalibration"].getLiveCalibration(), wide_camera);
       live_calib_seen = true;
     }
+    job.stage_ms[STAGE_SM_UPDATE] = clock.lap();
 
     float vec_desire[DESIRE_LEN] = {0};
     if (desire >= 0 && desire < DESIRE_LEN) {
       vec_desire[desire] = 1.0;
     }
 
-    double mt1 = millis_since_boot();
-    ModelOutput *model_output = model_eval_frame(&model, buf->buf_cl, buf->width, buf->height,
-                                              model_transform, vec_desire);
-    double mt2 = millis_since_boot();
-    float model_execution_time = (mt2 - mt1) / 1000.0;
+    job.input = model_prepare_frame(&model, buf, model_transform, vec_desire);
+    job.stage_ms[STAGE_WARP] = job.input.prepare_times.warp;
+    job.stage_ms[STAGE_LOAD] = job.input.prepare_times.load;
+    job.stage_ms[STAGE_FINISH] = job.input.prepare_times.finish;
 
     // tracked dropped frames
-    uint32_t vipc_dropped_frames = extra.frame_id - last_vipc_frame_id - 1;
-    float frames_dropped = frame_dropped_filter.update((float)std::min(vipc_dropped_frames, 10U));
+    job.vipc_dropped_frames = job.extra.frame_id - last_vipc_frame_id - 1;
+    float frames_dropped = frame_dropped_filter.update((float)std::min(job.vipc_dropped_frames, 10U));
     if (run_count < 10) { // let frame drops warm up
       frame_dropped_filter.reset(0);
       frames_dropped = 0.;
     }
     run_count++;
 
-    float frame_drop_ratio = frames_dropped / (1 + frames_dropped);
+    job.frame_drop_ratio = frames_dropped / (1 + frames_dropped);
+    job.frame_id = frame_id;
+    job.live_calib_seen = live_calib_seen;
+    job.t_prepared = millis_since_boot();
+    prepared.push(job);
 
-    model_publish(pm, extra.frame_id, frame_id, frame_drop_ratio, *model_output, extra.timestamp_eof, model_execution_time,
-                  kj::ArrayPtr<const float>(model.output.data(), model.output.size()), live_calib_seen);
-    posenet_publish(pm, extra.frame_id, vipc_dropped_frames, *model_output, extra.timestamp_eof, live_calib_seen);
-
-    //printf("model process: %.2fms, from last %.2fms, vipc_frame_id %u, frame_id, %u, frame_drop %.3f\n", mt2 - mt1, mt1 - last, extra.frame_id, frame_id, frame_drop_ratio);
-    last = mt1;
-    last_vipc_frame_id = extra.frame_id;
+    last_vipc_frame_id = job.extra.frame_id;
+    // the wait for the next input starts here
+    clock.lap();
   }
+
+  // frames already prepared are still executed and published
+  ModelJob stop = {};
+  stop.stop = true;
+  prepared.push(stop);
+  execute_thread.join();
+  publish_thread.join();
 }
 
 int main(int argc, char **argv) {
-  if (!Hardware::PC()) {
-    int ret;
-    ret = util::set_realtime_priority(54);
-    assert(ret == 0);
-    util::set_core_affinity({Hardware::EON() ? 2 : 7});
-    assert(ret == 0);
-  }
-
   bool wide_camera = Hardware::TICI() ? Params().getBool("EnableWideCamera") : false;
 
-  // cl init
-  cl_device_id device_id = cl_get_device_id(CL_DEVICE_TYPE_DEFAULT);
-  cl_context context = CL_CHECK_ERR(clCreateContext(NULL, 1, &device_id, NULL, NULL, &err));
+  // cl init. on PC without an OpenCL GPU, frames are prepared on the CPU
+  cl_device_id device_id = Hardware::PC() ? cl_find_device_id(CL_DEVICE_TYPE_GPU) : cl_get_device_id(CL_DEVICE_TYPE_DEFAULT);
+  cl_context context = nullptr;
+  if (device_id) {
+    context = CL_CHECK_ERR(clCreateContext(NULL, 1, &device_id, NULL, NULL, &err));
+  } else {
+    LOGW("no OpenCL GPU found, preparing frames on the CPU");
+  }
 
   // init the models
   ModelState model;
@@ -145,6 +273,6 @@ int main(int argc, char **argv) {
   }
 
   model_free(&model);
-  CL_CHECK(clReleaseContext(context));
+  if (context) CL_CHECK(clReleaseContext(context));
   return 0;
 }
@@ -0,0 +1,197 @@
+// Runs the driving model over logged segments as fast as the machine allows, e.g. to evaluate
+// a new model on a set of routes. Each segment is an independent job: its rlog provides the
+// calibration, desire and frame ids modeld would have seen live, and the frames come from its
+// fcamera.hevc (ecamera.hevc with --wide). Segments are spread over worker threads, each with
+// its own model instance, so throughput scales with cores until the model runtime saturates them.
+//
+// The modelV2 messages of each segment are written to <output dir>/<segment index>--modelV2.bz2,
+// a log LogReader and tools/lib/logreader.py can read.
+//
+// usage: modeld_offline [--wide] [-j workers] <output dir> <segment> [<segment> ...]
+// a segment is a local directory or an https:// url holding the rlog.bz2 and camera files of
+// one segment. Run it from selfdrive/modeld like modeld, it loads the models from ../../models
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "selfdrive/common/clutil.h"
+#include "selfdrive/common/swaglog.h"
+#include "selfdrive/common/timing.h"
+#include "selfdrive/common/util.h"
+#include "selfdrive/loggerd/logger.h"
+#include "selfdrive/modeld/models/driving.h"
+#include "selfdrive/ui/replay/framereader.h"
+#include "selfdrive/ui/replay/logreader.h"
+
+ExitHandler do_exit;
+
+struct Args {
+  bool wide_camera = false;
+  int workers = std::max(1U, std::thread::hardware_concurrency() / 2);
+  std::string output_dir;
+  std::vector<std::string> segments;
+};
+
+struct SegmentResult {
+  bool ok = false;
+  int frames = 0;
+  double seconds = 0;
+};
+
+// runs one segment from start to end, the same steps as run_model in modeld.cc
+SegmentResult run_segment(const Args &args, int idx, cl_device_id device_id, cl_context context) {
+  SegmentResult result;
+  const std::string &segment = args.segments[idx];
+  const double t1 = millis_since_boot();
+
+  LogReader lr;
+  if (!lr.load(segment + "/rlog.bz2")) {
+    LOGE("segment %d: failed to load %s/rlog.bz2", idx, segment.c_str());
+    return result;
+  }
+  FrameReader fr;
+  const std::string camera = args.wide_camera ? "ecamera" : "fcamera";
+  if (!fr.load(segment + "/" + camera + ".hevc")) {
+    LOGE("segment %d: failed to load %s/%s.hevc", idx, segment.c_str(), camera.c_str());
+    return result;
+  }
+
+  VisionBuf buf;
+  buf.allocate(fr.getYUVSize());
+  if (device_id) buf.init_cl(device_id, context);
+  buf.init_yuv(fr.width, fr.height);
+
+  // a fresh model per segment, no recurrent state or fcw history carries over from the previous one
+  ModelState model;
+  model_init(&model, device_id, context);
+  PublishState ps = {};
+
+  const std::string path = util::string_format("%s/%03d--modelV2.bz2", args.output_dir.c_str(), idx);
+  BZFile log(path.c_str(), false);
+
+  const cereal::Event::Which encode_idx = args.wide_camera ? cereal::Event::WIDE_ROAD_ENCODE_IDX : cereal::Event::ROAD_ENCODE_IDX;
+  FirstOrderFilter frame_dropped_filter(0., 10., 1. / MODEL_FREQ);
+  uint32_t frame_id = 0, last_vipc_frame_id = 0;
+  int desire = -1;
+  mat3 model_transform = {};
+  bool live_calib_seen = false;
+
+  // the last state seen before each frame stands in for the SubMaster
+  for (const Event *e : lr.events) {
+    if (do_exit) break;
+
+    if (e->which == cereal::Event::LIVE_CALIBRATION) {
+      model_transform = update_calibration(e->event.getLiveCalibration(), args.wide_camera);
+      live_calib_seen = true;
+    } else if (e->which == cereal::Event::LATERAL_PLAN) {
+      desire = (int)e->event.getLateralPlan().getDesire();
+    } else if (e->which == cereal::Event::ROAD_CAMERA_STATE) {
+      frame_id = e->event.getRoadCameraState().getFrameId();
+    } else if (e->which == encode_idx && !e->frame) {
+      auto eidx = args.wide_camera ? e->event.getWideRoadEncodeIdx() : e->event.getRoadEncodeIdx();
+      if (!fr.get(eidx.getSegmentId(), nullptr, (uint8_t *)buf.addr)) {
+        LOGW("segment %d: failed to decode frame %d", idx, eidx.getSegmentId());
+        continue;
+      }
+      if (device_id) buf.sync(VISIONBUF_SYNC_TO_DEVICE);
+
+      float vec_desire[DESIRE_LEN] = {0};
+      if (desire >= 0 && desire < DESIRE_LEN) {
+        vec_desire[desire] = 1.0;
+      }
+
+      double mt1 = millis_since_boot();
+      ModelOutput *model_output = model_eval_frame(&model, &buf, model_transform, vec_desire);
+      double mt2 = millis_since_boot();
+
+      const uint32_t vipc_frame_id = eidx.getFrameId();
+      uint32_t vipc_dropped_frames = vipc_frame_id - last_vipc_frame_id - 1;
+      float frames_dropped = frame_dropped_filter.update((float)std::min(vipc_dropped_frames, 10U));
+      if (result.frames < 10) {
+        frame_dropped_filter.reset(0);
+        frames_dropped = 0.;
+      }
+      last_vipc_frame_id = vipc_frame_id;
+
+      auto event = fill_model_msg(ps, vipc_frame_id, frame_id, frames_dropped / (1 + frames_dropped), *model_output,
+                                  eidx.getTimestampEof(), (mt2 - mt1) / 1000.0,
+                                  kj::ArrayPtr<const float>(model.output.data(), model.output.size()), live_calib_seen);
+      // keep the time of the frame, so the output lines up with the rest of the route
+      event.setLogMonoTime(e->mono_time);
+      auto bytes = ps.msg.toBytes();
+      log.write(bytes.begin(), bytes.size());
+      result.frames++;
+    }
+  }
+
+  model_free(&model);
+  buf.free();
+
+  result.ok = !do_exit;
+  result.seconds = (millis_since_boot() - t1) / 1000.0;
+  printf("segment %d: %d frames in %.1fs (%.1f fps) -> %s\n", idx, result.frames, result.seconds,
+         result.frames / std::max(result.seconds, 1e-3), path.c_str());
+  return result;
+}
+
+int main(int argc, char **argv) {
+  Args args;
+  std::vector<std::string> positional;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--wide") args.wide_camera = true;
+    else if (arg == "-j" && i + 1 < argc) args.workers = std::max(1, atoi(argv[++i]));
+    else positional.push_back(arg);
+  }
+  if (positional.size() < 2) {
+    fprintf(stderr, "usage: %s [--wide] [-j workers] <output dir> <segment> [<segment> ...]\n", argv[0]);
+    return 1;
+  }
+  args.output_dir = positional[0];
+  args.segments.assign(positional.begin() + 1, positional.end());
+  if (!util::create_directories(args.output_dir, 0775)) {
+    fprintf(stderr, "failed to create %s\n", args.output_dir.c_str());
+    return 1;
+  }
+
+  // frames are prepared on the CPU without an OpenCL GPU, like modeld
+  cl_device_id device_id = cl_find_device_id(CL_DEVICE_TYPE_GPU);
+  cl_context context = nullptr;
+  if (device_id) {
+    context = CL_CHECK_ERR(clCreateContext(NULL, 1, &device_id, NULL, NULL, &err));
+  }
+
+  // segments are handed out one at a time, so a worker with a short segment picks up the next one
+  const int workers = std::min<int>(args.workers, args.segments.size());
+  std::atomic<int> next_segment = 0;
+  std::vector<SegmentResult> results(args.segments.size());
+  const double t1 = millis_since_boot();
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < workers; i++) {
+    threads.emplace_back([&]() {
+      for (int idx = next_segment++; idx < (int)args.segments.size() && !do_exit; idx = next_segment++) {
+        results[idx] = run_segment(args, idx, device_id, context);
+      }
+    });
+  }
+  for (auto &t : threads) t.join();
+
+  const double seconds = (millis_since_boot() - t1) / 1000.0;
+  int frames = 0, failed = 0;
+  for (const auto &r : results) {
+    frames += r.frames;
+    failed += !r.ok;
+  }
+  printf("%zu segments, %d frames in %.1fs with %d workers: %.1f fps, %d failed\n", args.segments.size(), frames,
+         seconds, workers, frames / std::max(seconds, 1e-3), failed);
+
+  if (context) CL_CHECK(clReleaseContext(context));
+  return failed > 0 ? 1 : 0;
+}
@@ -7,10 +7,17 @@
 
 #include "selfdrive/common/clutil.h"
 #include "selfdrive/common/mat.h"
-#include "selfdrive/common/timing.h"
+#include "selfdrive/common/simd.h"
+#include "selfdrive/common/stage_stats.h"
 
 ModelFrame::ModelFrame(cl_device_id device_id, cl_context context) {
-  input_frames = std::make_unique<float[]>(buf_size);
+  for (auto &input : input_frames) {
+    input = std::make_unique<float[]>(buf_size);
+  }
+  if (device_id == nullptr) {
+    transform_cpu = std::make_unique<TransformCpu>(MODEL_WIDTH, MODEL_HEIGHT);
+    return;
+  }
 
   q = CL_CHECK_ERR(clCreateCommandQueue(context, device_id, 0, &err));
   y_cl = CL_CHECK_ERR(clCreateBuffer(context, CL_MEM_READ_WRITE, MODEL_WIDTH * MODEL_HEIGHT, NULL, &err));
@@ -23,26 +30,56 @@ ModelFrame::ModelFrame(cl_device_id device_id, cl_context context) {
 }
 
 float* ModelFrame::prepare(cl_mem yuv_cl, int frame_width, int frame_height, const mat3 &projection, cl_mem *output) {
+  StageClock clock;
   transform_queue(&this->transform, q,
                   yuv_cl, frame_width, frame_height,
                   y_cl, u_cl, v_cl, MODEL_WIDTH, MODEL_HEIGHT, projection);
+  times.warp = clock.lap();
 
   if (output == NULL) {
     loadyuv_queue(&loadyuv, q, y_cl, u_cl, v_cl, net_input_cl);
 
-    std::memmove(&input_frames[0], &input_frames[MODEL_FRAME_SIZE], sizeof(float) * MODEL_FRAME_SIZE);
-    CL_CHECK(clEnqueueReadBuffer(q, net_input_cl, CL_TRUE, 0, MODEL_FRAME_SIZE * sizeof(float), &input_frames[MODEL_FRAME_SIZE], 0, nullptr, nullptr));
+    float *input = next_input();
+    times.load = clock.lap();
+    CL_CHECK(clEnqueueReadBuffer(q, net_input_cl, CL_TRUE, 0, MODEL_FRAME_SIZE * sizeof(float), &input[MODEL_FRAME_SIZE], 0, nullptr, nullptr));
     clFinish(q);
-    return &input_frames[0];
+    times.finish = clock.lap();
+    return input;
   } else {
     loadyuv_queue(&loadyuv, q, y_cl, u_cl, v_cl, *output, true);
+    times.load = clock.lap();
     // NOTE: Since thneed is using a different command queue, this clFinish is needed to ensure the image is ready.
     clFinish(q);
+    times.finish = clock.lap();
     return NULL;
   }
 }
 
+// the new frame is warped straight into the second half of the input, behind the previous one
+float* ModelFrame::prepare(const uint8_t *yuv, int frame_width, int frame_height, const mat3 &projection) {
+  assert(use_cpu());
+  StageClock clock;
+  float *input = next_input();
+  times.load = clock.lap();
+  // the warp writes the tensor itself
+  transform_cpu->run(yuv, frame_width, frame_height, projection, &input[MODEL_FRAME_SIZE]);
+  times.warp = clock.lap();
+  times.finish = 0;
+  return input;
+}
+
+// switches to the other input and copies the last frame into its first half
+float* ModelFrame::next_input() {
+  const float *prev = input_frames[input_idx].get();
+  input_idx ^= 1;
+  float *input = input_frames[input_idx].get();
+  std::memcpy(&input[0], &prev[MODEL_FRAME_SIZE], sizeof(float) * MODEL_FRAME_SIZE);
+  return input;
+}
+
 ModelFrame::~ModelFrame() {
+  if (use_cpu()) return;
+
   transform_destroy(&transform);
   loadyuv_destroy(&loadyuv);
   CL_CHECK(clReleaseMemObject(net_input_cl));
@@ -52,15 +89,67 @@ ModelFrame::~ModelFrame() {
   CL_CHECK(clReleaseCommandQueue(q));
 }
 
+// expf of cephes: e^x = 2^n * e^r with |r| <= ln(2)/2, within 1 ulp of exp (1.02 when the
+// multiply-adds are fused, as on arm64). x is clamped with bitwise selects to where e^x is a
+// normal float, NaN passes through
+static inline f32x8 exp8(f32x8 x) {
+  constexpr float m = 88.3762626647949f;
+  const f32x8 lo = {-m, -m, -m, -m, -m, -m, -m, -m}, hi = {m, m, m, m, m, m, m, m};
+  const f32x8 in = x;
+  x = simd::select(x < hi, x, hi);
+  x = simd::select(x > lo, x, lo);
+
+  // n = floor(x / ln(2) + 0.5)
+  const f32x8 t = x * 1.44269504088896341f + 0.5f;
+  f32x8 n = __builtin_convertvector(__builtin_convertvector(t, i32x8), f32x8);
+  n += __builtin_convertvector(n > t, f32x8);
+  // r = x - n * ln(2), with ln(2) in two parts
+  x -= n * 0.693359375f;
+  x -= n * -2.12194440e-4f;
+
+  f32x8 y = x * 1.9875691500e-4f + 1.3981999507e-3f;
+  y = y * x + 8.3334519073e-3f;
+  y = y * x + 4.1665795894e-2f;
+  y = y * x + 1.6666665459e-1f;
+  y = y * x + 5.0000001201e-1f;
+  y = y * x * x + x + 1.0f;
+
+  // 2^n as the exponent bits of a float
+  const i32x8 pow2n = (__builtin_convertvector(n, i32x8) + 127) << 23;
+  y *= (f32x8)pow2n;
+  return simd::select(in != in, in, y);
+}
+
+template <typename F>
+static inline void map8(const float* input, float* output, size_t len, F fn) {
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    simd::store(&output[i], fn(simd::load<f32x8>(&input[i])));
+  }
+  if (i < len) {
+    f32x8 v = {};
+    memcpy(&v, &input[i], (len - i) * sizeof(float));
+    v = fn(v);
+    memcpy(&output[i], &v, (len - i) * sizeof(float));
+  }
+}
+
+void exp_n(const float* input, float* output, size_t len) {
+  map8(input, output, len, [](f32x8 v) { return exp8(v); });
+}
+
+void sigmoid_n(const float* input, float* output, size_t len) {
+  map8(input, output, len, [](f32x8 v) { return 1.0f / (1.0f + exp8(-v)); });
+}
+
 void softmax(const float* input, float* output, size_t len) {
   const float max_val = *std::max_element(input, input + len);
+  map8(input, output, len, [=](f32x8 v) { return exp8(v - max_val); });
+
   float denominator = 0;
   for(int i = 0; i < len; i++) {
-    float const v_exp = expf(input[i] - max_val);
-    denominator += v_exp;
-    output[i] = v_exp;
+    denominator += output[i];
   }
-
   const float inv_denominator = 1. / denominator;
   for(int i = 0; i < len; i++) {
     output[i] *= inv_denominator;
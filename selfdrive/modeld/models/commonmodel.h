@@ -15,18 +15,34 @@
 #include "selfdrive/common/mat.h"
 #include "selfdrive/modeld/transforms/loadyuv.h"
 #include "selfdrive/modeld/transforms/transform.h"
+#include "selfdrive/modeld/transforms/transform_cpu.h"
 
 const bool send_raw_pred = getenv("SEND_RAW_PRED") != NULL;
 
 void softmax(const float* input, float* output, size_t len);
 float softplus(float input);
 float sigmoid(float input);
+// exp and sigmoid of len contiguous floats, eight at a time. input and output may be the same
+void exp_n(const float* input, float* output, size_t len);
+void sigmoid_n(const float* input, float* output, size_t len);
+
+// the steps of the last ModelFrame::prepare in ms. the OpenCL kernels are only queued by warp and
+// load and run on the device until the read back, so with a GPU their time is part of finish
+struct PrepareTimes {
+  double warp = 0, load = 0, finish = 0;
+};
 
 class ModelFrame {
 public:
+  // without an OpenCL device (device_id is nullptr) frames are prepared on the CPU
   ModelFrame(cl_device_id device_id, cl_context context);
   ~ModelFrame();
+  // the returned input stays valid until the next but one prepare, so a frame can be prepared
+  // while the runner still reads the previous one
   float* prepare(cl_mem yuv_cl, int width, int height, const mat3& transform, cl_mem *output);
+  float* prepare(const uint8_t *yuv, int width, int height, const mat3& transform);
+  bool use_cpu() const { return transform_cpu != nullptr; }
+  const PrepareTimes &prepare_times() const { return times; }
 
   const int MODEL_WIDTH = 512;
   const int MODEL_HEIGHT = 256;
@@ -34,9 +50,15 @@ public:
   const int buf_size = MODEL_FRAME_SIZE * 2;
 
 private:
+  float *next_input();
+
   Transform transform;
   LoadYUVState loadyuv;
   cl_command_queue q;
   cl_mem y_cl, u_cl, v_cl, net_input_cl;
-  std::unique_ptr<float[]> input_frames;
+  // two inputs used in turn, each the previous frame followed by the new one
+  std::unique_ptr<float[]> input_frames[2];
+  int input_idx = 0;
+  std::unique_ptr<TransformCpu> transform_cpu;
+  PrepareTimes times;
 };
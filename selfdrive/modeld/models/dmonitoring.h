@@ -1,11 +1,13 @@
 #pragma once
 
+#include <memory>
 #include <vector>
 
 #include "cereal/messaging/messaging.h"
 #include "selfdrive/common/util.h"
 #include "selfdrive/modeld/models/commonmodel.h"
 #include "selfdrive/modeld/runners/run.h"
+#include "selfdrive/modeld/transforms/crop_resize_cpu.h"
 
 #define OUTPUT_SIZE 39
 
@@ -28,15 +30,18 @@ typedef struct DMonitoringResult {
   float dsp_execution_time;
 } DMonitoringResult;
 
+// the steps of the last dmonitoring_eval_frame in ms
+struct DMonitoringTimes {
+  double prepare, execute, decode;
+};
+
 typedef struct DMonitoringModelState {
   RunModel *m;
   bool is_rhd;
   float output[OUTPUT_SIZE];
-  std::vector<uint8_t> resized_buf;
-  std::vector<uint8_t> cropped_buf;
-  std::vector<uint8_t> premirror_cropped_buf;
+  std::unique_ptr<CropResizeCpu> crop_resize;
   std::vector<float> net_input_buf;
-  float tensor[UINT8_MAX + 1];
+  DMonitoringTimes times;
 } DMonitoringModelState;
 
 void dmonitoring_init(DMonitoringModelState* s);
@@ -3,10 +3,13 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 
+#include <capnp/serialize.h>
 #include <eigen3/Eigen/Dense>
+#include <kj/io.h>
 
 #include "selfdrive/common/clutil.h"
 #include "selfdrive/common/params.h"
@@ -16,9 +19,6 @@ constexpr float FCW_THRESHOLD_5MS2_HIGH = 0.15;
 constexpr float FCW_THRESHOLD_5MS2_LOW = 0.05;
 constexpr float FCW_THRESHOLD_3MS2 = 0.7;
 
-std::array<float, 5> prev_brake_5ms2_probs = {0,0,0,0,0};
-std::array<float, 3> prev_brake_3ms2_probs = {0,0,0};
-
 // #define DUMP_YUV
 
 template<class T, size_t size>
@@ -26,17 +26,33 @@ constexpr const kj::ArrayPtr<const T> to_kj_array_ptr(const std::array<T, size>
   return kj::ArrayPtr(arr.data(), arr.size());
 }
 
-void model_init(ModelState* s, cl_device_id device_id, cl_context context) {
-  s->frame = new ModelFrame(device_id, context);
+MessageArena::MessageArena(size_t words) : segment(kj::heapArray<capnp::word>(words)) {
+  // capnp wants a first segment of zeros
+  std::memset(segment.begin(), 0, segment.size() * sizeof(capnp::word));
+}
 
-#ifdef USE_THNEED
-  s->m = std::make_unique<ThneedModel>("../../models/supercombo.thneed", &s->output[0], NET_OUTPUT_SIZE, USE_GPU_RUNTIME);
-#elif USE_ONNX_MODEL
-  s->m = std::make_unique<ONNXModel>("../../models/supercombo.onnx", &s->output[0], NET_OUTPUT_SIZE, USE_GPU_RUNTIME);
-#else
-  s->m = std::make_unique<SNPEModel>("../../models/supercombo.dlc", &s->output[0], NET_OUTPUT_SIZE, USE_GPU_RUNTIME);
-#endif
+cereal::Event::Builder MessageArena::initEvent(bool valid) {
+  // the builder of the previous message zeros the part of the segment it used
+  msg.reset();
+  msg.emplace(segment.asPtr());
+  auto event = msg->initRoot<cereal::Event>();
+  event.setLogMonoTime(nanos_since_boot());
+  event.setValid(valid);
+  return event;
+}
 
+kj::ArrayPtr<capnp::byte> MessageArena::toBytes() {
+  const size_t size = capnp::computeSerializedSizeInWords(*msg) * sizeof(capnp::word);
+  if (bytes.size() < size) {
+    bytes.resize(size);
+  }
+  kj::ArrayOutputStream stream(kj::arrayPtr(bytes.data(), size));
+  capnp::writeMessage(stream, *msg);
+  return kj::arrayPtr(bytes.data(), size);
+}
+
+// the inputs besides the frame the runner reads on each execute
+static void model_init_inputs(ModelState* s) {
 #ifdef TEMPORAL
   s->m->addRecurrent(&s->output[OUTPUT_SIZE], TEMPORAL_SIZE);
 #endif
@@ -52,63 +68,144 @@ void model_init(ModelState* s, cl_device_id device_id, cl_context context) {
 #endif
 }
 
-ModelOutput* model_eval_frame(ModelState* s, cl_mem yuv_cl, int width, int height,
-                           const mat3 &transform, float *desire_in) {
+void model_init(ModelState* s, cl_device_id device_id, cl_context context) {
+  s->frame = new ModelFrame(device_id, context);
+
+#ifdef USE_THNEED
+  s->m = std::make_unique<ThneedModel>("../../models/supercombo.thneed", &s->output[0], NET_OUTPUT_SIZE, USE_GPU_RUNTIME);
+#elif USE_ONNXRUNTIME
+  s->m = std::make_unique<ONNXRuntimeModel>("../../models/supercombo.onnx", &s->output[0], NET_OUTPUT_SIZE, USE_GPU_RUNTIME);
+#elif USE_ONNX_MODEL
+  s->m = std::make_unique<ONNXModel>("../../models/supercombo.onnx", &s->output[0], NET_OUTPUT_SIZE, USE_GPU_RUNTIME);
+#else
+  s->m = std::make_unique<SNPEModel>("../../models/supercombo.dlc", &s->output[0], NET_OUTPUT_SIZE, USE_GPU_RUNTIME);
+#endif
+  model_init_inputs(s);
+}
+
+void model_init(ModelState* s, cl_device_id device_id, cl_context context, std::unique_ptr<RunModel> m) {
+  s->frame = new ModelFrame(device_id, context);
+  s->m = std::move(m);
+  model_init_inputs(s);
+}
+
+ModelInput model_prepare_frame(ModelState* s, VisionBuf *buf, const mat3 &transform, float *desire_in) {
+  ModelInput input = {};
 #ifdef DESIRE
   if (desire_in != NULL) {
     for (int i = 1; i < DESIRE_LEN; i++) {
       // Model decides when action is completed
       // so desire input is just a pulse triggered on rising edge
       if (desire_in[i] - s->prev_desire[i] > .99) {
-        s->pulse_desire[i] = desire_in[i];
+        s->next_pulse_desire[i] = desire_in[i];
       } else {
-        s->pulse_desire[i] = 0.0;
+        s->next_pulse_desire[i] = 0.0;
       }
       s->prev_desire[i] = desire_in[i];
     }
   }
+  std::copy_n(s->next_pulse_desire, DESIRE_LEN, input.pulse_desire);
 #endif
 
-  // if getInputBuf is not NULL, net_input_buf will be
-  auto net_input_buf = s->frame->prepare(yuv_cl, width, height, transform, static_cast<cl_mem*>(s->m->getInputBuf()));
-  s->m->execute(net_input_buf, s->frame->buf_size);
+  if (s->frame->use_cpu()) {
+    input.net_input_buf = s->frame->prepare((const uint8_t *)buf->addr, buf->width, buf->height, transform);
+  } else {
+    // if getInputBuf is not NULL, net_input_buf will be
+    input.net_input_buf = s->frame->prepare(buf->buf_cl, buf->width, buf->height, transform, static_cast<cl_mem*>(s->m->getInputBuf()));
+  }
+  input.prepare_times = s->frame->prepare_times();
+  return input;
+}
+
+ModelOutput* model_execute(ModelState* s, const ModelInput &input) {
+#ifdef DESIRE
+  std::copy_n(input.pulse_desire, DESIRE_LEN, s->pulse_desire);
+#endif
+  s->m->execute(input.net_input_buf, s->frame->buf_size);
 
   return (ModelOutput*)&s->output;
 }
 
+ModelOutput* model_eval_frame(ModelState* s, VisionBuf *buf, const mat3 &transform, float *desire_in) {
+  return model_execute(s, model_prepare_frame(s, buf, transform, desire_in));
+}
+
+bool model_overlaps_frames(ModelState* s) {
+  // a runner with its own input buffer reads the frame from where the next one is prepared
+  return s->frame->use_cpu() || s->m->getInputBuf() == nullptr;
+}
+
 void model_free(ModelState* s) {
   delete s->frame;
 }
 
+mat3 update_calibration(cereal::LiveCalibrationData::Reader live_calib, bool wide_camera) {
+  /*
+     import numpy as np
+     from common.transformations.model import medmodel_frame_from_road_frame
+     medmodel_frame_from_ground = medmodel_frame_from_road_frame[:, (0, 1, 3)]
+     ground_from_medmodel_frame = np.linalg.inv(medmodel_frame_from_ground)
+  */
+  static const auto ground_from_medmodel_frame = (Eigen::Matrix<float, 3, 3>() << 
+    0.00000000e+00, 0.00000000e+00, 1.00000000e+00,
+    -1.09890110e-03, 0.00000000e+00, 2.81318681e-01,
+    -1.84808520e-20, 9.00738606e-04, -4.28751576e-02).finished();
+
+  static const auto fcam_intrinsics = Eigen::Matrix<float, 3, 3, Eigen::RowMajor>(fcam_intrinsic_matrix.v);
+  static const auto ecam_intrinsics = Eigen::Matrix<float, 3, 3, Eigen::RowMajor>(ecam_intrinsic_matrix.v);
+  static const mat3 yuv_transform = get_model_yuv_transform();
+  const auto &cam_intrinsics = wide_camera ? ecam_intrinsics : fcam_intrinsics;
+
+  auto extrinsic_matrix = live_calib.getExtrinsicMatrix();
+  Eigen::Matrix<float, 3, 4> extrinsic_matrix_eigen;
+  for (int i = 0; i < 4*3; i++) {
+    extrinsic_matrix_eigen(i / 4, i % 4) = extrinsic_matrix[i];
+  }
+
+  auto camera_frame_from_road_frame = cam_intrinsics * extrinsic_matrix_eigen;
+  Eigen::Matrix<float, 3, 3> camera_frame_from_ground;
+  camera_frame_from_ground.col(0) = camera_frame_from_road_frame.col(0);
+  camera_frame_from_ground.col(1) = camera_frame_from_road_frame.col(1);
+  camera_frame_from_ground.col(2) = camera_frame_from_road_frame.col(3);
+
+  auto warp_matrix = camera_frame_from_ground * ground_from_medmodel_frame;
+  mat3 transform = {};
+  for (int i=0; i<3*3; i++) {
+    transform.v[i] = warp_matrix(i / 3, i % 3);
+  }
+  return matmul3(yuv_transform, transform);
+}
+
+// a list of values `stride` floats apart
+static void set_list(capnp::List<float>::Builder list, const float *src, int stride = 1) {
+  for (int i = 0; i < list.size(); i++) {
+    list.set(i, src[i * stride]);
+  }
+}
+
 void fill_lead(cereal::ModelDataV2::LeadDataV3::Builder lead, const ModelOutputLeads &leads, int t_idx, float prob_t) {
-  std::array<float, LEAD_TRAJ_LEN> lead_t = {0.0, 2.0, 4.0, 6.0, 8.0, 10.0};
+  static constexpr std::array<float, LEAD_TRAJ_LEN> lead_t = {0.0, 2.0, 4.0, 6.0, 8.0, 10.0};
+  constexpr int stride = sizeof(ModelOutputLeadElement) / sizeof(float);
   const auto &best_prediction = leads.get_best_prediction(t_idx);
+  // the stds are one block of the output
+  std::array<float, LEAD_TRAJ_LEN * stride> stds;
+  exp_n(&best_prediction.std[0].x, stds.data(), stds.size());
+
   lead.setProb(sigmoid(leads.prob[t_idx]));
   lead.setProbTime(prob_t);
-  std::array<float, LEAD_TRAJ_LEN> lead_x, lead_y, lead_v, lead_a;
-  std::array<float, LEAD_TRAJ_LEN> lead_x_std, lead_y_std, lead_v_std, lead_a_std;
-  for (int i=0; i<LEAD_TRAJ_LEN; i++) {
-    lead_x[i] = best_prediction.mean[i].x;
-    lead_y[i] = best_prediction.mean[i].y;
-    lead_v[i] = best_prediction.mean[i].velocity;
-    lead_a[i] = best_prediction.mean[i].acceleration;
-    lead_x_std[i] = exp(best_prediction.std[i].x);
-    lead_y_std[i] = exp(best_prediction.std[i].y);
-    lead_v_std[i] = exp(best_prediction.std[i].velocity);
-    lead_a_std[i] = exp(best_prediction.std[i].acceleration);
-  }
+  const float *mean = &best_prediction.mean[0].x;
   lead.setT(to_kj_array_ptr(lead_t));
-  lead.setX(to_kj_array_ptr(lead_x));
-  lead.setY(to_kj_array_ptr(lead_y));
-  lead.setV(to_kj_array_ptr(lead_v));
-  lead.setA(to_kj_array_ptr(lead_a));
-  lead.setXStd(to_kj_array_ptr(lead_x_std));
-  lead.setYStd(to_kj_array_ptr(lead_y_std));
-  lead.setVStd(to_kj_array_ptr(lead_v_std));
-  lead.setAStd(to_kj_array_ptr(lead_a_std));
+  set_list(lead.initX(LEAD_TRAJ_LEN), &mean[0], stride);
+  set_list(lead.initY(LEAD_TRAJ_LEN), &mean[1], stride);
+  set_list(lead.initV(LEAD_TRAJ_LEN), &mean[2], stride);
+  set_list(lead.initA(LEAD_TRAJ_LEN), &mean[3], stride);
+  set_list(lead.initXStd(LEAD_TRAJ_LEN), &stds[0], stride);
+  set_list(lead.initYStd(LEAD_TRAJ_LEN), &stds[1], stride);
+  set_list(lead.initVStd(LEAD_TRAJ_LEN), &stds[2], stride);
+  set_list(lead.initAStd(LEAD_TRAJ_LEN), &stds[3], stride);
 }
 
-void fill_meta(cereal::ModelDataV2::MetaData::Builder meta, const ModelOutputMeta &meta_data) {
+void fill_meta(cereal::ModelDataV2::MetaData::Builder meta, const ModelOutputMeta &meta_data, PublishState &ps) {
   std::array<float, DESIRE_LEN> desire_state_softmax;
   softmax(meta_data.desire_state_prob.array.data(), desire_state_softmax.data(), DESIRE_LEN);
 
@@ -117,41 +214,36 @@ void fill_meta(cereal::ModelDataV2::MetaData::Builder meta, const ModelOutputMet
     softmax(meta_data.desire_pred_prob[i].array.data(), desire_pred_softmax.data() + (i * DESIRE_LEN), DESIRE_LEN);
   }
 
-  std::array<float, DISENGAGE_LEN> lat_long_t = {2,4,6,8,10};
-  std::array<float, DISENGAGE_LEN> gas_disengage_sigmoid, brake_disengage_sigmoid, steer_override_sigmoid,
-                                   brake_3ms2_sigmoid, brake_4ms2_sigmoid, brake_5ms2_sigmoid;
-  for (int i=0; i<DISENGAGE_LEN; i++) {
-    gas_disengage_sigmoid[i] = sigmoid(meta_data.disengage_prob[i].gas_disengage);
-    brake_disengage_sigmoid[i] = sigmoid(meta_data.disengage_prob[i].brake_disengage);
-    steer_override_sigmoid[i] = sigmoid(meta_data.disengage_prob[i].steer_override);
-    brake_3ms2_sigmoid[i] = sigmoid(meta_data.disengage_prob[i].brake_3ms2);
-    brake_4ms2_sigmoid[i] = sigmoid(meta_data.disengage_prob[i].brake_4ms2);
-    brake_5ms2_sigmoid[i] = sigmoid(meta_data.disengage_prob[i].brake_5ms2);
-    //gas_pressed_sigmoid[i] = sigmoid(meta_data.disengage_prob[i].gas_pressed);
-  }
+  // all disengage probabilities in one go, in the layout of the output
+  static constexpr std::array<float, DISENGAGE_LEN> lat_long_t = {2,4,6,8,10};
+  constexpr int stride = sizeof(ModelOutputDisengageProb) / sizeof(float);
+  std::array<ModelOutputDisengageProb, DISENGAGE_LEN> disengage_sigmoid;
+  sigmoid_n(&meta_data.disengage_prob[0].gas_disengage, &disengage_sigmoid[0].gas_disengage, DISENGAGE_LEN * stride);
 
-  std::memmove(prev_brake_5ms2_probs.data(), &prev_brake_5ms2_probs[1], 4*sizeof(float));
-  std::memmove(prev_brake_3ms2_probs.data(), &prev_brake_3ms2_probs[1], 2*sizeof(float));
-  prev_brake_5ms2_probs[4] = brake_5ms2_sigmoid[0];
-  prev_brake_3ms2_probs[2] = brake_3ms2_sigmoid[0];
+  const uint32_t frame = ps.frames++;
+  ps.prev_brake_5ms2_probs[frame % ps.prev_brake_5ms2_probs.size()] = disengage_sigmoid[0].brake_5ms2;
+  ps.prev_brake_3ms2_probs[frame % ps.prev_brake_3ms2_probs.size()] = disengage_sigmoid[0].brake_3ms2;
 
+  // oldest first
   bool above_fcw_threshold = true;
-  for (int i=0; i<prev_brake_5ms2_probs.size(); i++) {
+  for (int i=0; i<ps.prev_brake_5ms2_probs.size(); i++) {
     float threshold = i < 2 ? FCW_THRESHOLD_5MS2_LOW : FCW_THRESHOLD_5MS2_HIGH;
-    above_fcw_threshold = above_fcw_threshold && prev_brake_5ms2_probs[i] > threshold;
+    float prob = ps.prev_brake_5ms2_probs[(frame + 1 + i) % ps.prev_brake_5ms2_probs.size()];
+    above_fcw_threshold = above_fcw_threshold && prob > threshold;
   }
-  for (int i=0; i<prev_brake_3ms2_probs.size(); i++) {
-    above_fcw_threshold = above_fcw_threshold && prev_brake_3ms2_probs[i] > FCW_THRESHOLD_3MS2;
+  for (int i=0; i<ps.prev_brake_3ms2_probs.size(); i++) {
+    float prob = ps.prev_brake_3ms2_probs[(frame + 1 + i) % ps.prev_brake_3ms2_probs.size()];
+    above_fcw_threshold = above_fcw_threshold && prob > FCW_THRESHOLD_3MS2;
   }
 
   auto disengage = meta.initDisengagePredictions();
   disengage.setT(to_kj_array_ptr(lat_long_t));
-  disengage.setGasDisengageProbs(to_kj_array_ptr(gas_disengage_sigmoid));
-  disengage.setBrakeDisengageProbs(to_kj_array_ptr(brake_disengage_sigmoid));
-  disengage.setSteerOverrideProbs(to_kj_array_ptr(steer_override_sigmoid));
-  disengage.setBrake3MetersPerSecondSquaredProbs(to_kj_array_ptr(brake_3ms2_sigmoid));
-  disengage.setBrake4MetersPerSecondSquaredProbs(to_kj_array_ptr(brake_4ms2_sigmoid));
-  disengage.setBrake5MetersPerSecondSquaredProbs(to_kj_array_ptr(brake_5ms2_sigmoid));
+  set_list(disengage.initGasDisengageProbs(DISENGAGE_LEN), &disengage_sigmoid[0].gas_disengage, stride);
+  set_list(disengage.initBrakeDisengageProbs(DISENGAGE_LEN), &disengage_sigmoid[0].brake_disengage, stride);
+  set_list(disengage.initSteerOverrideProbs(DISENGAGE_LEN), &disengage_sigmoid[0].steer_override, stride);
+  set_list(disengage.initBrake3MetersPerSecondSquaredProbs(DISENGAGE_LEN), &disengage_sigmoid[0].brake_3ms2, stride);
+  set_list(disengage.initBrake4MetersPerSecondSquaredProbs(DISENGAGE_LEN), &disengage_sigmoid[0].brake_4ms2, stride);
+  set_list(disengage.initBrake5MetersPerSecondSquaredProbs(DISENGAGE_LEN), &disengage_sigmoid[0].brake_5ms2, stride);
 
   meta.setEngagedProb(sigmoid(meta_data.engaged_prob));
   meta.setDesirePrediction(to_kj_array_ptr(desire_pred_softmax));
@@ -159,116 +251,83 @@ void fill_meta(cereal::ModelDataV2::MetaData::Builder meta, const ModelOutputMet
   meta.setHardBrakePredicted(above_fcw_threshold);
 }
 
-template<size_t size>
-void fill_xyzt(cereal::ModelDataV2::XYZTData::Builder xyzt, const std::array<float, size> &t,
-               const std::array<float, size> &x, const std::array<float, size> &y, const std::array<float, size> &z) {
-  xyzt.setT(to_kj_array_ptr(t));
-  xyzt.setX(to_kj_array_ptr(x));
-  xyzt.setY(to_kj_array_ptr(y));
-  xyzt.setZ(to_kj_array_ptr(z));
+// TRAJECTORY_SIZE points, each `stride` floats after the previous one
+void fill_xyzt(cereal::ModelDataV2::XYZTData::Builder xyzt, const float *t, const ModelOutputXYZ *xyz, int stride) {
+  set_list(xyzt.initT(TRAJECTORY_SIZE), t);
+  set_list(xyzt.initX(TRAJECTORY_SIZE), &xyz->x, stride);
+  set_list(xyzt.initY(TRAJECTORY_SIZE), &xyz->y, stride);
+  set_list(xyzt.initZ(TRAJECTORY_SIZE), &xyz->z, stride);
 }
 
-template<size_t size>
-void fill_xyzt(cereal::ModelDataV2::XYZTData::Builder xyzt, const std::array<float, size> &t,
-               const std::array<float, size> &x, const std::array<float, size> &y, const std::array<float, size> &z,
-               const std::array<float, size> &x_std, const std::array<float, size> &y_std, const std::array<float, size> &z_std) {
-  fill_xyzt(xyzt, t, x, y, z);
-  xyzt.setXStd(to_kj_array_ptr(x_std));
-  xyzt.setYStd(to_kj_array_ptr(y_std));
-  xyzt.setZStd(to_kj_array_ptr(z_std));
+void fill_xyzt(cereal::ModelDataV2::XYZTData::Builder xyzt, const float *t, const float *x, const ModelOutputYZ *yz) {
+  constexpr int stride = sizeof(ModelOutputYZ) / sizeof(float);
+  set_list(xyzt.initT(TRAJECTORY_SIZE), t);
+  set_list(xyzt.initX(TRAJECTORY_SIZE), x);
+  set_list(xyzt.initY(TRAJECTORY_SIZE), &yz->y, stride);
+  set_list(xyzt.initZ(TRAJECTORY_SIZE), &yz->z, stride);
 }
 
 void fill_plan(cereal::ModelDataV2::Builder &framed, const ModelOutputPlanPrediction &plan) {
-  std::array<float, TRAJECTORY_SIZE> pos_x, pos_y, pos_z;
-  std::array<float, TRAJECTORY_SIZE> pos_x_std, pos_y_std, pos_z_std;
-  std::array<float, TRAJECTORY_SIZE> vel_x, vel_y, vel_z;
-  std::array<float, TRAJECTORY_SIZE> rot_x, rot_y, rot_z;
-  std::array<float, TRAJECTORY_SIZE> rot_rate_x, rot_rate_y, rot_rate_z;
-
-  for(int i=0; i<TRAJECTORY_SIZE; i++) {
-    pos_x[i] = plan.mean[i].position.x;
-    pos_y[i] = plan.mean[i].position.y;
-    pos_z[i] = plan.mean[i].position.z;
-    pos_x_std[i] = exp(plan.std[i].position.x);
-    pos_y_std[i] = exp(plan.std[i].position.y);
-    pos_z_std[i] = exp(plan.std[i].position.z);
-    vel_x[i] = plan.mean[i].velocity.x;
-    vel_y[i] = plan.mean[i].velocity.y;
-    vel_z[i] = plan.mean[i].velocity.z;
-    rot_x[i] = plan.mean[i].rotation.x;
-    rot_y[i] = plan.mean[i].rotation.y;
-    rot_z[i] = plan.mean[i].rotation.z;
-    rot_rate_x[i] = plan.mean[i].rotation_rate.x;
-    rot_rate_y[i] = plan.mean[i].rotation_rate.y;
-    rot_rate_z[i] = plan.mean[i].rotation_rate.z;
+  constexpr int stride = sizeof(ModelOutputPlanElement) / sizeof(float);
+  // the position stds gathered for one exp over them
+  std::array<ModelOutputXYZ, TRAJECTORY_SIZE> pos_std;
+  for (int i=0; i<TRAJECTORY_SIZE; i++) {
+    pos_std[i] = plan.std[i].position;
   }
-
-  fill_xyzt(framed.initPosition(), T_IDXS_FLOAT, pos_x, pos_y, pos_z, pos_x_std, pos_y_std, pos_z_std);
-  fill_xyzt(framed.initVelocity(), T_IDXS_FLOAT, vel_x, vel_y, vel_z);
-  fill_xyzt(framed.initOrientation(), T_IDXS_FLOAT, rot_x, rot_y, rot_z);
-  fill_xyzt(framed.initOrientationRate(), T_IDXS_FLOAT, rot_rate_x, rot_rate_y, rot_rate_z);
+  exp_n(&pos_std[0].x, &pos_std[0].x, TRAJECTORY_SIZE * 3);
+
+  auto position = framed.initPosition();
+  fill_xyzt(position, T_IDXS_FLOAT.data(), &plan.mean[0].position, stride);
+  set_list(position.initXStd(TRAJECTORY_SIZE), &pos_std[0].x, 3);
+  set_list(position.initYStd(TRAJECTORY_SIZE), &pos_std[0].y, 3);
+  set_list(position.initZStd(TRAJECTORY_SIZE), &pos_std[0].z, 3);
+  fill_xyzt(framed.initVelocity(), T_IDXS_FLOAT.data(), &plan.mean[0].velocity, stride);
+  fill_xyzt(framed.initOrientation(), T_IDXS_FLOAT.data(), &plan.mean[0].rotation, stride);
+  fill_xyzt(framed.initOrientationRate(), T_IDXS_FLOAT.data(), &plan.mean[0].rotation_rate, stride);
 }
 
 void fill_lane_lines(cereal::ModelDataV2::Builder &framed, const std::array<float, TRAJECTORY_SIZE> &plan_t,
                      const ModelOutputLaneLines &lanes) {
-  std::array<float, TRAJECTORY_SIZE> left_far_y, left_far_z;
-  std::array<float, TRAJECTORY_SIZE> left_near_y, left_near_z;
-  std::array<float, TRAJECTORY_SIZE> right_near_y, right_near_z;
-  std::array<float, TRAJECTORY_SIZE> right_far_y, right_far_z;
-  for (int j=0; j<TRAJECTORY_SIZE; j++) {
-    left_far_y[j] = lanes.mean.left_far[j].y;
-    left_far_z[j] = lanes.mean.left_far[j].z;
-    left_near_y[j] = lanes.mean.left_near[j].y;
-    left_near_z[j] = lanes.mean.left_near[j].z;
-    right_near_y[j] = lanes.mean.right_near[j].y;
-    right_near_z[j] = lanes.mean.right_near[j].z;
-    right_far_y[j] = lanes.mean.right_far[j].y;
-    right_far_z[j] = lanes.mean.right_far[j].z;
-  }
-
   auto lane_lines = framed.initLaneLines(4);
-  fill_xyzt(lane_lines[0], plan_t, X_IDXS_FLOAT, left_far_y, left_far_z);
-  fill_xyzt(lane_lines[1], plan_t, X_IDXS_FLOAT, left_near_y, left_near_z);
-  fill_xyzt(lane_lines[2], plan_t, X_IDXS_FLOAT, right_near_y, right_near_z);
-  fill_xyzt(lane_lines[3], plan_t, X_IDXS_FLOAT, right_far_y, right_far_z);
-
-  framed.setLaneLineStds({
-    exp(lanes.std.left_far[0].y),
-    exp(lanes.std.left_near[0].y),
-    exp(lanes.std.right_near[0].y),
-    exp(lanes.std.right_far[0].y),
-  });
-
-  framed.setLaneLineProbs({
-    sigmoid(lanes.prob.left_far.val),
-    sigmoid(lanes.prob.left_near.val),
-    sigmoid(lanes.prob.right_near.val),
-    sigmoid(lanes.prob.right_far.val),
-  });
+  fill_xyzt(lane_lines[0], plan_t.data(), X_IDXS_FLOAT.data(), lanes.mean.left_far.data());
+  fill_xyzt(lane_lines[1], plan_t.data(), X_IDXS_FLOAT.data(), lanes.mean.left_near.data());
+  fill_xyzt(lane_lines[2], plan_t.data(), X_IDXS_FLOAT.data(), lanes.mean.right_near.data());
+  fill_xyzt(lane_lines[3], plan_t.data(), X_IDXS_FLOAT.data(), lanes.mean.right_far.data());
+
+  std::array<float, 4> stds = {
+    lanes.std.left_far[0].y,
+    lanes.std.left_near[0].y,
+    lanes.std.right_near[0].y,
+    lanes.std.right_far[0].y,
+  };
+  exp_n(stds.data(), stds.data(), stds.size());
+  framed.setLaneLineStds(to_kj_array_ptr(stds));
+
+  std::array<float, 4> probs = {
+    lanes.prob.left_far.val,
+    lanes.prob.left_near.val,
+    lanes.prob.right_near.val,
+    lanes.prob.right_far.val,
+  };
+  sigmoid_n(probs.data(), probs.data(), probs.size());
+  framed.setLaneLineProbs(to_kj_array_ptr(probs));
 }
 
 void fill_road_edges(cereal::ModelDataV2::Builder &framed, const std::array<float, TRAJECTORY_SIZE> &plan_t,
                      const ModelOutputRoadEdges &edges) {
-  std::array<float, TRAJECTORY_SIZE> left_y, left_z;
-  std::array<float, TRAJECTORY_SIZE> right_y, right_z;
-  for (int j=0; j<TRAJECTORY_SIZE; j++) {
-    left_y[j] = edges.mean.left[j].y;
-    left_z[j] = edges.mean.left[j].z;
-    right_y[j] = edges.mean.right[j].y;
-    right_z[j] = edges.mean.right[j].z;
-  }
-
   auto road_edges = framed.initRoadEdges(2);
-  fill_xyzt(road_edges[0], plan_t, X_IDXS_FLOAT, left_y, left_z);
-  fill_xyzt(road_edges[1], plan_t, X_IDXS_FLOAT, right_y, right_z);
-
-  framed.setRoadEdgeStds({
-    exp(edges.std.left[0].y),
-    exp(edges.std.right[0].y),
-  });
+  fill_xyzt(road_edges[0], plan_t.data(), X_IDXS_FLOAT.data(), edges.mean.left.data());
+  fill_xyzt(road_edges[1], plan_t.data(), X_IDXS_FLOAT.data(), edges.mean.right.data());
+
+  std::array<float, 2> stds = {
+    edges.std.left[0].y,
+    edges.std.right[0].y,
+  };
+  exp_n(stds.data(), stds.data(), stds.size());
+  framed.setRoadEdgeStds(to_kj_array_ptr(stds));
 }
 
-void fill_model(cereal::ModelDataV2::Builder &framed, const ModelOutput &net_outputs) {
+void fill_model(cereal::ModelDataV2::Builder &framed, const ModelOutput &net_outputs, PublishState &ps) {
   const auto &best_plan = net_outputs.plans.get_best_prediction();
   std::array<float, TRAJECTORY_SIZE> plan_t;
   std::fill_n(plan_t.data(), plan_t.size(), NAN);
@@ -296,7 +355,7 @@ void fill_model(cereal::ModelDataV2::Builder &framed, const ModelOutput &net_out
   fill_road_edges(framed, plan_t, net_outputs.road_edges);
 
   // meta
-  fill_meta(framed.initMeta(), net_outputs.meta);
+  fill_meta(framed.initMeta(), net_outputs.meta, ps);
 
   // leads
   auto leads = framed.initLeadsV3(LEAD_MHP_SELECTION);
@@ -306,12 +365,12 @@ void fill_model(cereal::ModelDataV2::Builder &framed, const ModelOutput &net_out
   }
 }
 
-void model_publish(PubMaster &pm, uint32_t vipc_frame_id, uint32_t frame_id, float frame_drop,
-                   const ModelOutput &net_outputs, uint64_t timestamp_eof,
-                   float model_execution_time, kj::ArrayPtr<const float> raw_pred, const bool valid) {
+cereal::Event::Builder fill_model_msg(PublishState &ps, uint32_t vipc_frame_id, uint32_t frame_id, float frame_drop,
+                                      const ModelOutput &net_outputs, uint64_t timestamp_eof,
+                                      float model_execution_time, kj::ArrayPtr<const float> raw_pred, const bool valid) {
   const uint32_t frame_age = (frame_id > vipc_frame_id) ? (frame_id - vipc_frame_id) : 0;
-  MessageBuilder msg;
-  auto framed = msg.initEvent(valid).initModelV2();
+  auto event = ps.msg.initEvent(valid);
+  auto framed = event.initModelV2();
   framed.setFrameId(vipc_frame_id);
   framed.setFrameAge(frame_age);
   framed.setFrameDropPerc(frame_drop * 100);
@@ -320,8 +379,16 @@ void model_publish(PubMaster &pm, uint32_t vipc_frame_id, uint32_t frame_id, flo
   if (send_raw_pred) {
     framed.setRawPredictions(raw_pred.asBytes());
   }
-  fill_model(framed, net_outputs);
-  pm.send("modelV2", msg);
+  fill_model(framed, net_outputs, ps);
+  return event;
+}
+
+void model_publish(PubMaster &pm, PublishState &ps, uint32_t vipc_frame_id, uint32_t frame_id, float frame_drop,
+                   const ModelOutput &net_outputs, uint64_t timestamp_eof,
+                   float model_execution_time, kj::ArrayPtr<const float> raw_pred, const bool valid) {
+  fill_model_msg(ps, vipc_frame_id, frame_id, frame_drop, net_outputs, timestamp_eof, model_execution_time, raw_pred, valid);
+  auto bytes = ps.msg.toBytes();
+  pm.send("modelV2", bytes.begin(), bytes.size());
 }
 
 void posenet_publish(PubMaster &pm, uint32_t vipc_frame_id, uint32_t vipc_dropped_frames,
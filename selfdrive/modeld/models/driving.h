@@ -7,8 +7,11 @@
 
 #include <array>
 #include <memory>
+#include <optional>
+#include <vector>
 
 #include "cereal/messaging/messaging.h"
+#include "cereal/visionipc/visionbuf.h"
 #include "selfdrive/common/mat.h"
 #include "selfdrive/common/modeldata.h"
 #include "selfdrive/common/util.h"
@@ -225,17 +228,65 @@ struct ModelState {
 #ifdef DESIRE
   float prev_desire[DESIRE_LEN] = {};
   float pulse_desire[DESIRE_LEN] = {};
+  float next_pulse_desire[DESIRE_LEN] = {};
 #endif
 #ifdef TRAFFIC_CONVENTION
   float traffic_convention[TRAFFIC_CONVENTION_LEN] = {};
 #endif
 };
 
+// a prepared frame waiting to be executed
+struct ModelInput {
+  float *net_input_buf;  // NULL when it was prepared into the runner's own input buffer
+#ifdef DESIRE
+  float pulse_desire[DESIRE_LEN];
+#endif
+  PrepareTimes prepare_times;
+};
+
+// Builds messages in memory reused from one to the next: a message is built in a first segment that
+// capnp zeros again when its builder is done, and serialized into a buffer that only grows. Only a
+// message larger than the first segment allocates.
+class MessageArena {
+public:
+  MessageArena(size_t words = 8192);
+  // starts a new message, the previous one is gone
+  cereal::Event::Builder initEvent(bool valid = true);
+  // the message, valid until the next initEvent
+  kj::ArrayPtr<capnp::byte> toBytes();
+
+private:
+  kj::Array<capnp::word> segment;
+  std::optional<capnp::MallocMessageBuilder> msg;
+  std::vector<capnp::byte> bytes;
+};
+
+// state carried between published messages of one model instance
+struct PublishState {
+  // the last brake probabilities for the fcw, ring buffers written at frames % size
+  std::array<float, 5> prev_brake_5ms2_probs = {};
+  std::array<float, 3> prev_brake_3ms2_probs = {};
+  uint32_t frames = 0;
+  MessageArena msg;
+};
+
 void model_init(ModelState* s, cl_device_id device_id, cl_context context);
-ModelOutput *model_eval_frame(ModelState* s, cl_mem yuv_cl, int width, int height,
-                           const mat3 &transform, float *desire_in);
+// with a runner other than the one modeld is built with, e.g. to compare runners. it writes its
+// output to s->output
+void model_init(ModelState* s, cl_device_id device_id, cl_context context, std::unique_ptr<RunModel> m);
+ModelOutput *model_eval_frame(ModelState* s, VisionBuf *buf, const mat3 &transform, float *desire_in);
+// model_eval_frame in two steps, for running them on different threads. frames go through each
+// step in order, and a frame can be prepared while the previous one executes if model_overlaps_frames
+ModelInput model_prepare_frame(ModelState* s, VisionBuf *buf, const mat3 &transform, float *desire_in);
+ModelOutput *model_execute(ModelState* s, const ModelInput &input);
+bool model_overlaps_frames(ModelState* s);
 void model_free(ModelState* s);
-void model_publish(PubMaster &pm, uint32_t vipc_frame_id, uint32_t frame_id, float frame_drop,
+mat3 update_calibration(cereal::LiveCalibrationData::Reader live_calib, bool wide_camera);
+// builds modelV2 in ps.msg
+cereal::Event::Builder fill_model_msg(PublishState &ps, uint32_t vipc_frame_id, uint32_t frame_id, float frame_drop,
+                                      const ModelOutput &net_outputs, uint64_t timestamp_eof,
+                                      float model_execution_time, kj::ArrayPtr<const float> raw_pred, const bool valid);
+void model_publish(PubMaster &pm, PublishState &ps, uint32_t vipc_frame_id, uint32_t frame_id, float frame_drop,
                    const ModelOutput &net_outputs, uint64_t timestamp_eof,
                    float model_execution_time, kj::ArrayPtr<const float> raw_pred, const bool valid);
 void posenet_publish(PubMaster &pm, uint32_t vipc_frame_id, uint32_t vipc_dropped_frames,
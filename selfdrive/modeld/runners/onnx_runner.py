@@ -1,6 +1,9 @@
 #!/usr/bin/env python3
 
+import mmap
 import os
+import select
+import struct
 import sys
 import numpy as np
 
@@ -9,33 +12,53 @@ os.environ["OMP_WAIT_POLICY"] = "PASSIVE"
 
 import onnxruntime as ort # pylint: disable=import-error
 
-def read(sz):
-  dd = []
-  gt = 0
-  while gt < sz * 4:
-    st = os.read(0, sz * 4 - gt)
-    assert(len(st) > 0)
-    dd.append(st)
-    gt += len(st)
-  return np.frombuffer(b''.join(dd), dtype=np.float32)
+# shared memory layout from onnxmodel.h, offsets and sizes are in floats
+SHM_MAGIC = 0x4f4e4e58534d454d
+HEADER = struct.Struct("<6Q")  # magic, input count, output offset, output size, recurrent offset, recurrent size
+DOORBELL = (1).to_bytes(8, sys.byteorder)
 
-def write(d):
-  os.write(1, d.tobytes())
 
-def run_loop(m):
+def map_buffers(shm_fd, ishapes):
+  shm = mmap.mmap(shm_fd, os.fstat(shm_fd).st_size)
+  magic, n_inputs, output_offset, output_size, recurrent_offset, recurrent_size = HEADER.unpack_from(shm, 0)
+  assert magic == SHM_MAGIC
+  layout = struct.unpack_from(f"<{2 * n_inputs}Q", shm, HEADER.size)
+  data = np.frombuffer(shm, dtype=np.float32)
+
+  # views into the shared memory, nothing is copied
+  inputs = [data[layout[2*i]:layout[2*i] + layout[2*i + 1]] for i in range(n_inputs)]
+  output = data[output_offset:output_offset + output_size]
+  if recurrent_size > 0:
+    # the recurrent state is the model's last input, read back from its previous output
+    inputs.append(output[recurrent_offset:recurrent_offset + recurrent_size])
+  assert len(inputs) == len(ishapes), f"model takes {len(ishapes)} inputs, got {len(inputs)}"
+  return [i.reshape(shp) for i, shp in zip(inputs, ishapes)], output
+
+
+def wait_for_request(request_fd, parent_fd):
+  # the request doorbell never hangs up, the parent pipe does when modeld exits
+  ready, _, _ = select.select([request_fd, parent_fd], [], [])
+  if parent_fd in ready:
+    sys.exit(0)
+  os.read(request_fd, 8)
+
+
+def run_loop(m, shm_fd, request_fd, response_fd, parent_fd):
   ishapes = [[1]+ii.shape[1:] for ii in m.get_inputs()]
   keys = [x.name for x in m.get_inputs()]
   print("ready to run onnx model", keys, ishapes, file=sys.stderr)
+
+  # the first request comes with the layout in place
+  wait_for_request(request_fd, parent_fd)
+  inputs, output = map_buffers(shm_fd, ishapes)
   while 1:
-    inputs = []
-    for shp in ishapes:
-      ts = np.product(shp)
-      #print("reshaping %s with offset %d" % (str(shp), offset), file=sys.stderr)
-      inputs.append(read(ts).reshape(shp))
     ret = m.run(None, dict(zip(keys, inputs)))
-    #print(ret, file=sys.stderr)
+    offset = 0
     for r in ret:
-      write(r)
+      output[offset:offset + r.size] = r.ravel()
+      offset += r.size
+    os.write(response_fd, DOORBELL)
+    wait_for_request(request_fd, parent_fd)
 
 
 if __name__ == "__main__":
@@ -57,4 +80,4 @@ if __name__ == "__main__":
   print("Onnx selected provider: ", [provider], file=sys.stderr)
   ort_session = ort.InferenceSession(sys.argv[1], options, providers=[provider])
   print("Onnx using ", ort_session.get_providers(), file=sys.stderr)
-  run_loop(ort_session)
+  run_loop(ort_session, *map(int, sys.argv[2:6]))
@@ -1,7 +1,13 @@
 #include "selfdrive/modeld/runners/onnxmodel.h"
 
+#include <fcntl.h>
 #include <poll.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 #include <cassert>
 #include <csignal>
@@ -14,74 +20,191 @@
 #include "selfdrive/common/swaglog.h"
 #include "selfdrive/common/util.h"
 
-ONNXModel::ONNXModel(const char *path, float *_output, size_t _output_size, int runtime) {
-  LOGD("loading model %s", path);
+// the first response waits for python to start and load the model
+const int STARTUP_TIMEOUT_MS = 60000;
+const int RUN_TIMEOUT_MS = 10000;
+// consecutive runner restarts before modeld gives up
+const int MAX_RESTARTS = 3;
 
-  output = _output;
-  output_size = _output_size;
+namespace {
 
-  int err = pipe(pipein);
+// all fds are made close-on-exec, so a runner only inherits those passed to it and not the fds
+// of other models in the process
+void set_cloexec(int fd, bool cloexec) {
+  int flags = fcntl(fd, F_GETFD);
+  assert(flags >= 0);
+  fcntl(fd, F_SETFD, cloexec ? flags | FD_CLOEXEC : flags & ~FD_CLOEXEC);
+}
+
+void open_pipe(int fds[2]) {
+#ifdef __linux__
+  int err = pipe2(fds, O_CLOEXEC);
   assert(err == 0);
-  err = pipe(pipeout);
+#else
+  int err = pipe(fds);
   assert(err == 0);
+  set_cloexec(fds[0], true);
+  set_cloexec(fds[1], true);
+#endif
+}
+
+void open_doorbell(int &rd, int &wr) {
+#ifdef __linux__
+  rd = wr = eventfd(0, EFD_CLOEXEC);
+  assert(rd >= 0);
+#else
+  int fds[2];
+  open_pipe(fds);
+  rd = fds[0];
+  wr = fds[1];
+#endif
+}
+
+void close_doorbell(int &rd, int &wr) {
+  if (wr != rd && wr >= 0) close(wr);
+  if (rd >= 0) close(rd);
+  rd = wr = -1;
+}
+
+}  // namespace
+
+ONNXModel::ONNXModel(const char *_path, float *_output, size_t _output_size, int runtime) : path(_path) {
+  LOGD("loading model %s", path.c_str());
+
+  output = _output;
+  output_size = _output_size;
+
+#ifdef __linux__
+  shm_fd = memfd_create("onnx_model", MFD_CLOEXEC);
+#else
+  std::string shm_name = util::string_format("/onnx_model_%d_%p", getpid(), this);
+  // close-on-exec like any shm_open fd
+  shm_fd = shm_open(shm_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  shm_unlink(shm_name.c_str());
+#endif
+  assert(shm_fd >= 0);
+
+  // the runner loads the model while modeld starts up
+  spawn();
+}
+
+ONNXModel::~ONNXModel() {
+  stop();
+  if (shm) munmap(shm, shm_size);
+  close(shm_fd);
+}
+
+void ONNXModel::spawn() {
+  open_doorbell(request.rd, request.wr);
+  open_doorbell(response.rd, response.wr);
+  int alive[2], parent_alive[2];
+  open_pipe(alive);
+  open_pipe(parent_alive);
 
   std::string exe_dir = util::dir_name(util::readlink("/proc/self/exe"));
   std::string onnx_runner = exe_dir + "/runners/onnx_runner.py";
+  std::string fds[] = {std::to_string(shm_fd), std::to_string(request.rd), std::to_string(response.wr),
+                       std::to_string(parent_alive[0])};
+  char *argv[] = {(char*)onnx_runner.c_str(), (char*)path.c_str(), (char*)fds[0].c_str(),
+                  (char*)fds[1].c_str(), (char*)fds[2].c_str(), (char*)fds[3].c_str(), nullptr};
 
   proc_pid = fork();
   if (proc_pid == 0) {
-    LOGD("spawning onnx process %s", onnx_runner.c_str());
-    char *argv[] = {(char*)onnx_runner.c_str(), (char*)path, nullptr};
-    dup2(pipein[0], 0);
-    dup2(pipeout[1], 1);
-    close(pipein[0]);
-    close(pipein[1]);
-    close(pipeout[0]);
-    close(pipeout[1]);
+    // no locks from here on, no logging or allocating: another thread may have held one at the fork.
+    // the runner keeps the write end of the alive pipe open until it exits, and sees the read end
+    // of parent_alive hang up when modeld exits. everything else is closed on exec
+    const int runner_fds[] = {shm_fd, request.rd, response.wr, alive[1], parent_alive[0]};
+    for (int fd : runner_fds) set_cloexec(fd, false);
     execvp(onnx_runner.c_str(), argv);
+    _exit(127);
   }
 
   // parent
-  close(pipein[0]);
-  close(pipeout[1]);
+  assert(proc_pid > 0);
+  close(alive[1]);
+  close(parent_alive[0]);
+  alive_fd = alive[0];
+  parent_alive_fd = parent_alive[1];
+  ready = false;
 }
 
-ONNXModel::~ONNXModel() {
-  close(pipein[1]);
-  close(pipeout[0]);
-  kill(proc_pid, SIGTERM);
+void ONNXModel::stop() {
+  if (proc_pid > 0) {
+    kill(proc_pid, SIGKILL);
+    HANDLE_EINTR(waitpid(proc_pid, NULL, 0));
+    proc_pid = -1;
+  }
+  close_doorbell(request.rd, request.wr);
+  close_doorbell(response.rd, response.wr);
+  if (alive_fd >= 0) close(alive_fd);
+  if (parent_alive_fd >= 0) close(parent_alive_fd);
+  alive_fd = parent_alive_fd = -1;
 }
 
-void ONNXModel::pwrite(float *buf, int size) {
-  char *cbuf = (char *)buf;
-  int tw = size*sizeof(float);
-  while (tw > 0) {
-    int err = write(pipein[1], cbuf, tw);
-    //printf("host write %d\n", err);
-    assert(err >= 0);
-    cbuf += err;
-    tw -= err;
+void ONNXModel::initShm(int buf_size) {
+  // the recurrent state is the tail of the previous output. then the runner reads it from the
+  // output area and it's never sent, otherwise it's an input like the others
+  const bool rnn_resident = rnn_input_buf != NULL && rnn_input_buf >= output &&
+                            rnn_input_buf + rnn_state_size <= output + output_size;
+
+  // order must be this, the order of the model's inputs
+  std::vector<std::pair<float *, size_t>> bufs = {{nullptr, (size_t)buf_size}};
+  if (desire_input_buf != NULL) bufs.push_back({desire_input_buf, (size_t)desire_state_size});
+  if (traffic_convention_input_buf != NULL) bufs.push_back({traffic_convention_input_buf, (size_t)traffic_convention_size});
+  if (rnn_input_buf != NULL && !rnn_resident) bufs.push_back({rnn_input_buf, (size_t)rnn_state_size});
+
+  // 64 byte aligned areas after the header
+  auto align = [](size_t n) { return (n + 15) & ~(size_t)15; };
+  size_t offset = ONNX_SHM_HEADER_FLOATS;
+  for (auto &[buf, size] : bufs) {
+    inputs.push_back({buf, offset, size});
+    offset += align(size);
+  }
+  output_offset = offset;
+  shm_size = (output_offset + output_size) * sizeof(float);
+
+  int err = ftruncate(shm_fd, shm_size);
+  assert(err == 0);
+  shm = (float *)mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+  assert(shm != MAP_FAILED);
+
+  uint64_t *header = (uint64_t *)shm;
+  assert(6 + 2 * inputs.size() <= ONNX_SHM_HEADER_FLOATS / 2);
+  header[0] = ONNX_SHM_MAGIC;
+  header[1] = inputs.size();
+  header[2] = output_offset;
+  header[3] = output_size;
+  header[4] = rnn_resident ? rnn_input_buf - output : 0;
+  header[5] = rnn_resident ? rnn_state_size : 0;
+  for (size_t i = 0; i < inputs.size(); i++) {
+    header[6 + 2 * i] = inputs[i].offset;
+    header[7 + 2 * i] = inputs[i].size;
   }
-  LOGD("host write of size %d done", size);
+  // seeds the recurrent state
+  memcpy(shm + output_offset, output, output_size * sizeof(float));
 }
 
-void ONNXModel::pread(float *buf, int size) {
-  char *cbuf = (char *)buf;
-  int tr = size*sizeof(float);
-  struct pollfd fds[1];
-  fds[0].fd = pipeout[0];
-  fds[0].events = POLLIN;
-  while (tr > 0) {
-    int err;
-    err = poll(fds, 1, 10000);  // 10 second timeout
-    assert(err == 1 || (err == -1 && errno == EINTR));
-    LOGD("host read remaining %d/%d poll %d", tr, size*sizeof(float), err);
-    err = read(pipeout[0], cbuf, tr);
-    assert(err > 0 || (err == 0 && errno == EINTR));
-    cbuf += err;
-    tr -= err;
+// rings the runner and waits for it to answer, false if it exited or didn't answer in time
+bool ONNXModel::run(int timeout_ms) {
+  const uint64_t ring = 1;
+  if (HANDLE_EINTR(write(request.wr, &ring, sizeof(ring))) != sizeof(ring)) {
+    LOGE("onnx runner %s: request failed: %s", path.c_str(), strerror(errno));
+    return false;
   }
-  LOGD("host read done");
+
+  struct pollfd fds[2] = {{.fd = response.rd, .events = POLLIN}, {.fd = alive_fd, .events = POLLIN}};
+  int ret = HANDLE_EINTR(poll(fds, 2, timeout_ms));
+  if (ret == 0) {
+    LOGE("onnx runner %s: no response in %d ms", path.c_str(), timeout_ms);
+    return false;
+  } else if (ret < 0 || !(fds[0].revents & POLLIN)) {
+    LOGE("onnx runner %s: exited", path.c_str());
+    return false;
+  }
+
+  uint64_t count;
+  HANDLE_EINTR(read(response.rd, &count, sizeof(count)));
+  return true;
 }
 
 void ONNXModel::addRecurrent(float *state, int state_size) {
@@ -100,17 +223,28 @@ void ONNXModel::addTrafficConvention(float *state, int state_size) {
 }
 
 void ONNXModel::execute(float *net_input_buf, int buf_size) {
-  // order must be this
-  pwrite(net_input_buf, buf_size);
-  if (desire_input_buf != NULL) {
-    pwrite(desire_input_buf, desire_state_size);
-  }
-  if (traffic_convention_input_buf != NULL) {
-    pwrite(traffic_convention_input_buf, traffic_convention_size);
+  if (shm == nullptr) initShm(buf_size);
+  assert((size_t)buf_size == inputs[0].size);
+
+  inputs[0].buf = net_input_buf;
+  for (auto &in : inputs) {
+    memcpy(shm + in.offset, in.buf, in.size * sizeof(float));
   }
-  if (rnn_input_buf != NULL) {
-    pwrite(rnn_input_buf, rnn_state_size);
+
+  // a runner that died or hung is restarted, the request is still in shared memory. it may have
+  // been killed halfway through writing the output, so the recurrent state in it is put back to
+  // that of the last complete execute, which `output` still holds
+  for (int restarts = 0; !run(ready ? RUN_TIMEOUT_MS : STARTUP_TIMEOUT_MS); restarts++) {
+    if (restarts == MAX_RESTARTS) {
+      LOGE("onnx runner %s: failed %d times in a row, giving up", path.c_str(), restarts + 1);
+      throw std::runtime_error("onnx runner failed");
+    }
+    LOGW("onnx runner %s: restarting", path.c_str());
+    stop();
+    memcpy(shm + output_offset, output, output_size * sizeof(float));
+    spawn();
   }
-  pread(output, output_size);
-}
+  ready = true;
 
+  memcpy(output, shm + output_offset, output_size * sizeof(float));
+}
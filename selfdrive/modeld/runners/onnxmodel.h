@@ -1,9 +1,20 @@
 #pragma once
 
 #include <cstdlib>
+#include <string>
+#include <vector>
 
 #include "selfdrive/modeld/runners/runmodel.h"
 
+// shared memory layout, offsets and sizes in floats. the header is 64 bit words:
+// magic, input count, output offset, output size, recurrent offset in the output, recurrent size,
+// then an offset and size per input
+#define ONNX_SHM_MAGIC 0x4f4e4e58534d454dULL
+#define ONNX_SHM_HEADER_FLOATS 64
+
+// Runs an onnx model in onnx_runner.py. Inputs and outputs are exchanged through a shared memory
+// buffer, eventfds signal a new request and its response. The recurrent state stays in the
+// output area of the buffer, where the runner reads it back from.
 class ONNXModel : public RunModel {
 public:
   ONNXModel(const char *path, float *output, size_t output_size, int runtime);
@@ -13,7 +24,8 @@ public:
   void addTrafficConvention(float *state, int state_size);
   void execute(float *net_input_buf, int buf_size);
 private:
-  int proc_pid;
+  std::string path;
+  int proc_pid = -1;
 
   float *output;
   size_t output_size;
@@ -25,10 +37,29 @@ private:
   float *traffic_convention_input_buf = NULL;
   int traffic_convention_size;
 
-  // pipe to communicate to keras subprocess
-  void pread(float *buf, int size);
-  void pwrite(float *buf, int size);
-  int pipein[2];
-  int pipeout[2];
-};
+  // rung by one process, waited on by the other. an eventfd on linux, a pipe elsewhere
+  struct Doorbell {
+    int rd = -1, wr = -1;
+  };
 
+  // the runner process. alive_fd hangs up when it exits, the runner exits when parent_alive_fd
+  // hangs up, i.e. when modeld exits
+  void spawn();
+  void stop();
+  bool run(int timeout_ms);
+  Doorbell request, response;
+  int alive_fd = -1, parent_alive_fd = -1;
+  bool ready = false;
+
+  // memfd shared with the runner, laid out on the first execute
+  void initShm(int buf_size);
+  int shm_fd = -1;
+  float *shm = nullptr;
+  size_t shm_size = 0;
+  struct ShmInput {
+    float *buf;
+    size_t offset, size;
+  };
+  std::vector<ShmInput> inputs;
+  size_t output_offset;
+};
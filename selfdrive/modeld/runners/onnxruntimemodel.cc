@@ -0,0 +1,146 @@
+#include "selfdrive/modeld/runners/onnxruntimemodel.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <numeric>
+
+#include "selfdrive/common/swaglog.h"
+#include "selfdrive/common/util.h"
+
+namespace {
+
+// shape with a dynamic batch size set to 1, like onnx_runner.py
+std::vector<int64_t> fixed_shape(const Ort::TypeInfo &type_info) {
+  std::vector<int64_t> shape = type_info.GetTensorTypeAndShapeInfo().GetShape();
+  for (auto &d : shape) {
+    if (d < 0) d = 1;
+  }
+  return shape;
+}
+
+bool has_provider(const std::vector<std::string> &providers, const std::string &name) {
+  return std::find(providers.begin(), providers.end(), name) != providers.end();
+}
+
+}  // namespace
+
+ONNXRuntimeModel::ONNXRuntimeModel(const char *path, float *_output, size_t _output_size, int runtime, int intra_op_threads)
+    : env(ORT_LOGGING_LEVEL_WARNING, "modeld"), output(_output), output_size(_output_size) {
+  LOGD("loading model %s", path);
+
+  // same provider choice and settings as onnx_runner.py, whatever the runtime asked for
+  Ort::SessionOptions options;
+  const auto providers = Ort::GetAvailableProviders();
+  const bool use_cpu = getenv("ONNXCPU") != nullptr;
+  std::string provider = "CPUExecutionProvider";
+  if (!use_cpu && has_provider(providers, "OpenVINOExecutionProvider")) {
+    provider = "OpenVINOExecutionProvider";
+    options.SetGraphOptimizationLevel(GraphOptimizationLevel::ORT_DISABLE_ALL);
+    options.AppendExecutionProvider_OpenVINO(OrtOpenVINOProviderOptions{});
+  } else if (!use_cpu && has_provider(providers, "CUDAExecutionProvider")) {
+    provider = "CUDAExecutionProvider";
+    options.SetGraphOptimizationLevel(GraphOptimizationLevel::ORT_DISABLE_ALL);
+    options.AppendExecutionProvider_CUDA(OrtCUDAProviderOptions{});
+  } else {
+    options.SetGraphOptimizationLevel(GraphOptimizationLevel::ORT_ENABLE_ALL);
+    options.SetExecutionMode(ExecutionMode::ORT_SEQUENTIAL);
+  }
+  intra_op_threads = util::getenv("ONNX_INTRA_OP_THREADS", intra_op_threads);
+  options.SetIntraOpNumThreads(intra_op_threads);
+  options.SetInterOpNumThreads(1);
+
+  session = Ort::Session(env, path, options);
+  memory_info = Ort::MemoryInfo::CreateCpu(OrtArenaAllocator, OrtMemTypeDefault);
+
+  Ort::AllocatorWithDefaultOptions allocator;
+  for (size_t i = 0; i < session.GetInputCount(); i++) {
+    auto shape = fixed_shape(session.GetInputTypeInfo(i));
+    size_t size = std::accumulate(shape.begin(), shape.end(), (int64_t)1, std::multiplies<int64_t>());
+    inputs.push_back({session.GetInputNameAllocated(i, allocator).get(), shape, size});
+  }
+  size_t total_output_size = 0;
+  for (size_t i = 0; i < session.GetOutputCount(); i++) {
+    auto shape = fixed_shape(session.GetOutputTypeInfo(i));
+    size_t size = std::accumulate(shape.begin(), shape.end(), (int64_t)1, std::multiplies<int64_t>());
+    outputs.push_back({session.GetOutputNameAllocated(i, allocator).get(), shape, size});
+    total_output_size += size;
+  }
+  // outputs are laid out back to back in the output buffer
+  if (total_output_size != output_size) {
+    LOGE("%s outputs %zu floats, expected %zu", path, total_output_size, output_size);
+    assert(false);
+  }
+
+  LOG("onnxruntime %s: %zu inputs, %zu outputs, %s with %d threads", path, inputs.size(), outputs.size(),
+      provider.c_str(), intra_op_threads);
+}
+
+void ONNXRuntimeModel::addRecurrent(float *state, int state_size) {
+  recurrent = state;
+  recurrent_size = state_size;
+}
+
+void ONNXRuntimeModel::addDesire(float *state, int state_size) {
+  desire = state;
+  desire_size = state_size;
+}
+
+void ONNXRuntimeModel::addTrafficConvention(float *state, int state_size) {
+  traffic_convention = state;
+  traffic_convention_size = state_size;
+}
+
+void ONNXRuntimeModel::bind(const TensorInfo &info, float *buf, bool input) {
+  Ort::Value value = Ort::Value::CreateTensor<float>(memory_info, buf, info.size, info.shape.data(), info.shape.size());
+  if (input) {
+    binding->BindInput(info.name.c_str(), value);
+  } else {
+    binding->BindOutput(info.name.c_str(), value);
+  }
+}
+
+// binds everything but the image, which may move between frames
+void ONNXRuntimeModel::bindAll() {
+  binding = std::make_unique<Ort::IoBinding>(session);
+
+  // same order as ONNXModel writes them to onnx_runner.py
+  if (desire) extra_inputs.push_back({desire, desire_size});
+  if (traffic_convention) extra_inputs.push_back({traffic_convention, traffic_convention_size});
+  if (recurrent) {
+    const bool in_output = recurrent >= output && recurrent < output + output_size;
+    if (in_output) recurrent_input.resize(recurrent_size);
+    extra_inputs.push_back({in_output ? recurrent_input.data() : recurrent, recurrent_size});
+  }
+  assert(inputs.size() == extra_inputs.size() + 1);
+
+  for (size_t i = 0; i < extra_inputs.size(); i++) {
+    const TensorInfo &info = inputs[i + 1];
+    if (info.size != (size_t)extra_inputs[i].second) {
+      LOGE("input %s takes %zu floats, got %d", info.name.c_str(), info.size, extra_inputs[i].second);
+      assert(false);
+    }
+    bind(info, extra_inputs[i].first, true);
+  }
+
+  float *out = output;
+  for (const auto &info : outputs) {
+    bind(info, out, false);
+    out += info.size;
+  }
+}
+
+void ONNXRuntimeModel::execute(float *_net_input_buf, int buf_size) {
+  if (!binding) bindAll();
+
+  if (_net_input_buf != net_input_buf) {
+    assert((size_t)buf_size == inputs[0].size);
+    bind(inputs[0], _net_input_buf, true);
+    net_input_buf = _net_input_buf;
+  }
+  if (!recurrent_input.empty()) {
+    memcpy(recurrent_input.data(), recurrent, recurrent_size * sizeof(float));
+  }
+
+  session.Run(Ort::RunOptions{nullptr}, *binding);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <onnxruntime_cxx_api.h>
+
+#include "selfdrive/modeld/runners/runmodel.h"
+
+// Runs an onnx model in process through the ONNX Runtime C++ API. Inputs and outputs are
+// bound to the caller's buffers once, each execute() is a single Run() with no copies.
+class ONNXRuntimeModel : public RunModel {
+public:
+  // intra_op_threads is overridden by ONNX_INTRA_OP_THREADS
+  ONNXRuntimeModel(const char *path, float *output, size_t output_size, int runtime, int intra_op_threads = 2);
+  void addRecurrent(float *state, int state_size);
+  void addDesire(float *state, int state_size);
+  void addTrafficConvention(float *state, int state_size);
+  void execute(float *net_input_buf, int buf_size);
+
+private:
+  struct TensorInfo {
+    std::string name;
+    std::vector<int64_t> shape;
+    size_t size;
+  };
+  void bind(const TensorInfo &info, float *buf, bool input);
+  void bindAll();
+
+  Ort::Env env;
+  Ort::Session session{nullptr};
+  Ort::MemoryInfo memory_info{nullptr};
+  std::unique_ptr<Ort::IoBinding> binding;
+  std::vector<TensorInfo> inputs, outputs;
+
+  float *output;
+  size_t output_size;
+  float *net_input_buf = nullptr;
+
+  // inputs after the image, in the order the model takes them
+  std::vector<std::pair<float *, int>> extra_inputs;
+  float *desire = nullptr, *traffic_convention = nullptr, *recurrent = nullptr;
+  int desire_size, traffic_convention_size, recurrent_size;
+  // the recurrent state lives in the output buffer, it's copied out before each run so
+  // the model doesn't write its new state over the input it's still reading
+  std::vector<float> recurrent_input;
+};
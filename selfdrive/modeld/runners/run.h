@@ -5,6 +5,8 @@
 
 #if defined(USE_THNEED)
 #include "thneedmodel.h"
+#elif defined(USE_ONNXRUNTIME)
+#include "onnxruntimemodel.h"
 #elif defined(USE_ONNX_MODEL)
 #include "onnxmodel.h"
 #endif
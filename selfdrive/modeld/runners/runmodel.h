@@ -1,4 +1,10 @@
 #pragma once
+
+// the runtime a model asks for. SNPE runs it there, the other runners pick their own
+#define USE_CPU_RUNTIME 0
+#define USE_GPU_RUNTIME 1
+#define USE_DSP_RUNTIME 2
+
 class RunModel {
 public:
   virtual ~RunModel() {}
@@ -0,0 +1,122 @@
+// compares the fused dmonitoring frame preparation (transforms/crop_resize_cpu.cc) against the
+// libyuv passes it replaced, and benchmarks both
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "libyuv.h"
+
+#include "selfdrive/common/tests/cpu_port_test.h"
+#include "selfdrive/modeld/transforms/crop_resize_cpu.h"
+
+using Rect = CropResizeCpu::Rect;
+
+const int MODEL_WIDTH = 320, MODEL_HEIGHT = 640;
+const int MODEL_FRAME_SIZE = MODEL_WIDTH * MODEL_HEIGHT * 3 / 2;
+const int BENCHMARK_FRAMES = 200;
+
+// what dmonitoring_eval_frame did: copy the crop out, mirror it, scale it into a black frame and
+// look the pixels up in a table in the order of loadyuv.cl
+class Reference {
+public:
+  Reference() {
+    for (int x = 0; x < 256; ++x) {
+      tensor[x] = (x - 128.f) * 0.0078125f;
+    }
+    resized.resize(MODEL_FRAME_SIZE);
+  }
+
+  void run(const uint8_t *yuv, int width, int height, const Rect &crop, bool mirror, const Rect &dst, float *out) {
+    const int cw = crop.w, ch = crop.h, cuw = (cw + 1) / 2, cuh = (ch + 1) / 2;
+    cropped.resize(cw * ch + 2 * cuw * cuh);
+    mirrored.resize(cropped.size());
+    uint8_t *y = cropped.data(), *u = y + cw * ch, *v = u + cuw * cuh;
+    const uint8_t *in_u = yuv + width * height, *in_v = in_u + (width / 2) * (height / 2);
+    for (int r = 0; r < ch; ++r) {
+      memcpy(y + r * cw, yuv + (crop.y + r) * width + crop.x, cw);
+    }
+    for (int r = 0; r < cuh; ++r) {
+      memcpy(u + r * cuw, in_u + (crop.y / 2 + r) * (width / 2) + crop.x / 2, cuw);
+      memcpy(v + r * cuw, in_v + (crop.y / 2 + r) * (width / 2) + crop.x / 2, cuw);
+    }
+    if (mirror) {
+      uint8_t *my = mirrored.data(), *mu = my + cw * ch, *mv = mu + cuw * cuh;
+      libyuv::I420Mirror(y, cw, u, cuw, v, cuw, my, cw, mu, cuw, mv, cuw, cw, ch);
+      y = my, u = mu, v = mv;
+    }
+
+    uint8_t *ry = resized.data(), *ru = ry + MODEL_WIDTH * MODEL_HEIGHT, *rv = ru + MODEL_FRAME_SIZE / 6;
+    memset(ry, 16, MODEL_WIDTH * MODEL_HEIGHT);
+    memset(ru, 128, 2 * MODEL_FRAME_SIZE / 6);
+    const int uv_width = MODEL_WIDTH / 2;
+    libyuv::I420Scale(y, cw, u, cuw, v, cuw, cw, ch,
+                      ry + dst.y * MODEL_WIDTH + dst.x, MODEL_WIDTH,
+                      ru + dst.y / 2 * uv_width + dst.x / 2, uv_width,
+                      rv + dst.y / 2 * uv_width + dst.x / 2, uv_width,
+                      dst.w, dst.h, libyuv::kFilterBilinear);
+
+    const int plane = uv_width * (MODEL_HEIGHT / 2);
+    for (int r = 0; r < MODEL_HEIGHT / 2; r++) {
+      for (int c = 0; c < uv_width; c++) {
+        out[r * uv_width + c + 0 * plane] = tensor[ry[(2 * r) * MODEL_WIDTH + 2 * c]];
+        out[r * uv_width + c + 1 * plane] = tensor[ry[(2 * r + 1) * MODEL_WIDTH + 2 * c]];
+        out[r * uv_width + c + 2 * plane] = tensor[ry[(2 * r) * MODEL_WIDTH + 2 * c + 1]];
+        out[r * uv_width + c + 3 * plane] = tensor[ry[(2 * r + 1) * MODEL_WIDTH + 2 * c + 1]];
+        out[r * uv_width + c + 4 * plane] = tensor[ru[r * uv_width + c]];
+        out[r * uv_width + c + 5 * plane] = tensor[rv[r * uv_width + c]];
+      }
+    }
+  }
+
+private:
+  float tensor[256];
+  std::vector<uint8_t> cropped, mirrored, resized;
+};
+
+// the SIMD versions of libyuv round the column blend a little differently, allow off by one
+bool test_crop_resize(int width, int height, const Rect &crop, bool mirror, const Rect &dst, bool noise, bool benchmark) {
+  const auto yuv = test_frame(width, height, noise);
+  std::vector<float> out(MODEL_FRAME_SIZE), ref_out(MODEL_FRAME_SIZE);
+  CropResizeCpu crop_resize(MODEL_WIDTH, MODEL_HEIGHT);
+  Reference ref;
+  crop_resize.run(yuv.data(), width, height, crop, mirror, dst, out.data());
+  ref.run(yuv.data(), width, height, crop, mirror, dst, ref_out.data());
+
+  float max_diff = 0;
+  int off = 0;
+  for (int i = 0; i < MODEL_FRAME_SIZE; ++i) {
+    const float diff = std::abs(out[i] - ref_out[i]) * 128;
+    max_diff = std::max(max_diff, diff);
+    off += diff > 0.5;
+  }
+  const bool passed = max_diff <= 1;
+  printf("crop %dx%d of %dx%d%s%s: max diff %.0f, %d of %d values off by one\n", crop.w, crop.h, width, height,
+         mirror ? " mirrored" : "", noise ? " noise" : "", max_diff, off, MODEL_FRAME_SIZE);
+  if (benchmark) {
+    printf("  fused %.2f ms/frame, libyuv %.2f ms/frame\n",
+           time_ms(BENCHMARK_FRAMES, [&] { crop_resize.run(yuv.data(), width, height, crop, mirror, dst, out.data()); }),
+           time_ms(BENCHMARK_FRAMES, [&] { ref.run(yuv.data(), width, height, crop, mirror, dst, ref_out.data()); }));
+  }
+  return passed;
+}
+
+int main() {
+  bool passed = true;
+  // the crops of dmonitoring_eval_frame on tici, left and right hand drive
+  const Rect tici_crop = {1011, 102, 358, 717}, tici_crop_rhd = {415, 102, 358, 717};
+  const Rect tici_dst = {0, 0, MODEL_WIDTH, MODEL_HEIGHT};
+  passed &= test_crop_resize(1928, 1208, tici_crop, false, tici_dst, false, true);
+  passed &= test_crop_resize(1928, 1208, tici_crop_rhd, true, tici_dst, false, true);
+  passed &= test_crop_resize(1928, 1208, tici_crop, false, tici_dst, true, false);
+  passed &= test_crop_resize(1928, 1208, tici_crop_rhd, true, tici_dst, true, false);
+  // eon scales into a band of the model frame
+  const Rect eon_crop = {1152 - 372, 0, 372, 864}, eon_crop_rhd = {0, 0, 372, 864};
+  const Rect eon_dst = {0, 96, 272, 448};
+  passed &= test_crop_resize(1152, 864, eon_crop, false, eon_dst, true, false);
+  passed &= test_crop_resize(1152, 864, eon_crop_rhd, true, eon_dst, false, true);
+
+  return test_result(passed);
+}
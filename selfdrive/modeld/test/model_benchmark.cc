@@ -0,0 +1,262 @@
+// Benchmarks the driving model the way modeld runs it, with any of the runners: frames of a
+// recorded road camera go through model_prepare_frame (ModelFrame::prepare) and model_execute
+// one after the other. Frames are prepared with OpenCL on a GPU, or on the CPU without one like
+// modeld does, so with the onnx runner it also runs on a PC without a GPU.
+//
+// Reports p50/p90/p99/max latency of the stages of a frame, the throughput of frames run back to
+// back, and the CPU time per frame and RSS of this process and its children: the onnx runner
+// executes the model in a python process of its own.
+//
+// usage: model_benchmark [--runner onnx|snpe|thneed] [--model path] [--warmup frames] [--frames N]
+//                        [-n frames | -t seconds] [--json] <camera file>
+// the camera file is an fcamera.hevc, local or an https:// url. Its first --frames frames (default
+// 20) are decoded up front and cycled through, so decoding isn't measured. After --warmup frames
+// (default 10), -n runs a fixed number of frames (default 200) and -t runs for a fixed time.
+// --json also prints the results as one json object. Run it from selfdrive/modeld like modeld,
+// the onnx and snpe models load from ../../models unless --model is given. thneed needs --model:
+// the supercombo.thneed there is built with --binary for the GPU of the device.
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "json11.hpp"
+#include "selfdrive/common/clutil.h"
+#include "selfdrive/common/stage_stats.h"
+#include "selfdrive/common/timing.h"
+#include "selfdrive/common/util.h"
+#include "selfdrive/modeld/models/driving.h"
+#include "selfdrive/modeld/runners/thneedmodel.h"
+#include "selfdrive/proclogd/proclog.h"
+#include "selfdrive/ui/replay/framereader.h"
+
+ExitHandler do_exit;
+
+enum Stage {
+  STAGE_PREPARE,
+  STAGE_EXECUTE,
+  STAGE_FRAME,
+  STAGE_COUNT,
+};
+const std::array<const char *, STAGE_COUNT> STAGE_NAMES = {"prepare", "execute", "frame"};
+
+// the model each runner loads by default, none for thneed
+const std::map<std::string, std::string> DEFAULT_MODELS = {
+  {"onnx", "../../models/supercombo.onnx"},
+  {"snpe", "../../models/supercombo.dlc"},
+  {"thneed", ""},
+};
+
+struct Args {
+#if defined(USE_ONNXRUNTIME) || defined(USE_ONNX_MODEL)
+  std::string runner = "onnx";
+#else
+  std::string runner = "snpe";
+#endif
+  std::string model_path, camera_path;
+  int warmup = 10, frames = 20, iterations = 200;
+  double seconds = 0;
+  bool json = false;
+};
+
+// onnx is the runner modeld is built with on a PC, ONNXRuntimeModel or ONNXModel. nullptr when the
+// runner isn't built in
+std::unique_ptr<RunModel> make_runner(const std::string &runner, const char *path, float *output) {
+  if (runner == "snpe") return std::make_unique<SNPEModel>(path, output, NET_OUTPUT_SIZE, USE_GPU_RUNTIME);
+  if (runner == "thneed") return std::make_unique<ThneedModel>(path, output, NET_OUTPUT_SIZE, USE_GPU_RUNTIME);
+#if defined(USE_ONNXRUNTIME)
+  if (runner == "onnx") return std::make_unique<ONNXRuntimeModel>(path, output, NET_OUTPUT_SIZE, USE_GPU_RUNTIME);
+#elif defined(USE_ONNX_MODEL)
+  if (runner == "onnx") return std::make_unique<ONNXModel>(path, output, NET_OUTPUT_SIZE, USE_GPU_RUNTIME);
+#endif
+  return nullptr;
+}
+
+// the transform of a camera mounted straight, as update_calibration makes it from liveCalibration
+mat3 default_transform() {
+  // view_frame_from_road_frame of common/transformations/camera.py at 1.22 m, no rotation
+  const float extrinsic_matrix[] = {
+    0., 1., 0., 0.,
+    0., 0., 1., 1.22,
+    1., 0., 0., 0.,
+  };
+  MessageBuilder msg;
+  auto calib = msg.initEvent().initLiveCalibration();
+  calib.setExtrinsicMatrix(kj::ArrayPtr<const float>(extrinsic_matrix, 3 * 4));
+  return update_calibration(calib.asReader(), false);
+}
+
+struct ProcessUsage {
+  std::string name;
+  double cpu_ms = 0;  // user and system time since the process started
+  uint64_t rss = 0;   // bytes
+};
+
+// this process and its descendants by pid
+std::map<int, ProcessUsage> process_tree_usage() {
+  static const double jiffy = sysconf(_SC_CLK_TCK);
+  static const size_t page_size = sysconf(_SC_PAGE_SIZE);
+
+  std::vector<ProcStat> stats;
+  for (int pid : Parser::pids()) {
+    if (auto stat = Parser::procStat(util::read_file("/proc/" + std::to_string(pid) + "/stat"))) {
+      stats.push_back(*stat);
+    }
+  }
+  std::map<int, ProcessUsage> tree;
+  std::set<int> tree_pids = {getpid()};
+  for (bool grew = true; grew;) {
+    grew = false;
+    for (const ProcStat &s : stats) {
+      if ((s.pid == getpid() || tree_pids.count(s.ppid)) && !tree.count(s.pid)) {
+        tree[s.pid] = {s.name, (s.utime + s.stime) * 1000. / jiffy, s.rss * page_size};
+        tree_pids.insert(s.pid);
+        grew = true;
+      }
+    }
+  }
+  return tree;
+}
+
+int main(int argc, char **argv) {
+  Args args;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--runner" && i + 1 < argc) args.runner = argv[++i];
+    else if (arg == "--model" && i + 1 < argc) args.model_path = argv[++i];
+    else if (arg == "--warmup" && i + 1 < argc) args.warmup = std::max(0, atoi(argv[++i]));
+    else if (arg == "--frames" && i + 1 < argc) args.frames = std::max(1, atoi(argv[++i]));
+    else if (arg == "-n" && i + 1 < argc) args.iterations = std::max(1, atoi(argv[++i]));
+    else if (arg == "-t" && i + 1 < argc) args.seconds = std::max(0.1, atof(argv[++i]));
+    else if (arg == "--json") args.json = true;
+    else args.camera_path = arg;
+  }
+  if (args.camera_path.empty() || !DEFAULT_MODELS.count(args.runner)) {
+    fprintf(stderr, "usage: %s [--runner onnx|snpe|thneed] [--model path] [--warmup frames] [--frames N]\n"
+                    "       [-n frames | -t seconds] [--json] <camera file>\n", argv[0]);
+    return 1;
+  }
+  if (args.model_path.empty()) args.model_path = DEFAULT_MODELS.at(args.runner);
+  if (args.model_path.empty()) {
+    fprintf(stderr, "the thneed runner needs --model: a .thneed made by thneed/compile without --binary, binaries\n"
+                    "only load on the GPU they were built for\n");
+    return 1;
+  }
+
+  // thneed replays in an OpenCL context of its own, which frames can't be prepared into
+  cl_device_id device_id = args.runner == "thneed" ? nullptr : cl_find_device_id(CL_DEVICE_TYPE_GPU);
+  cl_context context = nullptr;
+  if (device_id) {
+    context = CL_CHECK_ERR(clCreateContext(NULL, 1, &device_id, NULL, NULL, &err));
+  }
+
+  FrameReader fr;
+  if (!fr.load(args.camera_path)) {
+    fprintf(stderr, "failed to load %s\n", args.camera_path.c_str());
+    return 1;
+  }
+  std::vector<VisionBuf> bufs(std::min<size_t>(args.frames, fr.getFrameCount()));
+  for (int i = 0; i < bufs.size(); i++) {
+    bufs[i].allocate(fr.getYUVSize());
+    if (device_id) bufs[i].init_cl(device_id, context);
+    bufs[i].init_yuv(fr.width, fr.height);
+    if (!fr.get(i, nullptr, (uint8_t *)bufs[i].addr)) {
+      fprintf(stderr, "failed to decode frame %d of %s\n", i, args.camera_path.c_str());
+      return 1;
+    }
+    if (device_id) bufs[i].sync(VISIONBUF_SYNC_TO_DEVICE);
+  }
+  if (bufs.empty()) {
+    fprintf(stderr, "no frames in %s\n", args.camera_path.c_str());
+    return 1;
+  }
+
+  ModelState model;
+  std::unique_ptr<RunModel> runner = make_runner(args.runner, args.model_path.c_str(), model.output.data());
+  if (!runner) {
+    fprintf(stderr, "the %s runner isn't built in\n", args.runner.c_str());
+    return 1;
+  }
+  model_init(&model, device_id, context, std::move(runner));
+  const mat3 transform = default_transform();
+  printf("%s runner, %s, %zu frames of %dx%d prepared on the %s\n", args.runner.c_str(), args.model_path.c_str(),
+         bufs.size(), fr.width, fr.height, model.frame->use_cpu() ? "CPU" : "GPU");
+
+  // model_eval_frame with its steps timed, no desire
+  StageStats<STAGE_COUNT> stats(STAGE_NAMES);
+  auto run_frame = [&](int i) {
+    StageClock clock;
+    ModelInput input = model_prepare_frame(&model, &bufs[i % bufs.size()], transform, nullptr);
+    const double prepare_ms = clock.lap();
+    model_execute(&model, input);
+    const double execute_ms = clock.lap();
+    stats.add(STAGE_PREPARE, prepare_ms);
+    stats.add(STAGE_EXECUTE, execute_ms);
+    stats.add(STAGE_FRAME, prepare_ms + execute_ms);
+  };
+
+  // the first frames pay for loading and compiling, like thneed recording its kernels
+  for (int i = 0; i < args.warmup && !do_exit; i++) {
+    run_frame(i);
+  }
+  stats.report();
+
+  const auto usage_start = process_tree_usage();
+  const double t1 = millis_since_boot();
+  int frames = 0;
+  while (!do_exit && (args.seconds > 0 ? millis_since_boot() - t1 < args.seconds * 1000 : frames < args.iterations)) {
+    run_frame(args.warmup + frames);
+    frames++;
+  }
+  const double seconds = (millis_since_boot() - t1) / 1000.;
+  const auto usage_end = process_tree_usage();
+  if (frames == 0) return 1;
+
+  printf("%d frames in %.2f s: %.1f fps\n", frames, seconds, frames / seconds);
+  printf("\n%-10s %8s %8s %8s %8s %8s\n", "ms", "mean", "p50", "p90", "p99", "max");
+  for (int s = 0; s < STAGE_COUNT; s++) {
+    const LatencyHistogram &h = stats[s];
+    printf("%-10s %8.2f %8.2f %8.2f %8.2f %8.2f\n", STAGE_NAMES[s], h.mean(), h.percentile(50), h.percentile(90),
+           h.percentile(99), h.max());
+  }
+
+  // a process that started during the run counts from zero. RSS is summed, pages shared between
+  // processes count for each
+  double cpu_ms = 0, rss_mb = 0;
+  printf("\n%-8s %-16s %12s %8s\n", "pid", "process", "cpu ms/frame", "rss MB");
+  for (const auto &[pid, usage] : usage_end) {
+    const double start_ms = usage_start.count(pid) ? usage_start.at(pid).cpu_ms : 0.;
+    const double process_cpu_ms = (usage.cpu_ms - start_ms) / frames;
+    cpu_ms += process_cpu_ms;
+    rss_mb += usage.rss / 1e6;
+    printf("%-8d %-16s %12.2f %8.1f\n", pid, usage.name.c_str(), process_cpu_ms, usage.rss / 1e6);
+  }
+  printf("%-25s %12.2f %8.1f\n", "total", cpu_ms, rss_mb);
+
+  if (args.json) {
+    json11::Json results = json11::Json::object{
+      {"runner", args.runner},
+      {"model", args.model_path},
+      {"cpu_prepare", model.frame->use_cpu()},
+      {"frames", frames},
+      {"seconds", seconds},
+      {"fps", frames / seconds},
+      {"cpu_ms_per_frame", cpu_ms},
+      {"rss_mb", rss_mb},
+      {"stages", stats.report()},
+    };
+    printf("%s\n", results.dump().c_str());
+  }
+
+  model_free(&model);
+  for (auto &buf : bufs) buf.free();
+  if (context) CL_CHECK(clReleaseContext(context));
+  return 0;
+}
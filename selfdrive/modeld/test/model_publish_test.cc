@@ -0,0 +1,458 @@
+// checks that modelV2 is built as before the decoding was vectorized, and benchmarks publishing it.
+// the reference is the scalar implementation it replaced, with a MessageBuilder per frame
+
+#include <algorithm>
+#include <chrono>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <capnp/dynamic.h>
+#include <capnp/serialize.h>
+
+#include "selfdrive/modeld/models/driving.h"
+
+const int TEST_FRAMES = 100;
+const int BENCHMARK_FRAMES = 2000;
+
+namespace ref {
+
+struct RefPublishState {
+  std::array<float, 5> prev_brake_5ms2_probs = {};
+  std::array<float, 3> prev_brake_3ms2_probs = {};
+};
+
+constexpr float FCW_THRESHOLD_5MS2_HIGH = 0.15;
+constexpr float FCW_THRESHOLD_5MS2_LOW = 0.05;
+constexpr float FCW_THRESHOLD_3MS2 = 0.7;
+
+template<class T, size_t size>
+constexpr const kj::ArrayPtr<const T> to_kj_array_ptr(const std::array<T, size> &arr) {
+  return kj::ArrayPtr(arr.data(), arr.size());
+}
+
+void ref_softmax(const float* input, float* output, size_t len) {
+  const float max_val = *std::max_element(input, input + len);
+  float denominator = 0;
+  for(int i = 0; i < len; i++) {
+    float const v_exp = expf(input[i] - max_val);
+    denominator += v_exp;
+    output[i] = v_exp;
+  }
+
+  const float inv_denominator = 1. / denominator;
+  for(int i = 0; i < len; i++) {
+    output[i] *= inv_denominator;
+  }
+}
+
+void fill_lead(cereal::ModelDataV2::LeadDataV3::Builder lead, const ModelOutputLeads &leads, int t_idx, float prob_t) {
+  std::array<float, LEAD_TRAJ_LEN> lead_t = {0.0, 2.0, 4.0, 6.0, 8.0, 10.0};
+  const auto &best_prediction = leads.get_best_prediction(t_idx);
+  lead.setProb(sigmoid(leads.prob[t_idx]));
+  lead.setProbTime(prob_t);
+  std::array<float, LEAD_TRAJ_LEN> lead_x, lead_y, lead_v, lead_a;
+  std::array<float, LEAD_TRAJ_LEN> lead_x_std, lead_y_std, lead_v_std, lead_a_std;
+  for (int i=0; i<LEAD_TRAJ_LEN; i++) {
+    lead_x[i] = best_prediction.mean[i].x;
+    lead_y[i] = best_prediction.mean[i].y;
+    lead_v[i] = best_prediction.mean[i].velocity;
+    lead_a[i] = best_prediction.mean[i].acceleration;
+    lead_x_std[i] = exp(best_prediction.std[i].x);
+    lead_y_std[i] = exp(best_prediction.std[i].y);
+    lead_v_std[i] = exp(best_prediction.std[i].velocity);
+    lead_a_std[i] = exp(best_prediction.std[i].acceleration);
+  }
+  lead.setT(to_kj_array_ptr(lead_t));
+  lead.setX(to_kj_array_ptr(lead_x));
+  lead.setY(to_kj_array_ptr(lead_y));
+  lead.setV(to_kj_array_ptr(lead_v));
+  lead.setA(to_kj_array_ptr(lead_a));
+  lead.setXStd(to_kj_array_ptr(lead_x_std));
+  lead.setYStd(to_kj_array_ptr(lead_y_std));
+  lead.setVStd(to_kj_array_ptr(lead_v_std));
+  lead.setAStd(to_kj_array_ptr(lead_a_std));
+}
+
+void fill_meta(cereal::ModelDataV2::MetaData::Builder meta, const ModelOutputMeta &meta_data, RefPublishState &ps) {
+  std::array<float, DESIRE_LEN> desire_state_softmax;
+  ref_softmax(meta_data.desire_state_prob.array.data(), desire_state_softmax.data(), DESIRE_LEN);
+
+  std::array<float, DESIRE_PRED_LEN * DESIRE_LEN> desire_pred_softmax;
+  for (int i=0; i<DESIRE_PRED_LEN; i++) {
+    ref_softmax(meta_data.desire_pred_prob[i].array.data(), desire_pred_softmax.data() + (i * DESIRE_LEN), DESIRE_LEN);
+  }
+
+  std::array<float, DISENGAGE_LEN> lat_long_t = {2,4,6,8,10};
+  std::array<float, DISENGAGE_LEN> gas_disengage_sigmoid, brake_disengage_sigmoid, steer_override_sigmoid,
+                                   brake_3ms2_sigmoid, brake_4ms2_sigmoid, brake_5ms2_sigmoid;
+  for (int i=0; i<DISENGAGE_LEN; i++) {
+    gas_disengage_sigmoid[i] = sigmoid(meta_data.disengage_prob[i].gas_disengage);
+    brake_disengage_sigmoid[i] = sigmoid(meta_data.disengage_prob[i].brake_disengage);
+    steer_override_sigmoid[i] = sigmoid(meta_data.disengage_prob[i].steer_override);
+    brake_3ms2_sigmoid[i] = sigmoid(meta_data.disengage_prob[i].brake_3ms2);
+    brake_4ms2_sigmoid[i] = sigmoid(meta_data.disengage_prob[i].brake_4ms2);
+    brake_5ms2_sigmoid[i] = sigmoid(meta_data.disengage_prob[i].brake_5ms2);
+    //gas_pressed_sigmoid[i] = sigmoid(meta_data.disengage_prob[i].gas_pressed);
+  }
+
+  std::memmove(ps.prev_brake_5ms2_probs.data(), &ps.prev_brake_5ms2_probs[1], 4*sizeof(float));
+  std::memmove(ps.prev_brake_3ms2_probs.data(), &ps.prev_brake_3ms2_probs[1], 2*sizeof(float));
+  ps.prev_brake_5ms2_probs[4] = brake_5ms2_sigmoid[0];
+  ps.prev_brake_3ms2_probs[2] = brake_3ms2_sigmoid[0];
+
+  bool above_fcw_threshold = true;
+  for (int i=0; i<ps.prev_brake_5ms2_probs.size(); i++) {
+    float threshold = i < 2 ? FCW_THRESHOLD_5MS2_LOW : FCW_THRESHOLD_5MS2_HIGH;
+    above_fcw_threshold = above_fcw_threshold && ps.prev_brake_5ms2_probs[i] > threshold;
+  }
+  for (int i=0; i<ps.prev_brake_3ms2_probs.size(); i++) {
+    above_fcw_threshold = above_fcw_threshold && ps.prev_brake_3ms2_probs[i] > FCW_THRESHOLD_3MS2;
+  }
+
+  auto disengage = meta.initDisengagePredictions();
+  disengage.setT(to_kj_array_ptr(lat_long_t));
+  disengage.setGasDisengageProbs(to_kj_array_ptr(gas_disengage_sigmoid));
+  disengage.setBrakeDisengageProbs(to_kj_array_ptr(brake_disengage_sigmoid));
+  disengage.setSteerOverrideProbs(to_kj_array_ptr(steer_override_sigmoid));
+  disengage.setBrake3MetersPerSecondSquaredProbs(to_kj_array_ptr(brake_3ms2_sigmoid));
+  disengage.setBrake4MetersPerSecondSquaredProbs(to_kj_array_ptr(brake_4ms2_sigmoid));
+  disengage.setBrake5MetersPerSecondSquaredProbs(to_kj_array_ptr(brake_5ms2_sigmoid));
+
+  meta.setEngagedProb(sigmoid(meta_data.engaged_prob));
+  meta.setDesirePrediction(to_kj_array_ptr(desire_pred_softmax));
+  meta.setDesireState(to_kj_array_ptr(desire_state_softmax));
+  meta.setHardBrakePredicted(above_fcw_threshold);
+}
+
+template<size_t size>
+void fill_xyzt(cereal::ModelDataV2::XYZTData::Builder xyzt, const std::array<float, size> &t,
+               const std::array<float, size> &x, const std::array<float, size> &y, const std::array<float, size> &z) {
+  xyzt.setT(to_kj_array_ptr(t));
+  xyzt.setX(to_kj_array_ptr(x));
+  xyzt.setY(to_kj_array_ptr(y));
+  xyzt.setZ(to_kj_array_ptr(z));
+}
+
+template<size_t size>
+void fill_xyzt(cereal::ModelDataV2::XYZTData::Builder xyzt, const std::array<float, size> &t,
+               const std::array<float, size> &x, const std::array<float, size> &y, const std::array<float, size> &z,
+               const std::array<float, size> &x_std, const std::array<float, size> &y_std, const std::array<float, size> &z_std) {
+  fill_xyzt(xyzt, t, x, y, z);
+  xyzt.setXStd(to_kj_array_ptr(x_std));
+  xyzt.setYStd(to_kj_array_ptr(y_std));
+  xyzt.setZStd(to_kj_array_ptr(z_std));
+}
+
+void fill_plan(cereal::ModelDataV2::Builder &framed, const ModelOutputPlanPrediction &plan) {
+  std::array<float, TRAJECTORY_SIZE> pos_x, pos_y, pos_z;
+  std::array<float, TRAJECTORY_SIZE> pos_x_std, pos_y_std, pos_z_std;
+  std::array<float, TRAJECTORY_SIZE> vel_x, vel_y, vel_z;
+  std::array<float, TRAJECTORY_SIZE> rot_x, rot_y, rot_z;
+  std::array<float, TRAJECTORY_SIZE> rot_rate_x, rot_rate_y, rot_rate_z;
+
+  for(int i=0; i<TRAJECTORY_SIZE; i++) {
+    pos_x[i] = plan.mean[i].position.x;
+    pos_y[i] = plan.mean[i].position.y;
+    pos_z[i] = plan.mean[i].position.z;
+    pos_x_std[i] = exp(plan.std[i].position.x);
+    pos_y_std[i] = exp(plan.std[i].position.y);
+    pos_z_std[i] = exp(plan.std[i].position.z);
+    vel_x[i] = plan.mean[i].velocity.x;
+    vel_y[i] = plan.mean[i].velocity.y;
+    vel_z[i] = plan.mean[i].velocity.z;
+    rot_x[i] = plan.mean[i].rotation.x;
+    rot_y[i] = plan.mean[i].rotation.y;
+    rot_z[i] = plan.mean[i].rotation.z;
+    rot_rate_x[i] = plan.mean[i].rotation_rate.x;
+    rot_rate_y[i] = plan.mean[i].rotation_rate.y;
+    rot_rate_z[i] = plan.mean[i].rotation_rate.z;
+  }
+
+  fill_xyzt(framed.initPosition(), T_IDXS_FLOAT, pos_x, pos_y, pos_z, pos_x_std, pos_y_std, pos_z_std);
+  fill_xyzt(framed.initVelocity(), T_IDXS_FLOAT, vel_x, vel_y, vel_z);
+  fill_xyzt(framed.initOrientation(), T_IDXS_FLOAT, rot_x, rot_y, rot_z);
+  fill_xyzt(framed.initOrientationRate(), T_IDXS_FLOAT, rot_rate_x, rot_rate_y, rot_rate_z);
+}
+
+void fill_lane_lines(cereal::ModelDataV2::Builder &framed, const std::array<float, TRAJECTORY_SIZE> &plan_t,
+                     const ModelOutputLaneLines &lanes) {
+  std::array<float, TRAJECTORY_SIZE> left_far_y, left_far_z;
+  std::array<float, TRAJECTORY_SIZE> left_near_y, left_near_z;
+  std::array<float, TRAJECTORY_SIZE> right_near_y, right_near_z;
+  std::array<float, TRAJECTORY_SIZE> right_far_y, right_far_z;
+  for (int j=0; j<TRAJECTORY_SIZE; j++) {
+    left_far_y[j] = lanes.mean.left_far[j].y;
+    left_far_z[j] = lanes.mean.left_far[j].z;
+    left_near_y[j] = lanes.mean.left_near[j].y;
+    left_near_z[j] = lanes.mean.left_near[j].z;
+    right_near_y[j] = lanes.mean.right_near[j].y;
+    right_near_z[j] = lanes.mean.right_near[j].z;
+    right_far_y[j] = lanes.mean.right_far[j].y;
+    right_far_z[j] = lanes.mean.right_far[j].z;
+  }
+
+  auto lane_lines = framed.initLaneLines(4);
+  fill_xyzt(lane_lines[0], plan_t, X_IDXS_FLOAT, left_far_y, left_far_z);
+  fill_xyzt(lane_lines[1], plan_t, X_IDXS_FLOAT, left_near_y, left_near_z);
+  fill_xyzt(lane_lines[2], plan_t, X_IDXS_FLOAT, right_near_y, right_near_z);
+  fill_xyzt(lane_lines[3], plan_t, X_IDXS_FLOAT, right_far_y, right_far_z);
+
+  framed.setLaneLineStds({
+    exp(lanes.std.left_far[0].y),
+    exp(lanes.std.left_near[0].y),
+    exp(lanes.std.right_near[0].y),
+    exp(lanes.std.right_far[0].y),
+  });
+
+  framed.setLaneLineProbs({
+    sigmoid(lanes.prob.left_far.val),
+    sigmoid(lanes.prob.left_near.val),
+    sigmoid(lanes.prob.right_near.val),
+    sigmoid(lanes.prob.right_far.val),
+  });
+}
+
+void fill_road_edges(cereal::ModelDataV2::Builder &framed, const std::array<float, TRAJECTORY_SIZE> &plan_t,
+                     const ModelOutputRoadEdges &edges) {
+  std::array<float, TRAJECTORY_SIZE> left_y, left_z;
+  std::array<float, TRAJECTORY_SIZE> right_y, right_z;
+  for (int j=0; j<TRAJECTORY_SIZE; j++) {
+    left_y[j] = edges.mean.left[j].y;
+    left_z[j] = edges.mean.left[j].z;
+    right_y[j] = edges.mean.right[j].y;
+    right_z[j] = edges.mean.right[j].z;
+  }
+
+  auto road_edges = framed.initRoadEdges(2);
+  fill_xyzt(road_edges[0], plan_t, X_IDXS_FLOAT, left_y, left_z);
+  fill_xyzt(road_edges[1], plan_t, X_IDXS_FLOAT, right_y, right_z);
+
+  framed.setRoadEdgeStds({
+    exp(edges.std.left[0].y),
+    exp(edges.std.right[0].y),
+  });
+}
+
+void fill_model(cereal::ModelDataV2::Builder &framed, const ModelOutput &net_outputs, RefPublishState &ps) {
+  const auto &best_plan = net_outputs.plans.get_best_prediction();
+  std::array<float, TRAJECTORY_SIZE> plan_t;
+  std::fill_n(plan_t.data(), plan_t.size(), NAN);
+  plan_t[0] = 0.0;
+  for (int xidx=1, tidx=0; xidx<TRAJECTORY_SIZE; xidx++) {
+    // increment tidx until we find an element that's further away than the current xidx
+    for (int next_tid = tidx + 1; next_tid < TRAJECTORY_SIZE && best_plan.mean[next_tid].position.x < X_IDXS[xidx]; next_tid++) {
+      tidx++;
+    }
+    if (tidx == TRAJECTORY_SIZE - 1) {
+      // if the Plan doesn't extend far enough, set plan_t to the max value (10s), then break
+      plan_t[xidx] = T_IDXS[TRAJECTORY_SIZE - 1];
+      break;
+    }
+
+    // interpolate to find `t` for the current xidx
+    float current_x_val = best_plan.mean[tidx].position.x;
+    float next_x_val = best_plan.mean[tidx+1].position.x;
+    float p = (X_IDXS[xidx] - current_x_val) / (next_x_val - current_x_val);
+    plan_t[xidx] = p * T_IDXS[tidx+1] + (1 - p) * T_IDXS[tidx];
+  }
+
+  fill_plan(framed, best_plan);
+  fill_lane_lines(framed, plan_t, net_outputs.lane_lines);
+  fill_road_edges(framed, plan_t, net_outputs.road_edges);
+
+  // meta
+  fill_meta(framed.initMeta(), net_outputs.meta, ps);
+
+  // leads
+  auto leads = framed.initLeadsV3(LEAD_MHP_SELECTION);
+  std::array<float, LEAD_MHP_SELECTION> t_offsets = {0.0, 2.0, 4.0};
+  for (int i=0; i<LEAD_MHP_SELECTION; i++) {
+    fill_lead(leads[i], net_outputs.leads, i, t_offsets[i]);
+  }
+}
+
+void fill_model_msg(MessageBuilder &msg, RefPublishState &ps, uint32_t vipc_frame_id, uint32_t frame_id, float frame_drop,
+                    const ModelOutput &net_outputs, uint64_t timestamp_eof,
+                    float model_execution_time, kj::ArrayPtr<const float> raw_pred, const bool valid) {
+  const uint32_t frame_age = (frame_id > vipc_frame_id) ? (frame_id - vipc_frame_id) : 0;
+  auto framed = msg.initEvent(valid).initModelV2();
+  framed.setFrameId(vipc_frame_id);
+  framed.setFrameAge(frame_age);
+  framed.setFrameDropPerc(frame_drop * 100);
+  framed.setTimestampEof(timestamp_eof);
+  framed.setModelExecutionTime(model_execution_time);
+  if (send_raw_pred) {
+    framed.setRawPredictions(raw_pred.asBytes());
+  }
+  fill_model(framed, net_outputs, ps);
+}
+
+}  // namespace ref
+
+// model outputs around zero like the logits of the model, with runs of hard braking for the fcw
+std::vector<std::array<float, NET_OUTPUT_SIZE>> test_outputs(int frames) {
+  std::mt19937 rng(frames);
+  std::normal_distribution<float> dist(0.0, 2.0);
+  std::vector<std::array<float, NET_OUTPUT_SIZE>> outputs(frames);
+  for (int f = 0; f < frames; ++f) {
+    for (float &v : outputs[f]) v = dist(rng);
+
+    ModelOutput *out = (ModelOutput *)outputs[f].data();
+    if (f % 40 >= 20 && f % 40 < 30) {
+      *const_cast<float *>(&out->meta.disengage_prob[0].brake_5ms2) = 5.0;
+      *const_cast<float *>(&out->meta.disengage_prob[0].brake_3ms2) = 5.0;
+    }
+    // the plan moves forward, so lane lines get a time for most points
+    auto &plans = const_cast<ModelOutputPlans &>(out->plans);
+    for (auto &p : plans.prediction) {
+      for (int i = 0; i < TRAJECTORY_SIZE; ++i) {
+        p.mean[i].position.x = X_IDXS[i] * (1.0 + 0.1 * dist(rng));
+      }
+      std::sort(&p.mean[0], &p.mean[TRAJECTORY_SIZE], [](auto &a, auto &b) { return a.position.x < b.position.x; });
+    }
+  }
+  return outputs;
+}
+
+// every field of the two messages, floats within a relative 1e-5
+bool equal(capnp::DynamicValue::Reader a, capnp::DynamicValue::Reader b, const std::string &path) {
+  switch (a.getType()) {
+    case capnp::DynamicValue::FLOAT: {
+      const double x = a.as<double>(), y = b.as<double>();
+      if ((std::isnan(x) && std::isnan(y)) || std::abs(x - y) <= 1e-5 * std::max(1.0, std::abs(y))) return true;
+      printf("%s: %g, expected %g\n", path.c_str(), x, y);
+      return false;
+    }
+    case capnp::DynamicValue::LIST: {
+      auto la = a.as<capnp::DynamicList>(), lb = b.as<capnp::DynamicList>();
+      if (la.size() != lb.size()) {
+        printf("%s: %u elements, expected %u\n", path.c_str(), la.size(), lb.size());
+        return false;
+      }
+      bool ok = true;
+      for (int i = 0; i < la.size(); ++i) {
+        ok &= equal(la[i], lb[i], path + "[" + std::to_string(i) + "]");
+      }
+      return ok;
+    }
+    case capnp::DynamicValue::STRUCT: {
+      auto sa = a.as<capnp::DynamicStruct>(), sb = b.as<capnp::DynamicStruct>();
+      bool ok = true;
+      for (auto field : sa.getSchema().getNonUnionFields()) {
+        ok &= equal(sa.get(field), sb.get(field), path + "." + field.getProto().getName().cStr());
+      }
+      KJ_IF_MAYBE(field, sa.which()) {
+        ok &= equal(sa.get(*field), sb.get(*field), path + "." + field->getProto().getName().cStr());
+      }
+      return ok;
+    }
+    case capnp::DynamicValue::BOOL:
+      if (a.as<bool>() == b.as<bool>()) return true;
+      break;
+    case capnp::DynamicValue::INT:
+      if (a.as<int64_t>() == b.as<int64_t>()) return true;
+      break;
+    case capnp::DynamicValue::UINT:
+      if (a.as<uint64_t>() == b.as<uint64_t>()) return true;
+      break;
+    case capnp::DynamicValue::ENUM:
+      if (a.as<capnp::DynamicEnum>().getRaw() == b.as<capnp::DynamicEnum>().getRaw()) return true;
+      break;
+    case capnp::DynamicValue::DATA:
+      if (a.as<capnp::Data>() == b.as<capnp::Data>()) return true;
+      break;
+    default:
+      return true;
+  }
+  printf("%s differs\n", path.c_str());
+  return false;
+}
+
+// exp_n and sigmoid_n against expf over the range the clamp keeps, a NaN output stays NaN
+// exp_n clamps its input to +-88.3763: past it, it saturates at the largest result instead of
+// going to inf, and is 0 below it. down to the clamp it may flush results under FLT_MIN to 0
+bool test_activations() {
+  constexpr float clamp = 88.3762626647949f, saturated = 0x1.6a0948p+127f;
+  std::vector<float> input, exp_out, sigmoid_out;
+  for (float x = -100.f; x < 100.f; x += 0.37f) input.push_back(x);
+  for (float x : {clamp, 88.38f, 89.f, 1e10f, INFINITY}) {
+    input.push_back(x);
+    input.push_back(-x);
+  }
+  input.push_back(NAN);
+  exp_out.resize(input.size());
+  sigmoid_out.resize(input.size());
+  exp_n(input.data(), exp_out.data(), input.size());
+  sigmoid_n(input.data(), sigmoid_out.data(), input.size());
+
+  bool passed = std::isnan(exp_out.back()) && std::isnan(sigmoid_out.back());
+  for (int i = 0; i + 1 < input.size(); ++i) {
+    const float x = input[i];
+    if (x > clamp) {
+      passed &= exp_out[i] == saturated;
+    } else if (x < -clamp) {
+      passed &= exp_out[i] == 0;
+    } else {
+      passed &= std::abs(exp_out[i] - expf(x)) <= std::max(3e-7f * expf(x), FLT_MIN);
+    }
+    passed &= std::abs(sigmoid_out[i] - sigmoid(x)) <= 3e-7;
+  }
+  printf("exp_n and sigmoid_n: %s\n", passed ? "ok" : "differ");
+  return passed;
+}
+
+template <typename F>
+double time_us(F fn) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < BENCHMARK_FRAMES; ++i) fn(i);
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / BENCHMARK_FRAMES;
+}
+
+int main() {
+  const auto outputs = test_outputs(TEST_FRAMES);
+  auto output = [&](int i) -> const ModelOutput & { return *(const ModelOutput *)outputs[i % outputs.size()].data(); };
+  auto raw_pred = [&](int i) { return kj::ArrayPtr<const float>(outputs[i % outputs.size()].data(), NET_OUTPUT_SIZE); };
+
+  PublishState ps = {};
+  ref::RefPublishState ref_ps = {};
+  bool passed = test_activations();
+  int hard_brakes = 0;
+  for (int i = 0; i < TEST_FRAMES; ++i) {
+    fill_model_msg(ps, i, i, 0.1, output(i), 1000 * i, 0.05, raw_pred(i), true);
+    auto bytes = ps.msg.toBytes();
+    kj::ArrayPtr<const capnp::word> words((const capnp::word *)bytes.begin(), bytes.size() / sizeof(capnp::word));
+    capnp::FlatArrayMessageReader reader(words);
+
+    MessageBuilder ref_msg;
+    ref::fill_model_msg(ref_msg, ref_ps, i, i, 0.1, output(i), 1000 * i, 0.05, raw_pred(i), true);
+
+    auto model = reader.getRoot<cereal::Event>().getModelV2();
+    auto ref_model = ref_msg.getRoot<cereal::Event>().asReader().getModelV2();
+    passed &= equal(capnp::toDynamic(model), capnp::toDynamic(ref_model), "modelV2");
+    hard_brakes += ref_model.getMeta().getHardBrakePredicted();
+  }
+  printf("%d frames compared, %d with a hard brake predicted\n", TEST_FRAMES, hard_brakes);
+  passed &= hard_brakes > 0;
+
+  // the sizes keep the messages from being optimized away
+  size_t ref_size = 0, size = 0;
+  const double ref_us = time_us([&](int i) {
+    MessageBuilder msg;
+    ref::fill_model_msg(msg, ref_ps, i, i, 0.1, output(i), 1000 * i, 0.05, raw_pred(i), true);
+    ref_size += msg.toBytes().size();
+  });
+  const double us = time_us([&](int i) {
+    fill_model_msg(ps, i, i, 0.1, output(i), 1000 * i, 0.05, raw_pred(i), true);
+    size += ps.msg.toBytes().size();
+  });
+  printf("model_publish without sending: %.1f us/frame, was %.1f us/frame (%zu bytes, was %zu)\n", us, ref_us,
+         size / BENCHMARK_FRAMES, ref_size / BENCHMARK_FRAMES);
+
+  printf(passed ? "all tests passed\n" : "TEST FAILED\n");
+  return passed ? 0 : -1;
+}
@@ -0,0 +1,214 @@
+// saves small models as a .thneed the way thneed/compile does, loads them back and replays them on
+// whichever OpenCL device there is, pocl included, against the same models on the CPU. also checks
+// that profiling gives a time for every kernel
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "selfdrive/common/clutil.h"
+#include "selfdrive/common/tests/cpu_port_test.h"
+#include "selfdrive/modeld/thneed/thneed.h"
+
+extern map<cl_program, string> g_program_source;
+cl_int thneed_clSetKernelArg(cl_kernel kernel, cl_uint arg_index, size_t arg_size, const void *arg_value);
+
+const int N = 1024;
+const size_t LOCAL_SIZE = 64;
+// the images are N floats as RGBA halfs
+const int IMAGE_WIDTH = 64, IMAGE_HEIGHT = N / 4 / IMAGE_WIDTH;
+
+// the input and output kernels have the names and args find_inputs_outputs looks for
+const char *MODEL_SOURCE = R"(
+__kernel void zero_pad_image_float(__global const float *input, __global float *output) {
+  const int i = get_global_id(0);
+  output[i] = input[i];
+}
+__kernel void scale_bias(__global const float *input, __global const float *weights, __global const float *biases, __global float *output) {
+  const int i = get_global_id(0);
+  output[i] = input[i] * weights[i] + biases[i];
+}
+__kernel void image2d_to_buffer_float(__global const float *input, __global float *output) {
+  const int i = get_global_id(0);
+  output[i] = max(input[i], 0.0f);
+}
+)";
+
+// a kernel writes a buffer as halfs, the next one reads it as an image made on that buffer and
+// scales it by weights that are an image too, like SNPE's models
+const char *IMAGE_MODEL_SOURCE = R"(
+__kernel void zero_pad_image_float(__global const float *input, __global half *output) {
+  const int i = get_global_id(0);
+  vstore_half(input[i], i, output);
+}
+__kernel void image2d_to_buffer_float(__read_only image2d_t input, __read_only image2d_t weights, __global float *output) {
+  const sampler_t smp = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_NONE | CLK_FILTER_NEAREST;
+  const int i = get_global_id(0);
+  const int2 pos = (int2)(i % IMAGE_WIDTH, i / IMAGE_WIDTH);
+  vstore4(read_imagef(input, smp, pos) * read_imagef(weights, smp, pos), i, output);
+}
+)";
+
+// what SNPE does under thneed's interceptors: set the args of a kernel and enqueue it
+void record_kernel(Thneed &thneed, cl_program program, const char *name, const vector<cl_mem> &args, size_t global_work_size = N) {
+  cl_kernel kernel = CL_CHECK_ERR(clCreateKernel(program, name, &err));
+  for (int i = 0; i < args.size(); i++) {
+    CL_CHECK(thneed_clSetKernelArg(kernel, i, sizeof(cl_mem), &args[i]));
+  }
+  thneed.kq.push_back(std::make_shared<CLQueuedKernel>(&thneed, kernel, 1, &global_work_size, &LOCAL_SIZE));
+}
+
+Thneed *new_thneed(ClEnv &cl) {
+  Thneed *thneed = new Thneed(false, true);
+  thneed->context = cl.ctx;
+  thneed->device_id = cl.device_id;
+  thneed->command_queue = cl.q;
+  return thneed;
+}
+
+// loads a saved model and replays it, plain and profiled
+bool replay(ClEnv &cl, const char *path, int kernels, vector<float> &input, const vector<float> &expected, float max_diff) {
+  std::unique_ptr<Thneed> thneed(new_thneed(cl));
+  thneed->load(path);
+  thneed->clexec();
+  thneed->find_inputs_outputs();
+  assert(thneed->kq.size() == kernels);
+  assert(thneed->input_sizes.size() == 1 && thneed->input_sizes[0] == N * sizeof(float));
+  assert(thneed->output != NULL);
+
+  vector<float> output(N);
+  float *inputs[] = {input.data()};
+  thneed->execute(inputs, output.data());
+  float diff = 0;
+  for (int i = 0; i < N; i++) {
+    diff = std::max(diff, std::abs(output[i] - expected[i]));
+  }
+  bool passed = diff <= max_diff;
+  printf("%s: max diff %g\n", path, diff);
+
+  // profiled, same output
+  std::fill(output.begin(), output.end(), 0.f);
+  thneed->copy_inputs(inputs);
+  const vector<double> ms = thneed->clprofile();
+  thneed->copy_output(output.data());
+  passed &= ms.size() == thneed->kq.size();
+  for (int i = 0; i < ms.size(); i++) {
+    printf("  %s: %.3f ms\n", thneed->kq[i]->name.c_str(), ms[i]);
+    passed &= ms[i] >= 0;
+  }
+  for (int i = 0; i < N; i++) {
+    passed &= std::abs(output[i] - expected[i]) <= max_diff;
+  }
+  remove(path);
+  return passed;
+}
+
+bool test_buffers(ClEnv &cl, std::mt19937 &rng) {
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+  vector<float> input(N), weights(N), biases(N), expected(N);
+  for (int i = 0; i < N; i++) {
+    input[i] = dist(rng), weights[i] = dist(rng), biases[i] = dist(rng);
+    expected[i] = std::max(input[i] * weights[i] + biases[i], 0.f);
+  }
+
+  const char *path = "/tmp/thneed_replay_test.thneed";
+  {
+    std::unique_ptr<Thneed> thneed(new_thneed(cl));
+    cl_program program = cl_program_from_source(cl.ctx, cl.device_id, MODEL_SOURCE, "-cl-kernel-arg-info");
+    g_program_source[program] = MODEL_SOURCE;
+
+    cl_mem in = cl.create(N * sizeof(float)), padded = cl.create(N * sizeof(float));
+    cl_mem w = cl.create(N * sizeof(float), weights.data()), b = cl.create(N * sizeof(float), biases.data());
+    cl_mem scaled = cl.create(N * sizeof(float)), out = cl.create(N * sizeof(float));
+    record_kernel(*thneed, program, "zero_pad_image_float", {in, padded});
+    record_kernel(*thneed, program, "scale_bias", {padded, w, b, scaled});
+    record_kernel(*thneed, program, "image2d_to_buffer_float", {scaled, out});
+    thneed->save(path);
+  }
+  return replay(cl, path, 3, input, expected, 1e-5);
+}
+
+// the image reads what the kernel before it wrote to the buffer, so the image must be on the buffer
+bool test_image_from_buffer(ClEnv &cl, std::mt19937 &rng) {
+  size_t size = 0;
+  CL_CHECK(clGetDeviceInfo(cl.device_id, CL_DEVICE_EXTENSIONS, 0, NULL, &size));
+  string extensions(size, '\0');
+  CL_CHECK(clGetDeviceInfo(cl.device_id, CL_DEVICE_EXTENSIONS, size, extensions.data(), NULL));
+  char version[0x100] = {};
+  clGetDeviceInfo(cl.device_id, CL_DEVICE_VERSION, sizeof(version) - 1, version, NULL);
+  cl_bool image_support = CL_FALSE;
+  clGetDeviceInfo(cl.device_id, CL_DEVICE_IMAGE_SUPPORT, sizeof(image_support), &image_support, NULL);
+  if (!image_support || (extensions.find("cl_khr_image2d_from_buffer") == string::npos && strncmp(version, "OpenCL 2", 8) < 0)) {
+    printf("no image2d from buffer, skipping the image model\n");
+    return true;
+  }
+
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+  vector<float> input(N), weights(N), expected(N);
+  vector<cl_half> weights_half(N);
+  for (int i = 0; i < N; i++) {
+    input[i] = dist(rng), weights[i] = dist(rng);
+    expected[i] = input[i] * weights[i];
+  }
+  // the weights are stored as halfs, converted on the device
+  {
+    const char *to_half = "__kernel void to_half(__global const float *in, __global half *out) { vstore_half(in[get_global_id(0)], get_global_id(0), out); }";
+    cl_program program = cl_program_from_source(cl.ctx, cl.device_id, to_half);
+    cl_kernel kernel = CL_CHECK_ERR(clCreateKernel(program, "to_half", &err));
+    cl_mem in = cl.create(N * sizeof(float), weights.data()), out = cl.create(N * sizeof(cl_half));
+    CL_CHECK(clSetKernelArg(kernel, 0, sizeof(cl_mem), &in));
+    CL_CHECK(clSetKernelArg(kernel, 1, sizeof(cl_mem), &out));
+    const size_t work_size = N;
+    CL_CHECK(clEnqueueNDRangeKernel(cl.q, kernel, 1, NULL, &work_size, NULL, 0, NULL, NULL));
+    CL_CHECK(clEnqueueReadBuffer(cl.q, out, CL_TRUE, 0, N * sizeof(cl_half), weights_half.data(), 0, NULL, NULL));
+  }
+
+  const char *path = "/tmp/thneed_replay_test_image.thneed";
+  {
+    std::unique_ptr<Thneed> thneed(new_thneed(cl));
+    const string args = "-cl-kernel-arg-info -DIMAGE_WIDTH=" + std::to_string(IMAGE_WIDTH);
+    cl_program program = cl_program_from_source(cl.ctx, cl.device_id, IMAGE_MODEL_SOURCE, args.c_str());
+    g_program_source[program] = "#define IMAGE_WIDTH " + std::to_string(IMAGE_WIDTH) + "\n" + IMAGE_MODEL_SOURCE;
+
+    auto image_on = [&](cl_mem buf) {
+      cl_image_format format = {CL_RGBA, CL_HALF_FLOAT};
+      cl_image_desc desc = {};
+      desc.image_type = CL_MEM_OBJECT_IMAGE2D;
+      desc.image_width = IMAGE_WIDTH;
+      desc.image_height = IMAGE_HEIGHT;
+      desc.image_row_pitch = IMAGE_WIDTH * 4 * sizeof(cl_half);
+      desc.buffer = buf;
+      return CL_CHECK_ERR(clCreateImage(cl.ctx, CL_MEM_READ_WRITE, &format, &desc, NULL, &err));
+    };
+    cl_mem in = cl.create(N * sizeof(float)), padded = cl.create(N * sizeof(cl_half));
+    cl_mem w = cl.create(N * sizeof(cl_half), weights_half.data()), out = cl.create(N * sizeof(float));
+    record_kernel(*thneed, program, "zero_pad_image_float", {in, padded});
+    record_kernel(*thneed, program, "image2d_to_buffer_float", {image_on(padded), image_on(w), out}, N / 4);
+    thneed->save(path);
+  }
+  // the input is rounded to half on the way
+  return replay(cl, path, 2, input, expected, 2e-3);
+}
+
+int main() {
+  // clprofile needs the events of a profiling queue
+  ClEnv cl(CL_QUEUE_PROFILING_ENABLE);
+  if (!cl.device_id) {
+    printf("no OpenCL device, skipping\n");
+    return 0;
+  }
+
+  std::mt19937 rng(0);
+  bool passed = test_buffers(cl, rng);
+  passed &= test_image_from_buffer(cl, rng);
+
+  printf(passed ? "all tests passed\n" : "TEST FAILED\n");
+  return passed ? 0 : -1;
+}
@@ -0,0 +1,97 @@
+// compares the CPU frame preparation (transforms/transform_cpu.cc) against transform.cl
+// and loadyuv.cl, and benchmarks both at 1928x1208
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#include "selfdrive/common/tests/cpu_port_test.h"
+#include "selfdrive/modeld/transforms/loadyuv.h"
+#include "selfdrive/modeld/transforms/transform.h"
+#include "selfdrive/modeld/transforms/transform_cpu.h"
+
+const int MODEL_WIDTH = 512, MODEL_HEIGHT = 256;
+const int MODEL_FRAME_SIZE = MODEL_WIDTH * MODEL_HEIGHT * 3 / 2;
+const int BENCHMARK_FRAMES = 50;
+
+// model pixels to frame pixels: a crop around the center scaled by `scale`, with a perspective term
+mat3 test_projection(int width, int height, float scale, float perspective) {
+  return (mat3){{
+    scale, 0.0f, width / 2.0f - scale * MODEL_WIDTH / 2,
+    0.0f, scale, height / 2.0f - scale * MODEL_HEIGHT / 2,
+    0.0f, perspective, 1.0f,
+  }};
+}
+
+// the kernels' float math isn't bit exact across devices (division is allowed 2.5 ulp, multiply-adds
+// may be fused), which moves a sample position by 1/32 pixel now and then. that changes the sample
+// by up to 255/32, the rest is integer math. so no value is further off than that, and few are off
+const float MAX_DIFF = ceilf(255.f / 32);
+
+bool test_transform(ClEnv &cl, int width, int height, const mat3 &projection, bool noise, bool benchmark) {
+  const auto yuv = test_frame(width, height, noise);
+
+  std::vector<float> cpu_out(MODEL_FRAME_SIZE);
+  TransformCpu transform_cpu(MODEL_WIDTH, MODEL_HEIGHT);
+  transform_cpu.run(yuv.data(), width, height, projection, cpu_out.data());
+
+  Transform transform;
+  LoadYUVState loadyuv;
+  transform_init(&transform, cl.ctx, cl.device_id);
+  loadyuv_init(&loadyuv, cl.ctx, cl.device_id, MODEL_WIDTH, MODEL_HEIGHT);
+  cl_mem yuv_cl = cl.create(yuv.size(), yuv.data());
+  cl_mem y_cl = cl.create(MODEL_WIDTH * MODEL_HEIGHT);
+  cl_mem u_cl = cl.create((MODEL_WIDTH / 2) * (MODEL_HEIGHT / 2));
+  cl_mem v_cl = cl.create((MODEL_WIDTH / 2) * (MODEL_HEIGHT / 2));
+  cl_mem out_cl = cl.create(MODEL_FRAME_SIZE * sizeof(float));
+
+  // what ModelFrame::prepare does, with the read back
+  std::vector<float> cl_out(MODEL_FRAME_SIZE);
+  auto run_cl = [&]() {
+    transform_queue(&transform, cl.q, yuv_cl, width, height, y_cl, u_cl, v_cl, MODEL_WIDTH, MODEL_HEIGHT, projection);
+    loadyuv_queue(&loadyuv, cl.q, y_cl, u_cl, v_cl, out_cl);
+    CL_CHECK(clEnqueueReadBuffer(cl.q, out_cl, CL_TRUE, 0, MODEL_FRAME_SIZE * sizeof(float), cl_out.data(), 0, NULL, NULL));
+  };
+  run_cl();
+
+  float max_diff = 0;
+  int off = 0;
+  for (int i = 0; i < MODEL_FRAME_SIZE; ++i) {
+    const float diff = std::abs(cpu_out[i] - cl_out[i]);
+    max_diff = std::max(max_diff, diff);
+    off += diff > 0;
+  }
+  const bool passed = max_diff <= MAX_DIFF && off <= MODEL_FRAME_SIZE / 1000;
+  printf("transform %dx%d%s: max diff %.0f, %d of %d values off\n", width, height,
+         noise ? " noise" : "", max_diff, off, MODEL_FRAME_SIZE);
+  if (benchmark) {
+    printf("  cpu %.2f ms/frame, opencl %.2f ms/frame\n",
+           time_ms(BENCHMARK_FRAMES, [&] { transform_cpu.run(yuv.data(), width, height, projection, cpu_out.data()); }),
+           time_ms(BENCHMARK_FRAMES, run_cl));
+  }
+
+  for (cl_mem m : {yuv_cl, y_cl, u_cl, v_cl, out_cl}) {
+    CL_CHECK(clReleaseMemObject(m));
+  }
+  transform_destroy(&transform);
+  loadyuv_destroy(&loadyuv);
+  return passed;
+}
+
+int main() {
+  chdir_to_daemon();
+  ClEnv cl;
+  if (!cl.device_id) {
+    printf("no OpenCL device, skipping\n");
+    return 0;
+  }
+
+  bool passed = true;
+  // tici and eon road cameras, and a crop reaching past the frame
+  passed &= test_transform(cl, 1928, 1208, test_projection(1928, 1208, 2.5f, 0.0f), false, true);
+  passed &= test_transform(cl, 1928, 1208, test_projection(1928, 1208, 2.5f, 2e-4f), true, false);
+  passed &= test_transform(cl, 1164, 874, test_projection(1164, 874, 1.5f, -3e-4f), false, false);
+  passed &= test_transform(cl, 1164, 874, test_projection(1164, 874, 3.0f, 0.0f), true, false);
+  return test_result(passed);
+}
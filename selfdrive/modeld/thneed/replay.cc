@@ -0,0 +1,128 @@
+// Replays a .thneed on any OpenCL 1.2 device, e.g. pocl on a PC, and profiles it: the time of
+// each run and which kernels it goes to. Inputs are random, the output can be written out to
+// compare runs of a model across devices or changes.
+//
+// usage: replay [-n iterations] [-t top kernels] [-o output file] <model.thneed>
+// the .thneed needs the kernel sources, i.e. made by thneed/compile without --binary. binaries
+// only load on the GPU they were built for
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "selfdrive/common/clutil.h"
+#include "selfdrive/common/histogram.h"
+#include "selfdrive/common/timing.h"
+#include "selfdrive/modeld/thneed/thneed.h"
+
+const int WARMUP_RUNS = 5;
+
+struct KernelTime {
+  string name;
+  int launches = 0;
+  double ms = 0;  // summed over the iterations
+};
+
+int main(int argc, char **argv) {
+  int iterations = 100, top = 20;
+  string model_path, output_path;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "-n" && i + 1 < argc) iterations = std::max(1, atoi(argv[++i]));
+    else if (arg == "-t" && i + 1 < argc) top = std::max(1, atoi(argv[++i]));
+    else if (arg == "-o" && i + 1 < argc) output_path = argv[++i];
+    else model_path = arg;
+  }
+  if (model_path.empty()) {
+    fprintf(stderr, "usage: %s [-n iterations] [-t top kernels] [-o output file] <model.thneed>\n", argv[0]);
+    return 1;
+  }
+
+  Thneed thneed(true, true);
+  char device_name[0x100] = {};
+  clGetDeviceInfo(thneed.device_id, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL);
+  thneed.load(model_path.c_str());
+  thneed.clexec();
+  thneed.find_inputs_outputs();
+  if (thneed.output == NULL) return 1;
+
+  std::mt19937 rng(0);
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+  vector<vector<float>> inputs;
+  vector<float *> input_ptrs;
+  for (size_t sz : thneed.input_sizes) {
+    inputs.emplace_back(sz / sizeof(float));
+    std::generate(inputs.back().begin(), inputs.back().end(), [&] { return dist(rng); });
+    input_ptrs.push_back(inputs.back().data());
+  }
+  size_t output_size = 0;
+  CL_CHECK(clGetMemObjectInfo(thneed.output, CL_MEM_SIZE, sizeof(output_size), &output_size, NULL));
+  vector<float> output(output_size / sizeof(float));
+
+  for (int i = 0; i < WARMUP_RUNS; i++) {
+    thneed.execute(input_ptrs.data(), output.data());
+  }
+
+  // a run is the inputs in, the kernels and the output back, like ThneedModel::execute
+  LatencyHistogram runs;
+  vector<double> kernel_ms(thneed.kq.size());
+  for (int i = 0; i < iterations; i++) {
+    const double t1 = millis_since_boot();
+    thneed.copy_inputs(input_ptrs.data());
+    const vector<double> ms = thneed.clprofile();
+    thneed.copy_output(output.data());
+    runs.add(millis_since_boot() - t1);
+    for (int k = 0; k < ms.size(); k++) kernel_ms[k] += ms[k];
+  }
+
+  double device_ms = 0;
+  std::map<string, KernelTime> by_name;
+  for (int k = 0; k < thneed.kq.size(); k++) {
+    KernelTime &kt = by_name[thneed.kq[k]->name];
+    kt.name = thneed.kq[k]->name;
+    kt.launches++;
+    kt.ms += kernel_ms[k];
+    device_ms += kernel_ms[k];
+  }
+  vector<KernelTime> kernels;
+  for (auto &[name, kt] : by_name) kernels.push_back(kt);
+  std::sort(kernels.begin(), kernels.end(), [](auto &a, auto &b) { return a.ms > b.ms; });
+  vector<int> launches(thneed.kq.size());
+  for (int k = 0; k < launches.size(); k++) launches[k] = k;
+  std::sort(launches.begin(), launches.end(), [&](int a, int b) { return kernel_ms[a] > kernel_ms[b]; });
+
+  printf("%s on %s: %lu kernels, %d runs\n", model_path.c_str(), device_name, thneed.kq.size(), iterations);
+  printf("run: mean %.2f ms, p50 %.2f, p90 %.2f, p99 %.2f, max %.2f, %.2f ms of it in kernels\n",
+         runs.mean(), runs.percentile(50), runs.percentile(90), runs.percentile(99), runs.max(), device_ms / iterations);
+
+  printf("\ntop kernels:\n%10s %7s %9s  %s\n", "ms/run", "share", "launches", "name");
+  for (int i = 0; i < std::min<int>(top, kernels.size()); i++) {
+    const KernelTime &kt = kernels[i];
+    printf("%10.3f %6.1f%% %9d  %s\n", kt.ms / iterations, 100. * kt.ms / device_ms, kt.launches, kt.name.c_str());
+  }
+
+  printf("\ntop launches:\n%10s %7s %6s  %-48s %s\n", "ms/run", "share", "index", "name", "global work size");
+  for (int i = 0; i < std::min<int>(top, launches.size()); i++) {
+    const CLQueuedKernel &k = *thneed.kq[launches[i]];
+    string gws;
+    for (int d = 0; d < k.work_dim; d++) gws += (d > 0 ? " x " : "") + std::to_string(k.global_work_size[d]);
+    printf("%10.3f %6.1f%% %6d  %-48s %s\n", kernel_ms[launches[i]] / iterations, 100. * kernel_ms[launches[i]] / device_ms,
+           launches[i], k.name.c_str(), gws.c_str());
+  }
+
+  if (!output_path.empty()) {
+    FILE *f = fopen(output_path.c_str(), "wb");
+    const bool written = f != NULL && fwrite(output.data(), sizeof(float), output.size(), f) == output.size();
+    if (f != NULL) fclose(f);
+    if (!written) {
+      fprintf(stderr, "failed to write %s\n", output_path.c_str());
+      return 1;
+    }
+    printf("\nwrote %lu output values to %s\n", output.size(), output_path.c_str());
+  }
+  return 0;
+}
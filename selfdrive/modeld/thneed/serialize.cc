@@ -1,4 +1,5 @@
 #include <cassert>
+#include <cstdlib>
 #include <set>
 
 #include "json11.hpp"
@@ -22,6 +23,11 @@ void Thneed::load(const char *filename) {
   real_mem[NULL] = NULL;
 
   int ptr = sizeof(int)+jsz;
+  bool image_buffers = true;
+  // without image2d from buffer: the buffers whose images got memory of their own, with how many
+  // images each. buffers loaded with weights, whose data is copied into their images
+  map<cl_mem, int> split_buffers;
+  std::set<cl_mem> loaded_buffers;
   for (auto &obj : jdat["objects"].array_items()) {
     auto mobj = obj.object_items();
     int sz = mobj["size"].int_value();
@@ -35,6 +41,7 @@ void Thneed::load(const char *filename) {
       if (mobj["needs_load"].bool_value()) {
         //printf("loading %p %d @ 0x%X\n", clbuf, sz, ptr);
         clbuf = clCreateBuffer(context, CL_MEM_COPY_HOST_PTR | CL_MEM_READ_WRITE, sz, &buf[ptr], NULL);
+        loaded_buffers.insert(clbuf);
         ptr += sz;
       } else {
         clbuf = clCreateBuffer(context, CL_MEM_READ_WRITE, sz, NULL, NULL);
@@ -54,7 +61,29 @@ void Thneed::load(const char *filename) {
       format.image_channel_order = CL_RGBA;
       format.image_channel_data_type = CL_HALF_FLOAT;
 
-      clbuf = clCreateImage(context, CL_MEM_READ_WRITE, &format, &desc, NULL, NULL);
+      cl_int err;
+      cl_mem image = clCreateImage(context, CL_MEM_READ_WRITE, &format, &desc, NULL, &err);
+      if (err != CL_SUCCESS && desc.image_type == CL_MEM_OBJECT_IMAGE2D) {
+        // an image2d on a buffer needs OpenCL 2.0 or cl_khr_image2d_from_buffer. without them it gets
+        // its own memory, which is the same as long as nothing else uses the buffer under it. that's
+        // checked once the kernels are loaded
+        if (image_buffers) printf("Thneed::load: no image2d from buffer (%s), images get their own memory\n", cl_get_error_string(err));
+        image_buffers = false;
+        split_buffers[clbuf]++;
+        desc.image_row_pitch = 0;
+        desc.buffer = NULL;
+        image = clCreateImage(context, CL_MEM_READ_WRITE, &format, &desc, NULL, &err);
+        assert(image != NULL);
+        if (loaded_buffers.count(clbuf)) {
+          // the weights, row by row as the buffer rows are row_pitch apart
+          const size_t row_pitch = mobj["row_pitch"].int_value();
+          for (size_t y = 0; y < desc.image_height; y++) {
+            const size_t origin[3] = {0, y, 0}, region[3] = {desc.image_width, 1, 1};
+            CL_CHECK(clEnqueueCopyBufferToImage(command_queue, clbuf, image, y * row_pitch, origin, region, 0, NULL, NULL));
+          }
+        }
+      }
+      clbuf = image;
       assert(clbuf != NULL);
     }
 
@@ -64,7 +93,8 @@ void Thneed::load(const char *filename) {
   map<string, cl_program> g_programs;
   for (const auto &[name, source] : jdat["programs"].object_items()) {
     if (record & THNEED_DEBUG) printf("building %s with size %zu\n", name.c_str(), source.string_value().size());
-    g_programs[name] = cl_program_from_source(context, device_id, source.string_value());
+    // find_inputs_outputs goes by the names of the args, which not every OpenCL runtime keeps by default
+    g_programs[name] = cl_program_from_source(context, device_id, source.string_value(), "-cl-kernel-arg-info");
   }
 
   for (auto &obj : jdat["binaries"].array_items()) {
@@ -103,6 +133,22 @@ void Thneed::load(const char *filename) {
     kq.push_back(kk);
   }
 
+  // a kernel writing the buffer under an image and another reading the image, or two images of
+  // one buffer, would see different memory and silently compute something else
+  for (auto &[clbuf, images] : split_buffers) {
+    bool used = images > 1 && !loaded_buffers.count(clbuf);
+    for (auto &k : kq) {
+      for (auto &arg : k->args) {
+        used |= arg.size() == sizeof(cl_mem) && *(cl_mem*)arg.data() == clbuf;
+      }
+    }
+    if (used) {
+      printf("Thneed::load: %s uses the buffers under its images, which needs image2d from buffer\n", filename);
+      assert(false);
+      exit(1);
+    }
+  }
+
   clFinish(command_queue);
 }
 
@@ -208,8 +254,10 @@ void Thneed::save(const char *filename, bool save_binaries) {
         // buffers allocated with CL_MEM_HOST_WRITE_ONLY, hence this hack
         //hexdump((uint32_t*)val, 0x100);
 
+#if defined(QCOM) || defined(QCOM2)
         // the worst hack in thneed, the flags are at 0x14
         ((uint32_t*)val)[0x14] &= ~CL_MEM_HOST_WRITE_ONLY;
+#endif
         cl_int ret = clEnqueueReadBuffer(command_queue, val, CL_TRUE, 0, sz, buf, 0, NULL, NULL);
         assert(ret == CL_SUCCESS);
       }
@@ -28,7 +28,7 @@ class Thneed;
 class GPUMalloc {
   public:
     GPUMalloc(int size, int fd);
-    ~GPUMalloc();
+    ~GPUMalloc() {}  // TODO: free the GPU malloced area
     void *alloc(int size);
   private:
     uint64_t base;
@@ -43,7 +43,7 @@ class CLQueuedKernel {
                    cl_uint _work_dim,
                    const size_t *_global_work_size,
                    const size_t *_local_work_size);
-    cl_int exec();
+    cl_int exec(cl_event *event = NULL);
     void debug_print(bool verbose);
     int get_arg_num(const char *search_arg_name);
     cl_program program;
@@ -92,7 +92,7 @@ class CachedCommand: public CachedIoctl {
 
 class Thneed {
   public:
-    Thneed(bool do_clinit=false);
+    Thneed(bool do_clinit=false, bool profile=false);
     void stop();
     void execute(float **finputs, float *foutput, bool slow=false);
     void wait();
@@ -107,6 +107,7 @@ class Thneed {
     cl_command_queue command_queue;
     cl_device_id device_id;
     int context_id;
+    bool profile;  // the command queue has CL_QUEUE_PROFILING_ENABLE, for clprofile
 
     // protected?
     int record;
@@ -120,6 +121,8 @@ class Thneed {
     void copy_inputs(float **finputs);
     void copy_output(float *foutput);
     cl_int clexec();
+    // clexec with an event per kernel, for the time each kernel of kq ran on the device in ms
+    vector<double> clprofile();
     vector<shared_ptr<CLQueuedKernel> > kq;
 
     // pending CL kernels
@@ -0,0 +1,51 @@
+#include "selfdrive/modeld/thneed/thneed.h"
+
+#include <cassert>
+
+#include "selfdrive/common/clutil.h"
+#include "selfdrive/common/timing.h"
+
+// thneed on any OpenCL 1.2 device, like pocl on a PC. there are no KGSL ioctls to record, a
+// loaded .thneed is replayed kernel by kernel with clEnqueueNDRangeKernel
+
+Thneed::Thneed(bool do_clinit, bool lprofile) {
+  profile = lprofile;
+  if (do_clinit) clinit();
+  fd = -1;
+  record = 0;
+  timestamp = -1;
+}
+
+void Thneed::stop() {
+  find_inputs_outputs();
+  printf("Thneed::stop: replaying %lu kernels\n", kq.size());
+  ckq.clear();
+  record = 0;
+}
+
+void Thneed::wait() {
+  CL_CHECK(clFinish(command_queue));
+}
+
+void Thneed::execute(float **finputs, float *foutput, bool slow) {
+  uint64_t tb, te;
+  if (record & THNEED_DEBUG) tb = nanos_since_boot();
+
+  // ****** copy inputs
+  copy_inputs(finputs);
+
+  // ****** run kernels
+  for (auto &k : kq) {
+    cl_int ret = k->exec();
+    assert(ret == CL_SUCCESS);
+    if (slow) wait();
+  }
+
+  // ****** copy outputs, the read waits for the kernels
+  copy_output(foutput);
+
+  if (record & THNEED_DEBUG) {
+    te = nanos_since_boot();
+    printf("model exec in %lu us\n", (te-tb)/1000);
+  }
+}
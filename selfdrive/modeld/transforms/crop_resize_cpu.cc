@@ -0,0 +1,167 @@
+#include "selfdrive/modeld/transforms/crop_resize_cpu.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include "selfdrive/common/simd.h"
+
+namespace {
+
+constexpr uint8_t BLACK_Y = 16, BLACK_UV = 128;
+
+// 16.16 fixed point, FixedDiv of libyuv
+inline int fixed_div(int num, int div) {
+  return (int)(((int64_t)num << 16) / div);
+}
+
+// (a * (256 - f) + b * f + 128) >> 8, InterpolateRow of libyuv
+void interpolate_row(const uint8_t *a, const uint8_t *b, int f, uint8_t *out, int n) {
+  const uint16_t fa = 256 - f, fb = f;
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    const u16x16 va = __builtin_convertvector(simd::load<u8x16>(&a[i]), u16x16);
+    const u16x16 vb = __builtin_convertvector(simd::load<u8x16>(&b[i]), u16x16);
+    simd::store(&out[i], __builtin_convertvector((va * fa + vb * fb + 128) >> 8, u8x16));
+  }
+  for (; i < n; ++i) {
+    out[i] = (a[i] * fa + b[i] * fb + 128) >> 8;
+  }
+}
+
+inline bool operator!=(const CropResizeCpu::Rect &a, const CropResizeCpu::Rect &b) {
+  return a.x != b.x || a.y != b.y || a.w != b.w || a.h != b.h;
+}
+
+}  // namespace
+
+CropResizeCpu::CropResizeCpu(int out_width, int out_height) : out_width(out_width), out_height(out_height) {
+  assert(out_width % 2 == 0 && out_height % 2 == 0);
+  y_rows.resize(out_width * 2);
+  uv_row.resize(out_width / 2);
+}
+
+// ScaleSlope and ScalePlaneBilinearDown of libyuv: dst pixels are crop / dst apart, starting
+// half a step in, less half a pixel to center the filter
+void CropResizeCpu::update_map(PlaneMap &map, const Rect &crop, bool mirror, const Rect &dst) {
+  map.crop = crop;
+  map.dst = dst;
+
+  const int dx = fixed_div(crop.w, dst.w);
+  map.col_x.assign((dst.w + 15) & ~15, 0);
+  map.col_f.assign(map.col_x.size(), 0);
+  for (int i = 0, x = (dx >> 1) - 32768; i < dst.w; ++i, x += dx) {
+    int a = x >> 16, f = (x >> 8) & 255;
+    if (a + 1 >= crop.w) {
+      a = crop.w - 1;
+      f = 0;
+    }
+    // the mirrored crop is sampled at the same positions: pixel a is crop.w - 1 - a, and the one
+    // after it is to its left
+    if (mirror && f != 0) {
+      map.col_x[i] = crop.w - 2 - a;
+      map.col_f[i] = 256 - f;
+    } else {
+      map.col_x[i] = mirror ? crop.w - 1 - a : a;
+      map.col_f[i] = f;
+    }
+  }
+
+  const int dy = fixed_div(crop.h, dst.h);
+  const int max_y = (crop.h - 1) << 16;
+  map.rows.resize(dst.h);
+  for (int j = 0, y = std::min((dy >> 1) - 32768, max_y); j < dst.h; ++j, y = std::min(y + dy, max_y)) {
+    map.rows[j] = {.y = (uint16_t)(y >> 16), .f = (uint8_t)((y >> 8) & 255)};
+  }
+}
+
+// dst row `dst_row` of a plane into out_row, which is the full width of the model frame
+void CropResizeCpu::scale_row(const uint8_t *src, int stride, const PlaneMap &map, int dst_row, uint8_t *out_row) {
+  const RowTap &r = map.rows[dst_row];
+  const uint8_t *in = src + (map.crop.y + r.y) * stride + map.crop.x;
+  // one more pixel past the crop, for taps on its last pixel that give it all the weight. it's
+  // a copy of the last one, so every pixel read is initialized
+  uint8_t *row = interpolated.data();
+  if (r.f != 0) {
+    interpolate_row(in, in + stride, r.f, row, map.crop.w);
+  } else {
+    memcpy(row, in, map.crop.w);
+  }
+  row[map.crop.w] = row[map.crop.w - 1];
+
+  uint8_t *out = out_row + map.dst.x;
+  int i = 0;
+  for (; i + 16 <= map.dst.w; i += 16) {
+    // the pairs are gathered one by one, the rest is vector math. a pair is little endian, pixel
+    // x in the low byte
+    const uint16_t *x = &map.col_x[i];
+    u16x16 pairs;
+    for (int k = 0; k < 16; ++k) {
+      uint16_t pair;
+      memcpy(&pair, &row[x[k]], sizeof(pair));
+      pairs[k] = pair;
+    }
+    const u16x16 f = simd::load<u16x16>(&map.col_f[i]);
+    const u16x16 v = ((pairs & 255) * (256 - f) + (pairs >> 8) * f + 128) >> 8;
+    simd::store(&out[i], __builtin_convertvector(v, u8x16));
+  }
+  for (; i < map.dst.w; ++i) {
+    const int x = map.col_x[i], f = map.col_f[i];
+    out[i] = (row[x] * (256 - f) + row[x + 1] * f + 128) >> 8;
+  }
+}
+
+void CropResizeCpu::run(const uint8_t *yuv, int width, int height, const Rect &crop, bool mirror, const Rect &dst, float *out) {
+  // chroma is half the size, rounded up like I420Scale
+  const Rect crop_uv = {crop.x / 2, crop.y / 2, (crop.w + 1) / 2, (crop.h + 1) / 2};
+  const Rect dst_uv = {dst.x / 2, dst.y / 2, (dst.w + 1) / 2, (dst.h + 1) / 2};
+  assert(crop.x >= 0 && crop.y >= 0 && crop.x + crop.w <= width && crop.y + crop.h <= height);
+  assert(crop_uv.x + crop_uv.w <= width / 2 && crop_uv.y + crop_uv.h <= height / 2);
+  assert(dst.x >= 0 && dst.y >= 0 && dst.x + dst.w <= out_width && dst.y + dst.h <= out_height);
+  assert(dst.w <= crop.w && dst.h <= crop.h);
+
+  // the maps only change with the crop
+  if (mirror != this->mirror || crop != y_map.crop || dst != y_map.dst) {
+    this->mirror = mirror;
+    update_map(y_map, crop, mirror, dst);
+    update_map(uv_map, crop_uv, mirror, dst_uv);
+    interpolated.resize(crop.w + 1);
+  }
+
+  const uint8_t *in_y = yuv;
+  const uint8_t *in_u = in_y + width * height;
+  const uint8_t *in_v = in_u + (width / 2) * (height / 2);
+  const int uv_width = out_width / 2;
+  const int plane_size = uv_width * (out_height / 2);
+  const bool full_width = dst.x == 0 && dst.w == out_width;
+
+  // y rows two at a time, split into four planes by the parity of the row and column like
+  // loadyuv.cl, then a row of u and v
+  for (int oy = 0; oy < out_height; oy += 2) {
+    const int r = oy / 2;
+    for (int k = 0; k < 2; ++k) {
+      uint8_t *row = &y_rows[k * out_width];
+      const int dst_row = oy + k - dst.y;
+      if (!full_width || dst_row < 0 || dst_row >= dst.h) {
+        memset(row, BLACK_Y, out_width);
+      }
+      if (dst_row >= 0 && dst_row < dst.h) {
+        scale_row(in_y, width, y_map, dst_row, row);
+      }
+    }
+    simd::deinterleave_to_float(&y_rows[0], &out[0 * plane_size + r * uv_width], &out[2 * plane_size + r * uv_width], uv_width, 128.f, 0.0078125f);
+    simd::deinterleave_to_float(&y_rows[out_width], &out[1 * plane_size + r * uv_width], &out[3 * plane_size + r * uv_width], uv_width, 128.f, 0.0078125f);
+
+    const int dst_row = r - dst_uv.y;
+    const bool inside = dst_row >= 0 && dst_row < dst_uv.h;
+    for (int k = 0; k < 2; ++k) {
+      if (!inside || dst_uv.x > 0 || dst_uv.w < uv_width) {
+        memset(uv_row.data(), BLACK_UV, uv_width);
+      }
+      if (inside) {
+        scale_row(k == 0 ? in_u : in_v, width / 2, uv_map, dst_row, uv_row.data());
+      }
+      simd::bytes_to_float(uv_row.data(), &out[(4 + k) * plane_size + r * uv_width], uv_width, 128.f, 0.0078125f);
+    }
+  }
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Crops a rect of a YUV420 frame, mirrors it if asked and scales it down bilinearly into a rect
+// of the model frame, which is black around it. Writes the model input tensor straight away,
+// in the layout of loadyuv.cl with values normalized to (v - 128) / 128.
+// One pass over the frame for what took crop_yuv, I420Mirror, I420Scale and a lookup table.
+// Each output row interpolates the two source rows it needs into a row buffer that stays in
+// cache, then blends pairs of neighboring pixels of it, 16 output pixels at a time. The sampling
+// positions are those of ScalePlaneBilinearDown in libyuv, with 8 bit fractions like its SIMD
+// versions. Those round a little differently from one version to the next, so the output is
+// within one pixel value of I420Scale.
+class CropResizeCpu {
+public:
+  struct Rect {
+    int x, y, w, h;
+  };
+
+  CropResizeCpu(int out_width, int out_height);
+  // writes out_width * out_height * 3 / 2 floats to out. the crop is scaled down to dst in both
+  // dimensions, or kept at its size
+  void run(const uint8_t *yuv, int width, int height, const Rect &crop, bool mirror, const Rect &dst, float *out);
+
+private:
+  // sampling positions of one plane: the crop columns blended into each dst column, and the
+  // crop rows into each dst row, as offsets into the crop
+  struct RowTap {
+    uint16_t y;
+    uint8_t f;  // weight of the row below, 8 bit
+  };
+  struct PlaneMap {
+    Rect crop, dst;
+    // dst column i blends pixel col_x[i] and the one after it, weighting the latter col_f[i] / 256.
+    // padded to a multiple of 16 columns, to be loaded as vectors
+    std::vector<uint16_t> col_x, col_f;
+    std::vector<RowTap> rows;
+  };
+  static void update_map(PlaneMap &map, const Rect &crop, bool mirror, const Rect &dst);
+  void scale_row(const uint8_t *src, int stride, const PlaneMap &map, int dst_row, uint8_t *out_row);
+
+  const int out_width, out_height;
+  bool mirror = false;
+  PlaneMap y_map, uv_map;
+  std::vector<uint8_t> interpolated, y_rows, uv_row;
+};
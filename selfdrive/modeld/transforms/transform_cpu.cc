@@ -0,0 +1,146 @@
+#include "selfdrive/modeld/transforms/transform_cpu.h"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+
+#include "selfdrive/common/simd.h"
+#include "selfdrive/common/util.h"
+
+namespace {
+
+// same fixed point as transform.cl
+constexpr int INTER_BITS = 5;
+constexpr int INTER_TAB_SIZE = 1 << INTER_BITS;
+constexpr int INTER_REMAP_COEF_BITS = 15;
+constexpr int INTER_REMAP_COEF_SCALE = 1 << INTER_REMAP_COEF_BITS;
+
+inline int16_t saturate_short(int v) {
+  return std::clamp(v, -32768, 32767);
+}
+
+// bilinear weights of the top left, top right, bottom left and bottom right source pixels
+// for every subpixel position, rounded and saturated like convert_short_sat_rte
+const std::array<std::array<int16_t, 4>, INTER_TAB_SIZE * INTER_TAB_SIZE> &weight_table() {
+  static const auto table = []() {
+    std::array<std::array<int16_t, 4>, INTER_TAB_SIZE * INTER_TAB_SIZE> t;
+    for (int ay = 0; ay < INTER_TAB_SIZE; ++ay) {
+      for (int ax = 0; ax < INTER_TAB_SIZE; ++ax) {
+        const float taby = 1.f / INTER_TAB_SIZE * ay, tabx = 1.f / INTER_TAB_SIZE * ax;
+        t[ay * INTER_TAB_SIZE + ax] = {
+          saturate_short(lrintf((1.0f - taby) * (1.0f - tabx) * INTER_REMAP_COEF_SCALE)),
+          saturate_short(lrintf((1.0f - taby) * tabx * INTER_REMAP_COEF_SCALE)),
+          saturate_short(lrintf(taby * (1.0f - tabx) * INTER_REMAP_COEF_SCALE)),
+          saturate_short(lrintf(taby * tabx * INTER_REMAP_COEF_SCALE)),
+        };
+      }
+    }
+    return t;
+  }();
+  return table;
+}
+
+// one output row of warpPerspective, src is a plane `step` pixels wide
+template <typename Tap>
+void warp_row(const uint8_t *src, int step, const Tap *taps, int width, uint8_t *dst) {
+  const auto &weights = weight_table();
+  for (int x = 0; x < width; ++x) {
+    const Tap &t = taps[x];
+    const int16_t *w = weights[t.weights].data();
+    const int o = t.offset;
+    int val;
+    if (t.inside == 0xf) {
+      val = src[o] * w[0] + src[o + 1] * w[1] + src[o + step] * w[2] + src[o + step + 1] * w[3];
+    } else {
+      // pixels outside the frame are black
+      val = 0;
+      if (t.inside & 1) val += src[o] * w[0];
+      if (t.inside & 2) val += src[o + 1] * w[1];
+      if (t.inside & 4) val += src[o + step] * w[2];
+      if (t.inside & 8) val += src[o + step + 1] * w[3];
+    }
+    dst[x] = std::clamp((val + (1 << (INTER_REMAP_COEF_BITS - 1))) >> INTER_REMAP_COEF_BITS, 0, 255);
+  }
+}
+
+}  // namespace
+
+TransformCpu::TransformCpu(int out_width, int out_height) : out_width(out_width), out_height(out_height) {
+  assert(out_width % 2 == 0 && out_height % 2 == 0);
+  y_map.resize(out_width * out_height);
+  uv_map.resize((out_width / 2) * (out_height / 2));
+  rows.resize(out_width * out_height);
+}
+
+// same math as warpPerspective in transform.cl, for output rows [start, end)
+void TransformCpu::update_map(Tap *map, int in_width, int in_height, int out_width, const mat3 &m, int start, int end) {
+  const float *M = m.v;
+  for (int dy = start; dy < end; ++dy) {
+    for (int dx = 0; dx < out_width; ++dx) {
+      const float X0 = M[0] * dx + M[1] * dy + M[2];
+      const float Y0 = M[3] * dx + M[4] * dy + M[5];
+      float W = M[6] * dx + M[7] * dy + M[8];
+      W = W != 0.0f ? INTER_TAB_SIZE / W : 0.0f;
+      // rint, kept in the int range. the kernel leaves that to the device
+      const int X = std::clamp(std::nearbyint(X0 * W), -1e9f, 1e9f);
+      const int Y = std::clamp(std::nearbyint(Y0 * W), -1e9f, 1e9f);
+
+      const int sx = saturate_short(X >> INTER_BITS), sy = saturate_short(Y >> INTER_BITS);
+      const bool x0 = sx >= 0 && sx < in_width, x1 = sx + 1 >= 0 && sx + 1 < in_width;
+      const bool y0 = sy >= 0 && sy < in_height, y1 = sy + 1 >= 0 && sy + 1 < in_height;
+
+      Tap &t = map[dy * out_width + dx];
+      t.offset = sy * in_width + sx;
+      t.weights = (Y & (INTER_TAB_SIZE - 1)) * INTER_TAB_SIZE + (X & (INTER_TAB_SIZE - 1));
+      t.inside = (x0 && y0) | (x1 && y0) << 1 | (x0 && y1) << 2 | (x1 && y1) << 3;
+    }
+  }
+}
+
+void TransformCpu::run(const uint8_t *yuv, int width, int height, const mat3 &m, float *out) {
+  assert(width % 2 == 0 && height % 2 == 0);
+  // the maps only change with the calibration
+  const bool new_map = width != in_width || height != in_height || memcmp(m.v, projection.v, sizeof(m.v)) != 0;
+  if (new_map) {
+    in_width = width;
+    in_height = height;
+    projection = m;
+  }
+  // in and out uv is half the size of y, like transform_queue
+  const mat3 projection_uv = transform_scale_buffer(m, 0.5);
+
+  // a band warps the rows of the maps it updated, one dispatch to the pool per frame
+  util::parallel_for(out_height, 2, [&](int start, int end) {
+    if (new_map) {
+      update_map(y_map.data(), in_width, in_height, out_width, projection, start, end);
+      update_map(uv_map.data(), in_width / 2, in_height / 2, out_width / 2, projection_uv, start / 2, end / 2);
+    }
+    run_rows(yuv, out, start, end);
+  });
+}
+
+// y rows [start, end) and their uv rows. loadyuv.cl splits y into four planes by the parity of
+// the row and column, then u and v follow as they are
+void TransformCpu::run_rows(const uint8_t *yuv, float *out, int start, int end) {
+  const int uv_width = out_width / 2;
+  const int plane_size = uv_width * (out_height / 2);
+  const uint8_t *in_y = yuv;
+  const uint8_t *in_u = in_y + in_width * in_height;
+  const uint8_t *in_v = in_u + (in_width / 2) * (in_height / 2);
+
+  uint8_t *row = &rows[start * out_width];
+  for (int oy = start; oy < end; oy += 2) {
+    const int r = oy / 2;
+    warp_row(in_y, in_width, &y_map[oy * out_width], out_width, &row[0]);
+    warp_row(in_y, in_width, &y_map[(oy + 1) * out_width], out_width, &row[out_width]);
+    simd::deinterleave_to_float(&row[0], &out[0 * plane_size + r * uv_width], &out[2 * plane_size + r * uv_width], uv_width);
+    simd::deinterleave_to_float(&row[out_width], &out[1 * plane_size + r * uv_width], &out[3 * plane_size + r * uv_width], uv_width);
+
+    warp_row(in_u, in_width / 2, &uv_map[r * uv_width], uv_width, &row[0]);
+    warp_row(in_v, in_width / 2, &uv_map[r * uv_width], uv_width, &row[uv_width]);
+    simd::bytes_to_float(&row[0], &out[4 * plane_size + r * uv_width], uv_width);
+    simd::bytes_to_float(&row[uv_width], &out[5 * plane_size + r * uv_width], uv_width);
+  }
+}
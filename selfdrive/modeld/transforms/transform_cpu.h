@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "selfdrive/common/mat.h"
+
+// CPU port of transform.cl followed by loadyuv.cl, for hosts without an OpenCL GPU.
+// Warps a YUV420 frame to the model input size and packs it straight into the float tensor,
+// in row bands processed by one thread per core. The source pixel and bilinear weights of each
+// output pixel are computed once per projection, so a frame is a table lookup per pixel.
+// Matches the kernels to within one pixel value, except where the float math of the
+// device rounds a sample position differently.
+class TransformCpu {
+public:
+  TransformCpu(int out_width, int out_height);
+  // writes out_width * out_height * 3 / 2 floats to out, in the layout of loadyuv.cl
+  void run(const uint8_t *yuv, int in_width, int in_height, const mat3 &projection, float *out);
+
+private:
+  struct Tap {
+    int32_t offset;   // of the top left source pixel
+    uint16_t weights; // row in the weight table, the subpixel position
+    uint8_t inside;   // a bit per source pixel inside the frame: top left, top right, bottom left, bottom right
+  };
+  static void update_map(Tap *map, int in_width, int in_height, int out_width, const mat3 &m, int start, int end);
+  void run_rows(const uint8_t *yuv, float *out, int start, int end);
+
+  const int out_width, out_height;
+  int in_width = 0, in_height = 0;
+  mat3 projection = {};
+  std::vector<Tap> y_map, uv_map;
+  // warped rows before they're converted to floats, a band of rows uses the two at its start
+  std::vector<uint8_t> rows;
+};
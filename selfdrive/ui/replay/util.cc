@@ -212,12 +212,15 @@ std::string decompressBZ2(const std::byte *in, size_t in_size, std::atomic<bool>
   strm.next_in = (char *)in;
   strm.avail_in = in_size;
   std::string out(in_size * 5, '\0');
+  size_t out_pos = 0;
+  size_t stream_end_pos = 0;  // end of the output of the last complete stream
   do {
-    strm.next_out = (char *)(&out[strm.total_out_lo32]);
-    strm.avail_out = out.size() - strm.total_out_lo32;
+    strm.next_out = (char *)(&out[out_pos]);
+    strm.avail_out = out.size() - out_pos;
 
     const char *prev_write_pos = strm.next_out;
     bzerror = BZ2_bzDecompress(&strm);
+    out_pos = strm.next_out - out.data();
     if (bzerror == BZ_OK && prev_write_pos == strm.next_out) {
       // content is corrupt
       bzerror = BZ_STREAM_END;
@@ -225,14 +228,37 @@ std::string decompressBZ2(const std::byte *in, size_t in_size, std::atomic<bool>
       break;
     }
 
-    if (bzerror == BZ_OK && strm.avail_in > 0 && strm.avail_out == 0) {
+    if (bzerror == BZ_STREAM_END) {
+      stream_end_pos = out_pos;
+    }
+    if (bzerror == BZ_STREAM_END && strm.avail_in > 0) {
+      // chunked logs are a sequence of bz2 streams, continue with the next one
+      char *next_in = strm.next_in;
+      unsigned int avail_in = strm.avail_in;
+      BZ2_bzDecompressEnd(&strm);
+      strm = {};
+      bzerror = BZ2_bzDecompressInit(&strm, 0, 0);
+      assert(bzerror == BZ_OK);
+      strm.next_in = next_in;
+      strm.avail_in = avail_in;
+    }
+
+    if (bzerror == BZ_OK && out_pos == out.size()) {
       out.resize(out.size() * 2);
     }
   } while (bzerror == BZ_OK && !(abort && *abort));
 
   BZ2_bzDecompressEnd(&strm);
-  if (bzerror == BZ_STREAM_END && !(abort && *abort)) {
-    out.resize(strm.total_out_lo32);
+  if (abort && *abort) return {};
+
+  if (bzerror == BZ_STREAM_END) {
+    out.resize(out_pos);
+    return out;
+  }
+  if ((bzerror == BZ_DATA_ERROR || bzerror == BZ_DATA_ERROR_MAGIC) && stream_end_pos > 0) {
+    // garbage or zeros after the last complete chunk, e.g. a chunk cut off by a power loss
+    std::cout << "decompressBZ2 error : corrupt data after " << stream_end_pos << " bytes, keeping the complete chunks" << std::endl;
+    out.resize(stream_end_pos);
     return out;
   }
   return {};
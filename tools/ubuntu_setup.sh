@@ -63,6 +63,7 @@ function install_ubuntu_common_requirements() {
     ocl-icd-libopencl1 \
     ocl-icd-opencl-dev \
     clinfo \
+    pocl-opencl-icd \
     python-dev \
     python3-pip \
     qml-module-qtquick2 \